@@ -0,0 +1,357 @@
+#include "CaptureLoop.h"
+#include "Log.h"
+
+#ifdef __linux__
+
+#include <pcap.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// The parts of a link's state that decide whether it's worth trying to open again
+const unsigned LINK_FLAGS = IFF_UP | IFF_RUNNING;
+
+// Recorded for devices that don't exist, so any notification about them counts as a change
+const unsigned NO_LINK = ~0u;
+
+namespace {
+
+unsigned linkFlags(const std::string &name)
+{
+	auto fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		return NO_LINK;
+	}
+
+	ifreq req = {};
+	strncpy(req.ifr_name, name.c_str(), IFNAMSIZ - 1);
+	auto flags = ioctl(fd, SIOCGIFFLAGS, &req) == -1 ? NO_LINK : unsigned(req.ifr_flags) & LINK_FLAGS;
+	close(fd);
+	return flags;
+}
+
+} // namespace
+
+CaptureLoop::CaptureLoop(const std::string &filter, PacketCapture::Callback::Factory callbackFactory, const std::string &deviceName)
+	: _filter(filter),
+	  _callbackFactory(callbackFactory),
+	  _deviceName(deviceName),
+	  _epoll(-1),
+	  _netlink(-1),
+	  _wake(-1),
+	  _handles(),
+	  _failed(),
+	  _thread(),
+	  _mu(),
+	  _done(),
+	  _finished(false)
+{
+}
+
+CaptureLoop::~CaptureLoop()
+{
+	Stop();
+
+	if (_netlink != -1) {
+		close(_netlink);
+	}
+	if (_wake != -1) {
+		close(_wake);
+	}
+	if (_epoll != -1) {
+		close(_epoll);
+	}
+}
+
+bool CaptureLoop::Start()
+{
+	CHECK(_callbackFactory && !_thread.joinable(), false);
+
+	_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (_epoll == -1) {
+		LogError("epoll_create1: %s", strerror(errno));
+		return false;
+	}
+
+	// Used by Stop to wake the loop
+	_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_wake == -1) {
+		LogError("eventfd: %s", strerror(errno));
+		return false;
+	}
+
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = &_wake;
+	if (epoll_ctl(_epoll, EPOLL_CTL_ADD, _wake, &ev) == -1) {
+		LogError("epoll_ctl(eventfd): %s", strerror(errno));
+		return false;
+	}
+
+	// Listen for links coming up so new devices are noticed without polling
+	if (_deviceName.empty()) {
+		_netlink = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+		if (_netlink == -1) {
+			LogError("socket(NETLINK_ROUTE): %s", strerror(errno));
+			return false;
+		}
+
+		sockaddr_nl addr = {};
+		addr.nl_family = AF_NETLINK;
+		addr.nl_groups = RTMGRP_LINK;
+		if (bind(_netlink, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+			LogError("bind(NETLINK_ROUTE): %s", strerror(errno));
+			return false;
+		}
+
+		ev.data.ptr = &_netlink;
+		if (epoll_ctl(_epoll, EPOLL_CTL_ADD, _netlink, &ev) == -1) {
+			LogError("epoll_ctl(netlink): %s", strerror(errno));
+			return false;
+		}
+	}
+
+	_thread = std::thread([this]() { Run(); });
+	return true;
+}
+
+bool CaptureLoop::Stop(int timeoutMs)
+{
+	if (!_thread.joinable()) {
+		return true;
+	}
+
+	uint64_t one = 1;
+	if (write(_wake, &one, sizeof(one)) != sizeof(one)) {
+		LogError("write(eventfd): %s", strerror(errno));
+	}
+
+	if (timeoutMs >= 0) {
+		std::unique_lock<std::mutex> lock(_mu);
+		if (!_done.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return _finished; })) {
+			LogWarning("capture loop still running after %d ms", timeoutMs);
+			return false;
+		}
+	}
+
+	_thread.join();
+	return true;
+}
+
+void CaptureLoop::Run()
+{
+	// One callback (and so one parser state) for every device
+	auto callback = _callbackFactory();
+	Scan(callback.get());
+
+	const int MAX_EVENTS = 16;
+	epoll_event events[MAX_EVENTS];
+	std::vector<std::string> failed;
+
+	auto running = true;
+	while (running) {
+		auto n = epoll_wait(_epoll, events, MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LogError("epoll_wait: %s", strerror(errno));
+			break;
+		}
+
+		auto rescan = false;
+		for (auto i = 0; i < n; i++) {
+			auto ptr = events[i].data.ptr;
+			if (ptr == &_wake) {
+				running = false;
+			} else if (ptr == &_netlink) {
+				rescan |= DrainNetlink();
+			} else {
+				// Read everything that's ready without blocking
+				auto handle = static_cast<Handle *>(ptr);
+				if (pcap_dispatch(handle->pcap, -1, PacketCapture::Handler, (uint8_t *)&handle->context) < 0) {
+					LogError("pcap_dispatch(%s): %s", handle->name.c_str(), pcap_geterr(handle->pcap));
+					failed.push_back(handle->name);
+				} else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+					failed.push_back(handle->name);
+				}
+			}
+		}
+
+		// Close after the batch since later events may refer to the same handle
+		for (auto &name : failed) {
+			Close(name);
+		}
+		failed.clear();
+
+		if (rescan && running) {
+			Scan(callback.get());
+		}
+	}
+
+	while (!_handles.empty()) {
+		Close(_handles.begin()->first);
+	}
+
+	// Flush anything still buffered by the parser before reporting that we're done
+	callback.reset();
+	LogVerbose("capture loop exited");
+
+	std::lock_guard<std::mutex> lock(_mu);
+	_finished = true;
+	_done.notify_all();
+}
+
+void CaptureLoop::Scan(PacketCapture::Callback *callback)
+{
+	if (!_deviceName.empty()) {
+		if (_handles.find(_deviceName) == _handles.end() && _failed.find(_deviceName) == _failed.end()) {
+			Open(_deviceName, callback);
+		}
+		return;
+	}
+
+	char errbuf[PCAP_ERRBUF_SIZE];
+	pcap_if_t *alldevs;
+	if (pcap_findalldevs(&alldevs, errbuf) == -1) {
+		LogError("pcap_findalldevs: %s", errbuf);
+		return;
+	}
+
+	for (auto dev = alldevs; dev != nullptr; dev = dev->next) {
+		// Skip the "any" pseudo-device since every frame would be seen twice
+		if (std::string(dev->name) == "any") {
+			continue;
+		}
+
+		if (_handles.find(dev->name) == _handles.end() && _failed.find(dev->name) == _failed.end()) {
+			Open(dev->name, callback);
+		}
+	}
+
+	pcap_freealldevs(alldevs);
+}
+
+void CaptureLoop::Open(const std::string &name, PacketCapture::Callback *callback)
+{
+	char errbuf[PCAP_ERRBUF_SIZE] = "";
+
+	// Not retried until its link state changes (see DrainNetlink)
+	_failed[name] = linkFlags(name);
+
+	auto pcap = PacketCapture::OpenLive(name);
+	if (!pcap) {
+		return;
+	}
+
+	if (pcap_setnonblock(pcap, 1, errbuf) == -1) {
+		LogError("pcap_setnonblock(%s): %s", name.c_str(), errbuf);
+		pcap_close(pcap);
+		return;
+	}
+
+	if (!PacketCapture::SetFilter(pcap, _filter)) {
+		pcap_close(pcap);
+		return;
+	}
+
+	auto fd = pcap_get_selectable_fd(pcap);
+	if (fd == -1) {
+		LogError("pcap_get_selectable_fd(%s): not supported", name.c_str());
+		pcap_close(pcap);
+		return;
+	}
+
+	std::unique_ptr<Handle> handle(new Handle);
+	handle->name = name;
+	handle->pcap = pcap;
+	PacketCapture::Context context = { callback, pcap_datalink(pcap), pcap, nullptr, 0, 0 };
+	handle->context = context;
+	handle->context.device = handle->name.c_str();
+
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = handle.get();
+	if (epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		LogError("epoll_ctl(%s): %s", name.c_str(), strerror(errno));
+		pcap_close(pcap);
+		return;
+	}
+
+	LogMessage("listening to %s (link type %d)", name.c_str(), handle->context.linkType);
+	_handles[name] = std::move(handle);
+	_failed.erase(name);
+}
+
+void CaptureLoop::Close(const std::string &name)
+{
+	auto it = _handles.find(name);
+	if (it == _handles.end()) {
+		return;
+	}
+
+	// Closing the fd removes it from the epoll set
+	LogVerbose("closing %s", name.c_str());
+	PacketCapture::CheckDrops(it->second->context, true);
+	pcap_close(it->second->pcap);
+	_handles.erase(it);
+}
+
+bool CaptureLoop::DrainNetlink()
+{
+	auto rescan = false;
+
+	char buf[8192];
+	while (1) {
+		auto len = recv(_netlink, buf, sizeof(buf), 0);
+		if (len <= 0) {
+			if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				LogError("recv(netlink): %s", strerror(errno));
+			}
+			break;
+		}
+
+		for (auto msg = reinterpret_cast<nlmsghdr *>(buf); NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len)) {
+			if (msg->nlmsg_type != RTM_NEWLINK) {
+				continue;
+			}
+
+			auto info = static_cast<const ifinfomsg *>(NLMSG_DATA(msg));
+			std::string name;
+			auto attrLen = int(IFLA_PAYLOAD(msg));
+			for (auto attr = IFLA_RTA(info); RTA_OK(attr, attrLen); attr = RTA_NEXT(attr, attrLen)) {
+				if (attr->rta_type == IFLA_IFNAME) {
+					name = static_cast<const char *>(RTA_DATA(attr));
+				}
+			}
+
+			// Notifications also come for address and other changes, so only
+			// devices that are new or whose link came up (or went down) matter
+			if (name.empty() || _handles.find(name) != _handles.end() || (!_deviceName.empty() && name != _deviceName)) {
+				continue;
+			}
+			auto failed = _failed.find(name);
+			if (failed == _failed.end()) {
+				rescan = true;
+			} else if ((info->ifi_flags & LINK_FLAGS) != failed->second) {
+				LogVerbose("%s changed state, trying it again", name.c_str());
+				_failed.erase(failed);
+				rescan = true;
+			}
+		}
+	}
+
+	return rescan;
+}
+
+#endif // __linux__
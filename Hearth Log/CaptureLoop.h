@@ -0,0 +1,65 @@
+#pragma once
+
+#include "PacketCapture.h"
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+
+// Linux capture engine: every device is opened non-blocking and multiplexed
+// with epoll on a single thread feeding a single callback. Devices that
+// appear later are picked up from netlink link notifications instead of
+// polling, and devices that go away are closed when their handle errors.
+// A device that can't be opened is only tried again once its link state
+// changes.
+class CaptureLoop
+{
+public:
+	// An empty deviceName listens to every device (except "any")
+	CaptureLoop(const std::string &filter, PacketCapture::Callback::Factory callbackFactory, const std::string &deviceName);
+	~CaptureLoop();
+
+	bool Start();
+
+	// Waits up to timeoutMs (forever if negative) for the loop to exit and
+	// destroy its callback. Returns false if it's still running.
+	bool Stop(int timeoutMs = -1);
+
+private:
+	struct Handle
+	{
+		std::string name;
+		pcap_t *pcap;
+		PacketCapture::Context context;
+	};
+
+	const std::string _filter;
+	const PacketCapture::Callback::Factory _callbackFactory;
+	const std::string _deviceName;
+
+	int _epoll;
+	int _netlink;
+	int _wake;
+	std::map<std::string, std::unique_ptr<Handle>> _handles;
+	std::map<std::string, unsigned> _failed; // link state of devices that couldn't be opened
+	std::thread _thread;
+	std::mutex _mu;
+	std::condition_variable _done;
+	bool _finished;
+
+	void Run();
+	void Scan(PacketCapture::Callback *callback);
+	void Open(const std::string &name, PacketCapture::Callback *callback);
+	void Close(const std::string &name);
+	bool DrainNetlink();
+
+	CaptureLoop(const CaptureLoop &);
+	CaptureLoop &operator=(const CaptureLoop &);
+};
+
+#endif // __linux__
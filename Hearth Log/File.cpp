@@ -0,0 +1,374 @@
+#include "File.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+
+namespace {
+
+#ifdef _WIN32
+const char SEPARATOR = '\\';
+
+std::wstring widen(const std::string &s)
+{
+	if (s.empty()) {
+		return std::wstring();
+	}
+	auto size = MultiByteToWideChar(CP_UTF8, 0, s.data(), int(s.size()), nullptr, 0);
+	std::wstring w(size, 0);
+	MultiByteToWideChar(CP_UTF8, 0, s.data(), int(s.size()), &w[0], size);
+	return w;
+}
+
+std::string narrow(const std::wstring &w)
+{
+	if (w.empty()) {
+		return std::string();
+	}
+	auto size = WideCharToMultiByte(CP_UTF8, 0, w.data(), int(w.size()), nullptr, 0, nullptr, nullptr);
+	std::string s(size, 0);
+	WideCharToMultiByte(CP_UTF8, 0, w.data(), int(w.size()), &s[0], size, nullptr, nullptr);
+	return s;
+}
+
+FILE *openFile(const std::string &path, const wchar_t *mode)
+{
+	return _wfopen(widen(path).c_str(), mode);
+}
+
+// Creates a file for writing, failing (with errno EEXIST) if it already exists
+FILE *createFile(const std::string &path)
+{
+	auto fd = _wopen(widen(path).c_str(), _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+	if (fd == -1) {
+		return nullptr;
+	}
+	auto f = _fdopen(fd, "wb");
+	if (!f) {
+		_close(fd);
+	}
+	return f;
+}
+#else
+const char SEPARATOR = '/';
+
+FILE *openFile(const std::string &path, const char *mode)
+{
+	return fopen(path.c_str(), mode);
+}
+
+FILE *createFile(const std::string &path)
+{
+	auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd == -1) {
+		return nullptr;
+	}
+	auto f = fdopen(fd, "wb");
+	if (!f) {
+		close(fd);
+	}
+	return f;
+}
+#endif
+
+bool isSeparator(char c)
+{
+#ifdef _WIN32
+	return c == '\\' || c == '/';
+#else
+	return c == '/';
+#endif
+}
+
+} // namespace
+
+std::string file::Join(const std::string &dir, const std::string &name)
+{
+	if (dir.empty() || isSeparator(dir[dir.size() - 1])) {
+		return dir + name;
+	}
+	return dir + SEPARATOR + name;
+}
+
+bool file::MakeDirs(const std::string &dir)
+{
+	if (dir.empty() || DirExists(dir)) {
+		return true;
+	}
+
+	// Create the parent first
+	auto end = dir.size();
+	while (end > 0 && isSeparator(dir[end - 1])) {
+		end--;
+	}
+	auto start = end;
+	while (start > 0 && !isSeparator(dir[start - 1])) {
+		start--;
+	}
+	if (start > 1 && !MakeDirs(dir.substr(0, start - 1))) {
+		return false;
+	}
+
+#ifdef _WIN32
+	return _wmkdir(widen(dir).c_str()) == 0 || errno == EEXIST;
+#else
+	return mkdir(dir.c_str(), 0777) == 0 || errno == EEXIST;
+#endif
+}
+
+bool file::Exists(const std::string &path)
+{
+#ifdef _WIN32
+	auto attributes = GetFileAttributesW(widen(path).c_str());
+	return attributes != INVALID_FILE_ATTRIBUTES && !(attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+#endif
+}
+
+bool file::DirExists(const std::string &path)
+{
+#ifdef _WIN32
+	auto attributes = GetFileAttributesW(widen(path).c_str());
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+bool file::Rename(const std::string &from, const std::string &to)
+{
+#ifdef _WIN32
+	return MoveFileExW(widen(from).c_str(), widen(to).c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+bool file::Remove(const std::string &path)
+{
+#ifdef _WIN32
+	return _wremove(widen(path).c_str()) == 0;
+#else
+	return unlink(path.c_str()) == 0;
+#endif
+}
+
+std::vector<std::string> file::List(const std::string &dir, const std::string &suffix)
+{
+	std::vector<std::string> names;
+	auto matches = [&suffix](const std::string &name) {
+		return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+	};
+
+#ifdef _WIN32
+	WIN32_FIND_DATAW data;
+	auto find = FindFirstFileW(widen(Join(dir, "*")).c_str(), &data);
+	if (find == INVALID_HANDLE_VALUE) {
+		return names;
+	}
+	do {
+		auto name = narrow(data.cFileName);
+		if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && matches(name)) {
+			names.push_back(name);
+		}
+	} while (FindNextFileW(find, &data));
+	FindClose(find);
+#else
+	auto d = opendir(dir.c_str());
+	if (!d) {
+		return names;
+	}
+	while (auto entry = readdir(d)) {
+		std::string name(entry->d_name);
+		if (matches(name) && Exists(Join(dir, name))) {
+			names.push_back(name);
+		}
+	}
+	closedir(d);
+#endif
+	return names;
+}
+
+bool file::Read(const std::string &path, std::vector<uint8_t> &data)
+{
+#ifdef _WIN32
+	auto f = openFile(path, L"rb");
+#else
+	auto f = openFile(path, "rb");
+#endif
+	if (!f) {
+		return false;
+	}
+
+	data.clear();
+	uint8_t buffer[64 * 1024];
+	size_t size;
+	while ((size = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		data.insert(data.end(), buffer, buffer + size);
+	}
+	auto ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+bool file::Write(const std::string &path, const uint8_t *data, size_t size)
+{
+	Output out;
+	return out.Open(path) && out.Write(data, size) && out.Close();
+}
+
+file::Output::Output()
+	: _file(nullptr),
+	  _length(0)
+{
+}
+
+file::Output::~Output()
+{
+	Close();
+}
+
+bool file::Output::Open(const std::string &path, bool exclusive)
+{
+	Close();
+	if (exclusive) {
+		_file = createFile(path);
+	} else {
+#ifdef _WIN32
+		_file = openFile(path, L"wb");
+#else
+		_file = openFile(path, "wb");
+#endif
+	}
+	_length = 0;
+	return _file != nullptr;
+}
+
+bool file::Output::Write(const void *data, size_t size)
+{
+	if (!_file || fwrite(data, 1, size, _file) != size) {
+		return false;
+	}
+	_length += size;
+	return true;
+}
+
+bool file::Output::Sync()
+{
+	if (!_file || fflush(_file) != 0) {
+		return false;
+	}
+#ifdef _WIN32
+	return _commit(_fileno(_file)) == 0;
+#else
+	return fsync(fileno(_file)) == 0;
+#endif
+}
+
+bool file::Output::Close()
+{
+	if (!_file) {
+		return true;
+	}
+	auto ok = fclose(_file) == 0;
+	_file = nullptr;
+	return ok;
+}
+
+file::Mapping::Mapping()
+	: _data(nullptr),
+	  _size(0)
+#ifdef _WIN32
+	  , _mapping(nullptr)
+#endif
+{
+}
+
+file::Mapping::~Mapping()
+{
+	Close();
+}
+
+bool file::Mapping::Open(const std::string &path)
+{
+	Close();
+#ifdef _WIN32
+	auto file = CreateFileW(widen(path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	auto ok = GetFileSizeEx(file, &size) != 0;
+	if (ok && size.QuadPart > 0) {
+		// The mapping keeps the file open
+		_mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		auto view = _mapping ? MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+		if (view) {
+			_data = static_cast<const uint8_t *>(view);
+			_size = size_t(size.QuadPart);
+		} else {
+			ok = false;
+		}
+	}
+	CloseHandle(file);
+#else
+	auto fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	auto ok = fstat(fd, &st) == 0;
+	if (ok && st.st_size > 0) {
+		// The mapping stays valid after the file is closed
+		auto view = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+		if (view != MAP_FAILED) {
+			madvise(view, size_t(st.st_size), MADV_SEQUENTIAL); // read once, front to back
+			_data = static_cast<const uint8_t *>(view);
+			_size = size_t(st.st_size);
+		} else {
+			ok = false;
+		}
+	}
+	close(fd);
+#endif
+	if (!ok) {
+		Close();
+	}
+	return ok;
+}
+
+void file::Mapping::Close()
+{
+#ifdef _WIN32
+	if (_data) {
+		UnmapViewOfFile(_data);
+	}
+	if (_mapping) {
+		CloseHandle(_mapping);
+		_mapping = nullptr;
+	}
+#else
+	if (_data) {
+		munmap(const_cast<uint8_t *>(_data), _size);
+	}
+#endif
+	_data = nullptr;
+	_size = 0;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include "range.h"
+#include <string>
+#include <vector>
+
+// The little file handling the capture core needs, without wxWidgets.
+// Paths are UTF-8.
+namespace file {
+
+std::string Join(const std::string &dir, const std::string &name);
+
+// Creates the directory and any missing parents
+bool MakeDirs(const std::string &dir);
+
+bool Exists(const std::string &path);
+bool DirExists(const std::string &path);
+
+// Replaces the destination if it exists
+bool Rename(const std::string &from, const std::string &to);
+bool Remove(const std::string &path);
+
+// Names (not paths) of the files in dir ending with suffix
+std::vector<std::string> List(const std::string &dir, const std::string &suffix);
+
+bool Read(const std::string &path, std::vector<uint8_t> &data);
+
+// Replaces the file's contents
+bool Write(const std::string &path, const uint8_t *data, size_t size);
+
+// A file being written
+class Output
+{
+public:
+	Output();
+	~Output();
+
+	// With exclusive set an existing file isn't truncated, and Open fails with
+	// errno set to EEXIST
+	bool Open(const std::string &path, bool exclusive = false);
+	bool IsOpen() const { return _file != nullptr; }
+
+	bool Write(const void *data, size_t size);
+
+	// Pushes everything written so far to the disk
+	bool Sync();
+
+	bool Close();
+
+	uint64_t Length() const { return _length; }
+
+private:
+	FILE *_file;
+	uint64_t _length;
+
+	Output(const Output &);
+	Output &operator=(const Output &);
+};
+
+// A file mapped read-only into memory, so it can be used without copying it
+class Mapping
+{
+public:
+	Mapping();
+	~Mapping();
+
+	bool Open(const std::string &path);
+	void Close();
+
+	std::range<const uint8_t *> Data() const { return std::make_range(_data, _data + _size); }
+
+private:
+	const uint8_t *_data;
+	size_t _size;
+#ifdef _WIN32
+	void *_mapping; // HANDLE
+#endif
+
+	Mapping(const Mapping &);
+	Mapping &operator=(const Mapping &);
+};
+
+} // namespace file
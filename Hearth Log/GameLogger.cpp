@@ -1,151 +1,182 @@
-// wx #includes must come first to prevent secure function warning from wxcrt.h
-#include <wx/filename.h>
-#include <wx/log.h>
-#include <wx/wfstream.h>
-#include <wx/zstream.h>
-
-#include "HearthLogApp.h"
-#include "Helper.h"
+#include "LogWriter.h"
+#include "MessageArena.h"
+#include "WriterPool.h"
+#include "Log.h"
 
 #include "GameLogger.h"
 
 #include <algorithm>
+#include <cstring>
 
 template <typename T> void swap_clear(T &v) { if (!v.empty()) { T x; v.swap(x); } }
 
-class GameLogger::Log
+// Messages may sit anywhere in a packet, so their headers aren't necessarily aligned
+int32_t headerField(std::range<const uint8_t *> message, size_t i)
 {
-	typedef std::vector<uint8_t> Bytes;
-	typedef std::pair<int64_t, Bytes> Message;
-	typedef std::vector<Message> MessageList;
+	int32_t value;
+	memcpy(&value, message.begin() + 4 * i, sizeof(value));
+	return value;
+}
+
+// Message header sanity limits
+const uint32_t MAX_TYPE = 1000;
+const uint32_t MAX_SIZE = 8000;
 
+// Consecutive plausible headers needed to lock onto the framing of a stream
+// picked up mid-connection, and how much data to hold while looking for them.
+const int RESYNC_HEADERS = 3;
+const size_t RESYNC_LIMIT = 64 * 1024;
+
+// Messages are collected in slabs of this size and written out once there
+// are FLUSH_SIZE bytes of them, or the oldest has waited FLUSH_INTERVAL (in
+// capture time) so a crash doesn't lose it.
+const size_t SLAB_SIZE = 64 * 1024;
+const size_t FLUSH_SIZE = 4 * SLAB_SIZE;
+const int64_t FLUSH_INTERVAL = int64_t(30e9);
+
+// Compression and file I/O are left to the WriterPool so they never hold up capture
+class GameLogger::Log
+{
 public:
-	Log(std::string name, int64_t nanotime)
-		: _name(std::move(name))
+	Log(std::string name, int64_t nanotime, WriterPool::SavedCallback saved)
+		: _name(std::move(name)),
+		  _arena(new MessageArena(SLAB_SIZE)),
+		  _writer(std::make_shared<LogWriter>(nanotime)),
+		  _saved(saved),
+		  _messages(0),
+		  _canceled(false)
 	{
-		wxLogVerbose("%lld %s logging", nanotime, _name);
-		_messages.emplace_back(nanotime, Bytes());
+		LogVerbose("%lld %s logging", static_cast<long long>(nanotime), _name.c_str());
 	}
 
 	~Log()
 	{
-		if (_messages.size() <= 1) {
+		if (_canceled || _messages == 0) {
 			return;
 		}
 
-		// Build the file name for storing this game
-		auto file = Helper::GetUserDataDir();
-		file.SetFullName(wxString::Format("%i.hsl", int(_messages[0].first / int(1e9))));
-		file.AppendDir("Logged");
-		auto filename = file.GetFullPath();
-		wxLogVerbose("saving %d messages to %s", _messages.size() - 1, filename);
-
-		// Create the containing directory if needed
-		if (!file.Mkdir(wxS_DIR_DEFAULT, wxPATH_MKDIR_FULL)) {
-			wxLogError("error creating save directory: %s", filename);
-			return;
-		}
-
-		// This should't happen, but check and log just in case
-		if (file.Exists()) {
-			wxLogWarning("overwriting existing game: %s", filename);
-		}
-
-		// Open the file
-		wxFileOutputStream fout(file.GetFullPath());
-		if (!fout.Ok()) {
-			wxLogError("error opening file: %s", filename);
-			return;
-		}
+		Flush();
 
-		// Zip the data while saving it to save some bandwidth later when the file is uploaded
-		wxZlibOutputStream zout(fout, wxZ_BEST_COMPRESSION, wxZLIB_NO_HEADER);
-
-		// Add header info
-		// <nanotime>
-		// 48 53 4C 48 09 00 00 00 
-		// 09 XX XX XX XX XX XX XX XX
-		auto version = Helper::GetHearthstoneVersion();
-		zout.Write(&_messages[0].first, 8)
-			.Write("HSLH\t\0\0\0\t", 9) // HSLH 09000000 09
-			.Write(&version, 8);
-
-		// Add the rest of the data
-		auto size = 25;
-		for (auto i = 1u; i < _messages.size(); i++) {
-			auto time = _messages[i].first;
-			auto msg = _messages[i].second;
-
-			size += 8 + msg.size();
-			zout.Write(&time, 8).Write(msg.data(), msg.size());
-		}
-		zout.Close();
-		wxLogVerbose("saved %d messages from %s (%d bytes, %lld compressed)", _messages.size() - 1, _name, size, fout.GetLength());
-
-		// Notify the app that it can upload the log file
-		HearthLogApp::UploadLog(filename);
+		LogVerbose("saving %d messages from %s", int(_messages), _name.c_str());
+		WriterPool::Finish(_writer, _saved); // notify the app when it can upload the log file
 	}
 
-	void Add(int64_t nanotime, Bytes message)
+	void Add(int64_t nanotime, std::range<const uint8_t *> message)
 	{
 		if (WasCanceled()) {
 			// Cancel was called previously, so don't store messages anymore
 			return;
 		}
 
-		_messages.emplace_back(nanotime, message);
+		_arena->Add(nanotime, message);
+		_messages++;
 
-		auto header = reinterpret_cast<int32_t *>(message.data());
-		wxLogVerbose("%lld %s (%d, %d)", nanotime, _name, header[0], header[1]);
+		LogVerbose("%lld %s (%d, %d)", static_cast<long long>(nanotime), _name.c_str(), headerField(message, 0), headerField(message, 1));
+
+		if (_arena->Bytes() >= FLUSH_SIZE || nanotime - (*_arena)[0].nanotime >= FLUSH_INTERVAL) {
+			Flush();
+		}
 	}
 
 	void Cancel()
 	{
-		swap_clear(_messages); // clear and release memory
+		if (_canceled) {
+			return;
+		}
+		_canceled = true;
+
+		_arena->Clear();
+		WriterPool::Cancel(_writer);
 	}
 
 	bool WasCanceled()
 	{
-		return _messages.empty();
+		return _canceled;
 	}
 
 private:
 	std::string _name;
-	MessageList _messages;
+	std::unique_ptr<MessageArena> _arena;
+	std::shared_ptr<LogWriter> _writer;
+	WriterPool::SavedCallback _saved;
+	size_t _messages;
+	bool _canceled;
+
+	void Flush()
+	{
+		if (_arena->Empty()) {
+			return;
+		}
+
+		_arena = WriterPool::Write(_writer, std::move(_arena));
+		if (!_arena) {
+			_arena.reset(new MessageArena(SLAB_SIZE));
+		}
+	}
 };
 
-GameLogger::GameLogger(int64_t nanotime, tcp::Stream *stream)
+GameLogger::GameLogger(int64_t nanotime, tcp::Stream *stream, WriterPool::SavedCallback saved)
 	: _stream(stream),
 	  _header(),
 	  _message(),
 	  _buffer(_header.data(), _header.data() + _header.size()),
+	  _synced(!stream->IsMidStream()),
+	  _resync(),
+	  _resyncPos(0),
 	  _log()
 {
-	//wxLogVerbose("new stream: %s", stream->Endpoints().SrcToDst());
+	//LogVerbose("new stream: %s", stream->Endpoints().SrcToDst());
 	if (_stream->Other()) {
 		_log = reinterpret_cast<GameLogger*>(_stream->Other()->Callback())->_log;
 	} else {
-		_log = std::make_shared<Log>(_stream->Endpoints().SrcToDst(), nanotime);
+		_log = std::make_shared<Log>(_stream->Endpoints().SrcToDst(), nanotime, saved);
 	}
 }
 
 GameLogger::~GameLogger()
 {
 	if (_buffer.begin() != _header.data()) {
-		wxLogWarning("%s canceling log (stream closed mid-packet)", _stream->Endpoints().SrcToDst());
-		_log->Cancel();
+		if (_stream->IsDraining()) {
+			// Shutting down, so keep the complete messages and drop the partial one
+			LogVerbose("%s dropping partial message on shutdown", _stream->Endpoints().SrcToDst().c_str());
+		} else {
+			LogWarning("%s canceling log (stream closed mid-packet)", _stream->Endpoints().SrcToDst().c_str());
+			_log->Cancel();
+		}
 	}
-	//wxLogVerbose("stream closed: (%s)", _stream->Endpoints().SrcToDst());
+	//LogVerbose("stream closed: (%s)", _stream->Endpoints().SrcToDst());
 }
 
 void GameLogger::operator()(int64_t nanotime, std::range<const uint8_t *> data) 
 {
 	if (_log->WasCanceled()) {
 		swap_clear(_message);
+		swap_clear(_resync);
+		return;
+	}
+
+	if (!_synced) {
+		Resync(nanotime, data);
 		return;
 	}
 
 	while (!data.empty()) {
+		// Fast path: messages that lie entirely within data go straight to the
+		// log. Only messages split across segments are copied together below.
+		if (_buffer.begin() == _header.data() && data.size() >= 8) {
+			uint32_t header[2];
+			std::copy(data.begin(), data.begin() + 8, reinterpret_cast<uint8_t *>(header));
+			if (!CheckHeader(header[0], header[1])) {
+				return;
+			}
+
+			if (data.size() >= 8 + header[1]) {
+				_log->Add(nanotime, std::make_range(data.begin(), data.begin() + 8 + header[1]));
+				data.pop_front(8 + header[1]);
+				continue;
+			}
+		}
+
 		auto toCopy = std::min(_buffer.size(), data.size());
 
 		std::copy(data.begin(), data.begin() + toCopy, _buffer.begin());
@@ -159,12 +190,7 @@ void GameLogger::operator()(int64_t nanotime, std::range<const uint8_t *> data)
 				auto type = ptr[0];
 				auto size = ptr[1];
 
-				// Sanity check the values
-				if (type > 1000 || size > 8000) {
-					wxLogVerbose("%s canceling log (bad header: %d, %d)", _stream->Endpoints().SrcToDst(), type, size);
-					_log->Cancel();
-					swap_clear(_message);
-					_buffer = std::make_range(_header.data(), _header.data() + _header.size());
+				if (!CheckHeader(type, size)) {
 					return;
 				}
 
@@ -174,13 +200,77 @@ void GameLogger::operator()(int64_t nanotime, std::range<const uint8_t *> data)
 				_buffer = std::make_range(_message.data() + 8, _message.data() + _message.size());
 
 			} else {
-				// Done reading message, add it to the log
-				_log->Add(nanotime, std::move(_message));
+				// Done reading message, add it to the log (keeping _message's
+				// capacity so the next message doesn't need an allocation)
+				_log->Add(nanotime, std::make_range<const uint8_t *>(_message.data(), _message.data() + _message.size()));
 
 				// Setup for another header next
 				_buffer = std::make_range(_header.data(), _header.data() + _header.size());
 			}
 		}
 	}
-	//wxLogVerbose("packet: %d (%s)", data.size(), _stream->Endpoints().SrcToDst());
+	//LogVerbose("packet: %d (%s)", data.size(), _stream->Endpoints().SrcToDst());
+}
+
+bool GameLogger::CheckHeader(uint32_t type, uint32_t size)
+{
+	// Sanity check the values
+	if (type > MAX_TYPE || size > MAX_SIZE) {
+		LogVerbose("%s canceling log (bad header: %d, %d)", _stream->Endpoints().SrcToDst().c_str(), type, size);
+		_log->Cancel();
+		swap_clear(_message);
+		_buffer = std::make_range(_header.data(), _header.data() + _header.size());
+		return false;
+	}
+	return true;
+}
+
+void GameLogger::Resync(int64_t nanotime, std::range<const uint8_t *> data)
+{
+	_resync.insert(_resync.end(), data.begin(), data.end());
+
+	// Look for an offset followed by a run of plausible headers, where each
+	// message's size leads exactly to the next header. Offsets before
+	// _resyncPos have already been ruled out.
+	for (; _resyncPos + 8 <= _resync.size(); _resyncPos++) {
+		auto pos = _resyncPos;
+		auto headers = 0;
+		auto plausible = true;
+		while (headers < RESYNC_HEADERS && pos + 8 <= _resync.size()) {
+			uint32_t header[2];
+			std::copy(_resync.data() + pos, _resync.data() + pos + 8, reinterpret_cast<uint8_t *>(header));
+
+			// All zeros is common in padding, so it doesn't count as a header here
+			if (header[0] > MAX_TYPE || header[1] > MAX_SIZE || (header[0] == 0 && header[1] == 0)) {
+				plausible = false;
+				break;
+			}
+
+			headers++;
+			pos += 8 + header[1];
+		}
+
+		if (!plausible) {
+			continue; // ruled out, try the next offset
+		}
+
+		if (headers < RESYNC_HEADERS) {
+			break; // need more data to decide
+		}
+
+		// Found it, so drop everything before this offset and process the rest normally
+		LogVerbose("%s resynced after skipping %d bytes", _stream->Endpoints().SrcToDst().c_str(), int(_resyncPos));
+		std::vector<uint8_t> pending;
+		pending.swap(_resync);
+		_synced = true;
+		(*this)(nanotime, std::make_range<const uint8_t *>(pending.data() + _resyncPos, pending.data() + pending.size()));
+		return;
+	}
+
+	// Bound memory while searching by discarding the oldest half of the data
+	if (_resync.size() > RESYNC_LIMIT) {
+		auto drop = std::min(_resyncPos, _resync.size() / 2);
+		_resync.erase(_resync.begin(), _resync.begin() + drop);
+		_resyncPos -= drop;
+	}
 }
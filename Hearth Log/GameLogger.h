@@ -1,5 +1,6 @@
 #pragma once
 
+#include "WriterPool.h"
 #include "tcp/Parser.h"
 #include "tcp/Stream.h"
 
@@ -8,10 +9,13 @@
 #include "range.h"
 #include <vector>
 
+// Collects a game's messages from both directions of its connection and
+// hands them to the WriterPool, which calls saved once the game's file is in
+// Logged/.
 class GameLogger : public tcp::Parser::Callback
 {
 public:
-	GameLogger(int64_t nanotime, tcp::Stream *stream);
+	GameLogger(int64_t nanotime, tcp::Stream *stream, WriterPool::SavedCallback saved);
 	virtual ~GameLogger();
 
 	virtual void operator()(int64_t nanotime, std::range<const uint8_t *> data);
@@ -23,6 +27,17 @@ private:
 	std::vector<uint8_t> _message;
 	std::range<uint8_t *> _buffer;
 
+	// Mid-stream pickup: bytes are held (up to a limit) until a run of
+	// plausible message headers shows where the framing is.
+	bool _synced;
+	std::vector<uint8_t> _resync;
+	size_t _resyncPos;
+
+	// Cancels the log if a message header isn't plausible
+	bool CheckHeader(uint32_t type, uint32_t size);
+
+	void Resync(int64_t nanotime, std::range<const uint8_t *> data);
+
 	class Log;
 	std::shared_ptr<Log> _log;
 };
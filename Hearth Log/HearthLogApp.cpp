@@ -9,17 +9,128 @@
 #include "TaskBarIcon.h"
 #include "PacketCapture.h"
 #include "tcp/Parser.h"
+#include "tcp/ShardedParser.h"
 #include "GameLogger.h"
+#include "LogWriter.h"
+#include "WriterPool.h"
+#include "Uploader.h"
+#include "File.h"
+#include "Log.h"
 
 #include "util.h"
 #include <fstream>
 
 IMPLEMENT_APP(HearthLogApp)
 
-TaskBarIcon *icon;
+// How long to wait for capture to stop and in-progress games to be saved
+const int SHUTDOWN_TIMEOUT_MS = 5000;
+
+// Game data waiting to be compressed before capture threads have to wait for it
+const size_t MAX_QUEUED_BYTES = 32 << 20;
+
+// Pick up games that were already in progress when capture started
+bool resyncMidStream;
+
+// Threads each device's packets are parsed on (1 parses on the capture thread)
+int parserThreads;
 
 std::ofstream fout;
 
+// Passes the capture core's messages on to wxLog
+void logToWx(LogLevel level, const char *message)
+{
+	auto text = wxString::FromUTF8(message);
+	switch (level) {
+	case LOG_LEVEL_ERROR: wxLogError("%s", text); break;
+	case LOG_LEVEL_WARNING: wxLogWarning("%s", text); break;
+	case LOG_LEVEL_MESSAGE: wxLogMessage("%s", text); break;
+	default: wxLogVerbose("%s", text); break;
+	}
+}
+
+void gameSaved(const std::string &filename)
+{
+	Uploader::Add(filename);
+}
+
+PacketCapture::Callback::Ptr newParser()
+{
+	auto parser = std::make_unique<tcp::Parser>(
+		[](int64_t nanotime, tcp::Stream *stream) -> tcp::Parser::Callback::Ptr {
+			return std::make_unique<GameLogger>(nanotime, stream, gameSaved);
+		});
+	parser->SetResync(resyncMidStream);
+	return std::move(parser);
+}
+
+// Parses on the capture thread, or spreads connections over parserThreads threads
+PacketCapture::Callback::Ptr newCaptureCallback()
+{
+	if (parserThreads > 1) {
+		return std::make_unique<tcp::ShardedParser>(parserThreads, newParser);
+	}
+	return newParser();
+}
+
+// Reads the compression settings ("Codec", "CompressionLevel" and
+// "ZstdDictionary") and whether to write indexed files ("IndexedFiles")
+LogWriter::Settings logWriterSettings()
+{
+	LogWriter::Settings settings;
+	settings.dataDir = Helper::GetUserDataDir().GetPath().ToUTF8().data();
+	settings.gameVersion = Helper::GetHearthstoneVersion;
+
+	auto name = Helper::ReadConfig("Codec", wxString(hsl::CodecName(hsl::CODEC_DEFLATE)));
+	if (!hsl::ParseCodec(name.ToStdString(), settings.codec)) {
+		wxLogWarning("unknown codec: %s", name);
+		settings.codec = hsl::CODEC_DEFLATE;
+	}
+
+	settings.level = int(Helper::ReadConfig("CompressionLevel", -1L));
+
+	auto dictFile = Helper::ReadConfig("ZstdDictionary", wxString());
+	if (!dictFile.empty() && settings.codec == hsl::CODEC_ZSTD && !file::Read(dictFile.ToUTF8().data(), settings.dictionary)) {
+		wxLogError("couldn't read dictionary: %s", dictFile);
+		settings.dictionary.clear();
+	}
+
+	settings.indexed = Helper::ReadConfig("IndexedFiles", false);
+	return settings;
+}
+
+// Reads how devices are opened: "CaptureSnaplen", "CaptureBufferKB" (the
+// kernel buffer, 0 for the default), "CaptureTimeoutMs", "CaptureImmediate" and
+// "CaptureRingThreads" (Linux only, 0 for libpcap)
+PacketCapture::Options captureOptions()
+{
+	PacketCapture::Options options;
+	options.snaplen = int(Helper::ReadConfig("CaptureSnaplen", long(options.snaplen)));
+	options.bufferSize = int(Helper::ReadConfig("CaptureBufferKB", 0L)) * 1024;
+	options.timeoutMs = int(Helper::ReadConfig("CaptureTimeoutMs", long(options.timeoutMs)));
+	options.immediate = Helper::ReadConfig("CaptureImmediate", false);
+	options.ringThreads = int(Helper::ReadConfig("CaptureRingThreads", 0L));
+	return options;
+}
+
+// Uploads to the site, or to a local server on the "localhost" port for
+// development, on "UploadThreads" threads with up to "UploadBatchGames"
+// games in a request
+Uploader::Settings uploaderSettings()
+{
+	Uploader::Settings settings;
+	settings.dataDir = Helper::GetUserDataDir().GetPath().ToUTF8().data();
+	settings.key = Helper::ReadConfig("UploadKey", wxString()).ToUTF8().data();
+	settings.threads = int(Helper::ReadConfig("UploadThreads", 2L));
+	settings.batchGames = int(Helper::ReadConfig("UploadBatchGames", long(settings.batchGames)));
+
+	auto port = int(Helper::ReadConfig("localhost", 0L));
+	if (port) {
+		settings.host = "localhost";
+		settings.port = port;
+	}
+	return settings;
+}
+
 bool HearthLogApp::OnInit()
 {
 	// Build the path for a log file
@@ -44,8 +155,10 @@ bool HearthLogApp::OnInit()
 	logWindow->GetFrame()->SetSize(1024, 300);
 	wxLog::SetActiveTarget(logWindow);
 
-	// Start logging
+	// Start logging (including the capture core's messages)
 	wxLog::SetVerbose();
+	SetLogHandler(logToWx);
+	SetLogVerbose(true);
 	wxLogMessage(_("Hearth Log %s"), Helper::AppVersion());
 
 	// Setup config from file
@@ -57,28 +170,48 @@ bool HearthLogApp::OnInit()
 	}
 
 	// Create the GUI bits
-	icon = new TaskBarIcon();
+	new TaskBarIcon();
+
+	// Games are compressed and saved in the background. Games cut short by a
+	// crash are saved first, before anything else can be writing to Pending/.
+	LogWriter::Configure(logWriterSettings());
+	LogWriter::RecoverPending();
+	WriterPool::Start(Helper::ReadConfig("WriterThreads", 2L), MAX_QUEUED_BYTES);
 
 	// Setup a packet parsing stack
-	PacketCapture::Start("tcp port 3724 or tcp port 1119", 
-	//PacketCapture::Start("tcp port 1119", "C:\\Users\\Chip\\Documents\\Network Monitor 3\\Captures\\Hearthstone2.pcap", 
-		[]() -> PacketCapture::Callback::Ptr {
-			return std::make_unique<tcp::Parser>(
-				[](int64_t nanotime, tcp::Stream *stream) -> tcp::Parser::Callback::Ptr {
-					return std::make_unique<GameLogger>(nanotime, stream);
-				});
-		});
+	resyncMidStream = Helper::ReadConfig("ResyncMidStream", false);
+	parserThreads = int(Helper::ReadConfig("ParserThreads", 1L));
+	PacketCapture::Callback::Factory factory = newCaptureCallback;
+	PacketCapture::Configure(captureOptions());
+
+	// Listen to every device unless a single one is configured (e.g. "any" on Linux)
+	auto device = Helper::ReadConfig("CaptureDevice", wxString());
+	if (device.empty()) {
+		PacketCapture::Start("tcp port 3724 or tcp port 1119", factory);
+		//PacketCapture::Start("tcp port 1119", "C:\\Users\\Chip\\Documents\\Network Monitor 3\\Captures\\Hearthstone2.pcap", factory);
+	} else {
+		wxLogMessage("listening to %s", device);
+		PacketCapture::StartDevice("tcp port 3724 or tcp port 1119", device.ToStdString(), factory);
+	}
 
-	// Try to upload any logs that haven't been uploaded yet
-	icon->UploadAll();
+	// Try to upload any logs that haven't been uploaded yet (including games
+	// cut short by a crash)
+	Uploader::Start(uploaderSettings());
+	Uploader::AddPending();
 
 	return true;
 }
 
-void HearthLogApp::UploadLog(const wxString &filename)
+void HearthLogApp::Shutdown()
 {
-	wxCommandEvent evt(HSL_LOG_AVAILABLE_EVENT);
-	evt.SetString(filename);
-
-	wxPostEvent(icon, evt);
+	wxLogMessage("stopping capture");
+	if (!PacketCapture::Stop(SHUTDOWN_TIMEOUT_MS)) {
+		wxLogWarning("capture didn't stop cleanly, games in progress may be lost");
+	}
+	if (!WriterPool::Stop(SHUTDOWN_TIMEOUT_MS)) {
+		wxLogWarning("games still being saved will be recovered on the next start");
+	}
+	if (!Uploader::Stop(SHUTDOWN_TIMEOUT_MS)) {
+		wxLogWarning("games still being uploaded will be uploaded on the next start");
+	}
 }
@@ -5,7 +5,8 @@
 class HearthLogApp : public wxApp
 {
 public:
-	static void UploadLog(const wxString &filename);
+	// Stops capture (saving any games in progress) and uploading
+	static void Shutdown();
 
 	virtual bool OnInit();
 };
@@ -0,0 +1,403 @@
+#include "Http.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mutex>
+#else
+#include <cerrno>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+// Longest status or header line accepted from the server
+const size_t MAX_LINE = 8192;
+
+// Bytes read from the socket at a time
+const size_t RECEIVE_SIZE = 16 * 1024;
+
+// Most pieces handed to the socket at a time
+const size_t MAX_SEND_PIECES = 64;
+
+namespace {
+
+const intptr_t NO_SOCKET = -1;
+
+#ifdef _WIN32
+void startSockets()
+{
+	static std::once_flag once;
+	std::call_once(once, []() {
+		WSADATA data;
+		WSAStartup(MAKEWORD(2, 2), &data);
+	});
+}
+
+std::string socketError()
+{
+	return "socket error " + std::to_string(static_cast<long long>(WSAGetLastError()));
+}
+
+void closeSocket(intptr_t s)
+{
+	closesocket(SOCKET(s));
+}
+
+void setTimeouts(intptr_t s, int seconds)
+{
+	DWORD ms = seconds * 1000;
+	setsockopt(SOCKET(s), SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&ms), sizeof(ms));
+	setsockopt(SOCKET(s), SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char *>(&ms), sizeof(ms));
+}
+
+// Sends as much of the pieces as the socket takes, returning how much that was (or -1)
+long long sendPieces(intptr_t s, const HttpConnection::Piece *pieces, size_t count)
+{
+	WSABUF buffers[MAX_SEND_PIECES];
+	for (size_t i = 0; i < count; i++) {
+		buffers[i].buf = reinterpret_cast<CHAR *>(const_cast<uint8_t *>(pieces[i].begin()));
+		buffers[i].len = ULONG(pieces[i].size());
+	}
+
+	DWORD sent;
+	if (WSASend(SOCKET(s), buffers, DWORD(count), &sent, 0, nullptr, nullptr) != 0) {
+		return -1;
+	}
+	return sent;
+}
+#else
+void startSockets()
+{
+}
+
+std::string socketError()
+{
+	return strerror(errno);
+}
+
+void closeSocket(intptr_t s)
+{
+	close(int(s));
+}
+
+void setTimeouts(intptr_t s, int seconds)
+{
+	timeval tv = { seconds, 0 };
+	setsockopt(int(s), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(int(s), SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	setsockopt(int(s), SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+// Report a closed connection as an error rather than raising SIGPIPE
+#ifdef MSG_NOSIGNAL
+const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+const int SEND_FLAGS = 0;
+#endif
+
+// Sends as much of the pieces as the socket takes, returning how much that was (or -1)
+long long sendPieces(intptr_t s, const HttpConnection::Piece *pieces, size_t count)
+{
+	iovec buffers[MAX_SEND_PIECES];
+	for (size_t i = 0; i < count; i++) {
+		buffers[i].iov_base = const_cast<uint8_t *>(pieces[i].begin());
+		buffers[i].iov_len = size_t(pieces[i].size());
+	}
+
+	msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = buffers;
+	message.msg_iovlen = count;
+	return sendmsg(int(s), &message, SEND_FLAGS);
+}
+#endif
+
+std::string lower(std::string s)
+{
+	std::transform(s.begin(), s.end(), s.begin(), [](char c) { return char(tolower(static_cast<unsigned char>(c))); });
+	return s;
+}
+
+std::string trim(const std::string &s)
+{
+	auto begin = s.find_first_not_of(" \t");
+	if (begin == std::string::npos) {
+		return std::string();
+	}
+	return s.substr(begin, s.find_last_not_of(" \t") + 1 - begin);
+}
+
+} // namespace
+
+HttpConnection::HttpConnection(const std::string &host, int port, int timeoutSeconds)
+	: _host(host),
+	  _port(port),
+	  _timeoutSeconds(timeoutSeconds),
+	  _socket(NO_SOCKET),
+	  _buffer(),
+	  _error()
+{
+	startSockets();
+}
+
+HttpConnection::~HttpConnection()
+{
+	Close();
+}
+
+bool HttpConnection::IsOpen() const
+{
+	return _socket != NO_SOCKET;
+}
+
+void HttpConnection::Close()
+{
+	if (_socket != NO_SOCKET) {
+		closeSocket(_socket);
+		_socket = NO_SOCKET;
+	}
+	_buffer.clear();
+}
+
+bool HttpConnection::Open()
+{
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	addrinfo *addrs = nullptr;
+	auto result = getaddrinfo(_host.c_str(), std::to_string(static_cast<long long>(_port)).c_str(), &hints, &addrs);
+	if (result != 0) {
+		_error = "couldn't resolve " + _host + ": " + gai_strerror(result);
+		return false;
+	}
+
+	for (auto addr = addrs; addr; addr = addr->ai_next) {
+		auto s = intptr_t(socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol));
+		if (s == NO_SOCKET) {
+			_error = socketError();
+			continue;
+		}
+
+		setTimeouts(s, _timeoutSeconds);
+		if (connect(s, addr->ai_addr, int(addr->ai_addrlen)) != 0) {
+			_error = "couldn't connect to " + _host + ": " + socketError();
+			closeSocket(s);
+			continue;
+		}
+
+		// Each request goes out as soon as it's written
+		int on = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&on), sizeof(on));
+
+		_socket = s;
+		break;
+	}
+
+	freeaddrinfo(addrs);
+	return _socket != NO_SOCKET;
+}
+
+bool HttpConnection::Send(std::vector<Piece> pieces)
+{
+	pieces.erase(std::remove_if(pieces.begin(), pieces.end(), [](const Piece &piece) { return piece.empty(); }), pieces.end());
+
+	size_t next = 0;
+	while (next < pieces.size()) {
+		auto count = std::min(pieces.size() - next, MAX_SEND_PIECES);
+		auto sent = sendPieces(_socket, &pieces[next], count);
+		if (sent <= 0) {
+			_error = "send failed: " + socketError();
+			return false;
+		}
+
+		// Skip what went, starting again partway through a piece if need be
+		while (next < pieces.size() && sent >= pieces[next].size()) {
+			sent -= pieces[next].size();
+			next++;
+		}
+		if (sent > 0) {
+			pieces[next].pop_front(ptrdiff_t(sent));
+		}
+	}
+	return true;
+}
+
+bool HttpConnection::Receive()
+{
+	char data[RECEIVE_SIZE];
+	auto n = recv(_socket, data, int(sizeof(data)), 0);
+	if (n <= 0) {
+		_error = n == 0 ? "connection closed" : "receive failed: " + socketError();
+		return false;
+	}
+	_buffer.append(data, size_t(n));
+	return true;
+}
+
+bool HttpConnection::ReadLine(std::string &line)
+{
+	size_t end;
+	while ((end = _buffer.find("\r\n")) == std::string::npos) {
+		if (_buffer.size() > MAX_LINE) {
+			_error = "response line too long";
+			return false;
+		}
+		if (!Receive()) {
+			return false;
+		}
+	}
+
+	line.assign(_buffer, 0, end);
+	_buffer.erase(0, end + 2);
+	return true;
+}
+
+bool HttpConnection::ReadBytes(size_t size, std::string &out)
+{
+	while (_buffer.size() < size) {
+		if (!Receive()) {
+			return false;
+		}
+	}
+
+	out.append(_buffer, 0, size);
+	_buffer.erase(0, size);
+	return true;
+}
+
+bool HttpConnection::ReadResponse(Response &response, bool &keepAlive)
+{
+	// HTTP/1.1 200 OK
+	std::string line;
+	if (!ReadLine(line)) {
+		return false;
+	}
+	if (line.compare(0, 5, "HTTP/") != 0 || line.size() < 12) {
+		_error = "bad status line: " + line;
+		return false;
+	}
+	response.status = atoi(line.c_str() + 9);
+	keepAlive = line.compare(0, 8, "HTTP/1.1") == 0;
+
+	long long length = -1;
+	auto chunked = false;
+	while (1) {
+		if (!ReadLine(line)) {
+			return false;
+		}
+		if (line.empty()) {
+			break;
+		}
+
+		auto colon = line.find(':');
+		if (colon == std::string::npos) {
+			continue;
+		}
+		auto name = lower(trim(line.substr(0, colon)));
+		auto value = lower(trim(line.substr(colon + 1)));
+		if (name == "content-length") {
+			length = atoll(value.c_str());
+		} else if (name == "transfer-encoding") {
+			chunked = value.find("chunked") != std::string::npos;
+		} else if (name == "connection") {
+			keepAlive = value != "close";
+		}
+	}
+
+	response.body.clear();
+	if (response.status == 204 || response.status == 304 || response.status / 100 == 1) {
+		return true;
+	}
+
+	if (chunked) {
+		while (1) {
+			if (!ReadLine(line)) {
+				return false;
+			}
+			auto size = strtoul(line.c_str(), nullptr, 16);
+			if (size == 0) {
+				// Skip any trailers
+				do {
+					if (!ReadLine(line)) {
+						return false;
+					}
+				} while (!line.empty());
+				return true;
+			}
+			if (!ReadBytes(size, response.body) || !ReadLine(line)) {
+				return false;
+			}
+		}
+	}
+
+	if (length >= 0) {
+		return ReadBytes(size_t(length), response.body);
+	}
+
+	// No length, so the body runs until the server closes the connection
+	while (Receive()) {
+	}
+	response.body += _buffer;
+	_buffer.clear();
+	keepAlive = false;
+	return true;
+}
+
+bool HttpConnection::Post(const std::string &path, const std::string &contentType, const std::vector<Piece> &body, Response &response)
+{
+	long long length = 0;
+	for (auto &piece : body) {
+		length += piece.size();
+	}
+
+	std::string request = "POST " + path + " HTTP/1.1\r\n"
+		"Host: " + _host + (_port == 80 ? "" : ":" + std::to_string(static_cast<long long>(_port))) + "\r\n"
+		"Content-Type: " + contentType + "\r\n"
+		"Content-Length: " + std::to_string(length) + "\r\n"
+		"\r\n";
+
+	// The headers go in the same send as the start of the body
+	std::vector<Piece> pieces;
+	pieces.reserve(body.size() + 1);
+	pieces.push_back(std::make_range(reinterpret_cast<const uint8_t *>(request.data()), reinterpret_cast<const uint8_t *>(request.data() + request.size())));
+	pieces.insert(pieces.end(), body.begin(), body.end());
+
+	// A kept-alive connection may have been closed by the server since the
+	// last request, so if nothing comes back on it try once more on a new one
+	for (auto attempt = 0; attempt < 2; attempt++) {
+		auto reused = IsOpen();
+		if (!reused && !Open()) {
+			return false;
+		}
+
+		response = Response();
+		auto keepAlive = true;
+		if (Send(pieces) && ReadResponse(response, keepAlive)) {
+			if (!keepAlive) {
+				Close();
+			}
+			return true;
+		}
+
+		Close();
+		if (!reused || response.status != 0) {
+			break;
+		}
+	}
+	return false;
+}
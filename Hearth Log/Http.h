@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include "range.h"
+#include <string>
+#include <vector>
+
+// Minimal blocking HTTP/1.1 client for uploads (no wxWidgets, so it can be
+// used from any thread). The connection is kept alive between requests and
+// reopened when the server has closed it.
+class HttpConnection
+{
+public:
+	struct Response
+	{
+		Response() : status(0), body() { }
+
+		int status;
+		std::string body;
+	};
+
+	typedef std::range<const uint8_t *> Piece;
+
+	HttpConnection(const std::string &host, int port, int timeoutSeconds);
+	~HttpConnection();
+
+	// Sends a POST and reads the response, returning false on a network error
+	// (the server's status is in the response, whatever it is). The body is
+	// the pieces one after another, sent from where they are without being
+	// gathered into one buffer (so they can be mapped files).
+	bool Post(const std::string &path, const std::string &contentType, const std::vector<Piece> &body, Response &response);
+
+	void Close();
+	bool IsOpen() const;
+
+	// Why the last request failed
+	const std::string &Error() const { return _error; }
+
+private:
+	const std::string _host;
+	const int _port;
+	const int _timeoutSeconds;
+	intptr_t _socket; // SOCKET on Windows
+	std::string _buffer; // received but not yet parsed
+	std::string _error;
+
+	bool Open();
+	bool Send(std::vector<Piece> pieces);
+	bool Receive();
+	bool ReadLine(std::string &line);
+	bool ReadBytes(size_t size, std::string &out);
+	bool ReadResponse(Response &response, bool &keepAlive);
+
+	HttpConnection(const HttpConnection &);
+	HttpConnection &operator=(const HttpConnection &);
+};
@@ -0,0 +1,81 @@
+#include "Log.h"
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+
+namespace {
+
+const char *const LEVEL_NAMES[] = { "error", "warning", "message", "verbose" };
+
+std::atomic<LogHandler> logHandler(nullptr);
+std::atomic<bool> logVerbose(false);
+
+void write(LogLevel level, const char *format, va_list args)
+{
+	char message[1024];
+	if (vsnprintf(message, sizeof(message), format, args) < 0) {
+		message[sizeof(message) - 1] = 0; // truncated (older CRTs return -1)
+	}
+
+	auto handler = logHandler.load();
+	if (handler) {
+		handler(level, message);
+	} else {
+		fprintf(stderr, "%s: %s\n", LEVEL_NAMES[level], message);
+	}
+}
+
+} // namespace
+
+void SetLogHandler(LogHandler handler)
+{
+	logHandler = handler;
+}
+
+void SetLogVerbose(bool verbose)
+{
+	logVerbose = verbose;
+}
+
+bool LogVerboseEnabled()
+{
+	return logVerbose;
+}
+
+void LogError(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	write(LOG_LEVEL_ERROR, format, args);
+	va_end(args);
+}
+
+void LogWarning(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	write(LOG_LEVEL_WARNING, format, args);
+	va_end(args);
+}
+
+void LogMessage(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	write(LOG_LEVEL_MESSAGE, format, args);
+	va_end(args);
+}
+
+void LogVerboseMessage(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	write(LOG_LEVEL_VERBOSE, format, args);
+	va_end(args);
+}
+
+void LogCheckFailed(const char *condition, const char *file, int line)
+{
+	LogError("check failed: %s (%s:%d)", condition, file, line);
+}
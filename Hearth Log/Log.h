@@ -0,0 +1,43 @@
+#pragma once
+
+// Logging for the capture core, which doesn't depend on wxWidgets. The app
+// passes messages on to wxLog, the daemon writes them to stderr or syslog.
+// Formats are printf's (so cast size_t and friends to match).
+
+enum LogLevel
+{
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_MESSAGE,
+	LOG_LEVEL_VERBOSE,
+};
+
+typedef void (*LogHandler)(LogLevel level, const char *message);
+
+// Sets where messages go (stderr if null). Called from any thread.
+void SetLogHandler(LogHandler handler);
+
+// Verbose messages are dropped unless enabled
+void SetLogVerbose(bool verbose);
+
+bool LogVerboseEnabled();
+
+#if defined(__GNUC__)
+#define LOG_FORMAT __attribute__((format(printf, 1, 2)))
+#else
+#define LOG_FORMAT
+#endif
+
+void LogError(const char *format, ...) LOG_FORMAT;
+void LogWarning(const char *format, ...) LOG_FORMAT;
+void LogMessage(const char *format, ...) LOG_FORMAT;
+void LogVerboseMessage(const char *format, ...) LOG_FORMAT;
+
+// Like wxLogVerbose, the arguments aren't evaluated unless verbose messages are enabled
+#define LogVerbose(...) do { if (LogVerboseEnabled()) { LogVerboseMessage(__VA_ARGS__); } } while (0)
+
+void LogCheckFailed(const char *condition, const char *file, int line);
+
+// Like wxCHECK and wxCHECK2: log and return value (or run op) if cond is false
+#define CHECK(cond, value) do { if (!(cond)) { LogCheckFailed(#cond, __FILE__, __LINE__); return value; } } while (0)
+#define CHECK2(cond, op) do { if (!(cond)) { LogCheckFailed(#cond, __FILE__, __LINE__); op; } } while (0)
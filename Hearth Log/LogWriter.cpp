@@ -0,0 +1,368 @@
+#include "LogWriter.h"
+#include "File.h"
+#include "Log.h"
+#include "MessageArena.h"
+#include "hsl/Header.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+// How often (in capture time) to flush the compressed data to disk, so a
+// crash loses at most this much of a game. Each flush costs a little
+// compression since it resets the compressor's history.
+const int64_t SYNC_INTERVAL = int64_t(60e9);
+
+// Uncompressed size at which indexed files start a new block. Smaller
+// blocks make seeking cheaper but compress a little worse.
+const uint32_t BLOCK_SIZE = 256 * 1024;
+
+// See Configure
+LogWriter::Settings settings;
+
+// Passes compressed data on to the pending file, counting it for the index
+class LogWriter::FileSink : public hsl::Sink
+{
+public:
+	explicit FileSink(file::Output &out) : _out(out), _written(0) { }
+
+	bool Write(const uint8_t *data, size_t size)
+	{
+		_written += size;
+		return _out.Write(data, size);
+	}
+
+	uint64_t Written() const { return _written; }
+
+private:
+	file::Output &_out;
+	uint64_t _written;
+
+	FileSink &operator=(const FileSink &);
+};
+
+std::string userDir(const std::string &dir)
+{
+	return file::Join(settings.dataDir, dir);
+}
+
+// Guards picking a free name in Logged/ (games can finish on several writer threads)
+std::mutex loggedMutex;
+
+// Name the game is saved under in Logged/ (its start time in seconds, with a
+// count added if other games started in the same second)
+std::string loggedFile(int64_t nanotime, int n)
+{
+	auto name = std::to_string(static_cast<long long>(nanotime / int64_t(1e9)));
+	if (n > 0) {
+		name += "-" + std::to_string(static_cast<long long>(n));
+	}
+	return file::Join(userDir("Logged"), name + ".hsl");
+}
+
+// Name of a game's file in Pending/ while it's being written (its start time
+// in nanoseconds, with a count added if other games started at the same time)
+std::string pendingFile(int64_t nanotime, int n)
+{
+	auto name = std::to_string(static_cast<long long>(nanotime));
+	if (n > 0) {
+		name += "-" + std::to_string(static_cast<long long>(n));
+	}
+	return file::Join(userDir("Pending"), name + ".part");
+}
+
+// Moves a finished file into Logged/, returning its new path (or empty on error)
+std::string moveToLogged(const std::string &src, int64_t nanotime)
+{
+	// Create the containing directory if needed
+	if (!file::MakeDirs(userDir("Logged"))) {
+		LogError("error creating save directory: %s", userDir("Logged").c_str());
+		return std::string();
+	}
+
+	// Games only share a start time when capturing (or reading) several at once
+	std::lock_guard<std::mutex> lock(loggedMutex);
+	auto n = 0;
+	auto filename = loggedFile(nanotime, n);
+	while (file::Exists(filename)) {
+		filename = loggedFile(nanotime, ++n);
+	}
+
+	if (!file::Rename(src, filename)) {
+		LogError("error moving %s to %s", src.c_str(), filename.c_str());
+		return std::string();
+	}
+	return filename;
+}
+
+LogWriter::LogWriter(int64_t nanotime)
+	: _start(nanotime),
+	  _pending(),
+	  _fout(),
+	  _sink(),
+	  _compressor(),
+	  _index(),
+	  _block(),
+	  _messages(0),
+	  _size(0),
+	  _lastSync(nanotime),
+	  _canceled(false)
+{
+}
+
+LogWriter::~LogWriter()
+{
+	// Finish wasn't called, so the file is incomplete
+	Cancel();
+}
+
+void LogWriter::Configure(const Settings &newSettings)
+{
+	settings = newSettings;
+	if (!hsl::CodecAvailable(settings.codec)) {
+		LogWarning("%s support wasn't built in, using deflate", hsl::CodecName(settings.codec));
+		settings.codec = hsl::CODEC_DEFLATE;
+	}
+	if (settings.codec != hsl::CODEC_ZSTD) {
+		settings.dictionary.clear();
+	}
+
+	LogVerbose("saving games with %s (level %d%s%s)", hsl::CodecName(settings.codec), settings.level,
+		settings.dictionary.empty() ? "" : ", dictionary", settings.indexed ? ", indexed" : "");
+}
+
+bool LogWriter::Open()
+{
+	// Create the containing directory if needed
+	if (!file::MakeDirs(userDir("Pending"))) {
+		LogError("error creating save directory: %s", userDir("Pending").c_str());
+		return false;
+	}
+
+	// Pending files are named by the full start time, with a count added if
+	// another game (e.g. from another capture file) started at the same time
+	_fout.reset(new file::Output());
+	for (auto n = 0; ; n++) {
+		_pending = pendingFile(_start, n);
+		if (_fout->Open(_pending, true)) {
+			break;
+		}
+		if (errno != EEXIST) {
+			LogError("error opening file: %s", _pending.c_str());
+			_pending.clear(); // nothing to remove
+			_fout.reset();
+			return false;
+		}
+	}
+
+	// Compress the data while saving it to save some bandwidth later when the file is uploaded
+	_sink.reset(new FileSink(*_fout));
+	if (!StartBlock()) {
+		return false;
+	}
+
+	// Add header info
+	hsl::Header header;
+	header.nanotime = _start;
+	header.format = settings.indexed ? hsl::Header::FORMAT_INDEXED : hsl::Header::FORMAT;
+	header.gameVersion = settings.gameVersion ? settings.gameVersion() : 0;
+	header.codec = settings.codec;
+
+	std::vector<uint8_t> data;
+	header.Write(data);
+	_size = data.size();
+	_block.rawSize = uint32_t(data.size());
+
+	LogVerbose("writing %s", _pending.c_str());
+	return _compressor->Write(std::make_range<const uint8_t *>(data.data(), data.data() + data.size()));
+}
+
+bool LogWriter::StartBlock()
+{
+	_compressor = hsl::Compressor::Create(settings.codec, settings.level, *_sink, settings.dictionary.empty() ? nullptr : &settings.dictionary);
+	if (!_compressor) {
+		LogError("error starting %s compression", hsl::CodecName(settings.codec));
+		return false;
+	}
+
+	_block = hsl::BlockInfo();
+	_block.offset = _sink->Written();
+	return true;
+}
+
+bool LogWriter::EndBlock()
+{
+	if (!_compressor->Finish()) {
+		LogError("error writing %s: %s", _pending.c_str(), _compressor->Error().c_str());
+		return false;
+	}
+	_compressor.reset();
+
+	_block.compressedSize = uint32_t(_sink->Written() - _block.offset);
+	_index.blocks.push_back(_block);
+	return true;
+}
+
+void LogWriter::Close()
+{
+	_compressor.reset();
+	_sink.reset();
+	_fout.reset();
+}
+
+void LogWriter::Write(const MessageArena &arena)
+{
+	if (_canceled || arena.Empty()) {
+		return;
+	}
+
+	if ((!_fout && !Open()) || (!_compressor && !StartBlock())) {
+		Cancel();
+		return;
+	}
+
+	// Records are already laid out as they're stored, so write whole slabs
+	auto ok = true;
+	auto &compressor = *_compressor;
+	arena.ForEachSlab([&](std::range<const uint8_t *> records) {
+		ok = ok && compressor.Write(records);
+	});
+	if (!ok) {
+		LogError("error writing %s: %s", _pending.c_str(), _compressor->Error().c_str());
+		Cancel();
+		return;
+	}
+
+	_messages += arena.Size();
+	_size += arena.Bytes();
+
+	if (settings.indexed) {
+		for (auto i = 0u; i < arena.Size(); i++) {
+			auto &entry = arena[i];
+			uint32_t type;
+			memcpy(&type, arena.Message(entry).begin(), sizeof(type));
+			_block.Add(entry.nanotime, type);
+		}
+		_block.rawSize += uint32_t(arena.Bytes());
+	}
+
+	// Periodically push everything so far out to disk. Indexed files end
+	// the block instead, which also happens once it's big enough.
+	auto nanotime = arena[arena.Size() - 1].nanotime;
+	auto sync = nanotime - _lastSync >= SYNC_INTERVAL;
+	if (settings.indexed && (sync || _block.rawSize >= BLOCK_SIZE)) {
+		ok = EndBlock();
+	} else if (sync && !_compressor->Flush()) {
+		LogError("error writing %s: %s", _pending.c_str(), _compressor->Error().c_str());
+		ok = false;
+	}
+	if (!ok) {
+		Cancel();
+		return;
+	}
+
+	if (sync) {
+		_fout->Sync();
+		_lastSync = nanotime;
+	}
+}
+
+std::string LogWriter::Finish()
+{
+	if (_canceled || !_fout) {
+		return std::string();
+	}
+
+	bool ok;
+	if (settings.indexed) {
+		ok = !_compressor || EndBlock();
+		if (ok) {
+			std::vector<uint8_t> index;
+			_index.Write(index, _sink->Written());
+			ok = _sink->Write(index.data(), index.size());
+		}
+	} else {
+		ok = _compressor->Finish();
+	}
+	auto compressed = _fout->Length();
+	ok = _fout->Close() && ok;
+	Close();
+
+	if (!ok) {
+		LogError("error finishing %s", _pending.c_str());
+		Cancel();
+		return std::string();
+	}
+	LogVerbose("saved %d messages (%d bytes, %lld compressed)", int(_messages), int(_size), static_cast<long long>(compressed));
+
+	auto filename = moveToLogged(_pending, _start);
+	if (filename.empty()) {
+		Cancel();
+	}
+	_canceled = true; // done with the pending file either way
+	return filename;
+}
+
+void LogWriter::Cancel()
+{
+	if (_canceled) {
+		return;
+	}
+	_canceled = true;
+
+	// Only touch the disk if the file was created
+	if (!_pending.empty()) {
+		Close();
+		if (!file::Remove(_pending)) {
+			LogWarning("error removing %s", _pending.c_str());
+		}
+	}
+}
+
+void LogWriter::RecoverPending()
+{
+	auto path = userDir("Pending");
+	if (!file::DirExists(path))
+		return;
+
+	auto files = file::List(path, ".part");
+	for (auto i = 0u; i < files.size(); i++) {
+		auto name = file::Join(path, files[i]);
+		char *end;
+		auto start = strtoll(files[i].c_str(), &end, 10);
+		if (end != files[i].c_str() && *end == '-') {
+			strtol(end + 1, &end, 10);
+		}
+		if (end == files[i].c_str() || strcmp(end, ".part") != 0) {
+			LogWarning("unexpected file: %s", name.c_str());
+			continue;
+		}
+
+		std::vector<uint8_t> data;
+		if (!file::Read(name, data)) {
+			LogError("couldn't read file: %s", name.c_str());
+			continue;
+		}
+
+		// Cut anything written after the last flush (it may be incomplete)
+		// and end the file there
+		auto size = data.size();
+		auto fileCodec = hsl::DetectCodec(std::make_range<const uint8_t *>(data.data(), data.data() + data.size()));
+		if (!hsl::Recover(fileCodec, data, settings.dictionary.empty() ? nullptr : &settings.dictionary)) {
+			LogWarning("nothing to recover from %s", name.c_str());
+			file::Remove(name);
+			continue;
+		}
+
+		if (!file::Write(name, data.data(), data.size())) {
+			LogError("error recovering %s", name.c_str());
+			continue;
+		}
+
+		auto filename = moveToLogged(name, start);
+		if (!filename.empty()) {
+			LogMessage("recovered %s (%d of %d bytes)", filename.c_str(), int(data.size()), int(size));
+		}
+	}
+}
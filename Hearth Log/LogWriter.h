@@ -0,0 +1,78 @@
+#pragma once
+
+#include "hsl/Codec.h"
+#include "hsl/Index.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class MessageArena;
+
+namespace file { class Output; }
+
+// Writes one game to an .hsl file as its messages arrive. The data is
+// compressed into a temporary file in Pending/, which Finish moves into
+// Logged/, so only complete games are uploaded and memory use doesn't
+// grow with the length of the game.
+class LogWriter
+{
+public:
+	explicit LogWriter(int64_t nanotime);
+	~LogWriter();
+
+	struct Settings
+	{
+		Settings() : dataDir(), codec(hsl::CODEC_DEFLATE), level(-1), dictionary(), indexed(false), gameVersion(nullptr) { }
+
+		std::string dataDir;             // Pending/ and Logged/ go here (UTF-8)
+		hsl::Codec codec;
+		int level;                       // -1 for the codec's default
+		std::vector<uint8_t> dictionary; // zstd only
+		bool indexed;                    // write indexed files (format 10)
+		uint64_t (*gameVersion)();       // for the header (0 if null)
+	};
+
+	// Call before any games are written
+	static void Configure(const Settings &settings);
+
+	// Appends every record in the arena (the file is created with the first one)
+	void Write(const MessageArena &arena);
+
+	// Completes the file and moves it into Logged/, returning its new path
+	// (empty if there was nothing to save or it failed).
+	std::string Finish();
+
+	// Stops writing and deletes the temporary file
+	void Cancel();
+	bool WasCanceled() const { return _canceled; }
+
+	size_t Messages() const { return _messages; }
+
+	// Finishes games left in Pending/ by a crash, keeping the data up to the last flush
+	static void RecoverPending();
+
+private:
+	class FileSink;
+
+	const int64_t _start;
+	std::string _pending;
+	std::unique_ptr<file::Output> _fout;
+	std::unique_ptr<FileSink> _sink;
+	std::unique_ptr<hsl::Compressor> _compressor;
+	hsl::Index _index;  // finished blocks (indexed files only)
+	hsl::BlockInfo _block;
+	size_t _messages;
+	size_t _size;
+	int64_t _lastSync;
+	bool _canceled;
+
+	bool Open();
+	bool StartBlock();
+	bool EndBlock();
+	void Close();
+
+	LogWriter(const LogWriter &);
+	LogWriter &operator=(const LogWriter &);
+};
@@ -0,0 +1,64 @@
+#include "MessageArena.h"
+#include "Log.h"
+
+#include <algorithm>
+
+MessageArena::MessageArena(size_t slabSize)
+	: _slabSize(slabSize),
+	  _slabs(),
+	  _used(),
+	  _slab(0),
+	  _bytes(0),
+	  _index()
+{
+}
+
+uint8_t *MessageArena::Allocate(int64_t nanotime, size_t length)
+{
+	auto record = 8 + length;
+	CHECK(record <= _slabSize, nullptr);
+
+	// Move on to the next slab (reusing one from before a Clear if possible)
+	if (_slabs.empty() || _used[_slab] + record > _slabSize) {
+		if (!_slabs.empty()) {
+			_slab++;
+		}
+		if (_slab == _slabs.size()) {
+			_slabs.emplace_back(_slabSize);
+			_used.push_back(0);
+		}
+	}
+
+	auto &used = _used[_slab];
+	auto ptr = _slabs[_slab].data() + used;
+	std::copy(reinterpret_cast<const uint8_t *>(&nanotime), reinterpret_cast<const uint8_t *>(&nanotime) + 8, ptr);
+
+	Entry entry = { nanotime, uint32_t(_slab), uint32_t(used + 8), uint32_t(length) };
+	_index.push_back(entry);
+
+	used += record;
+	_bytes += record;
+	return ptr + 8;
+}
+
+void MessageArena::Add(int64_t nanotime, std::range<const uint8_t *> message)
+{
+	auto ptr = Allocate(nanotime, message.size());
+	if (ptr) {
+		std::copy(message.begin(), message.end(), ptr);
+	}
+}
+
+std::range<const uint8_t *> MessageArena::Message(const Entry &entry) const
+{
+	auto ptr = _slabs[entry.slab].data() + entry.offset;
+	return std::make_range(ptr, ptr + entry.length);
+}
+
+void MessageArena::Clear()
+{
+	std::fill(_used.begin(), _used.end(), 0);
+	_slab = 0;
+	_bytes = 0;
+	_index.clear();
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include "range.h"
+#include <vector>
+
+// Bump allocator for a game's messages. Records are stored back to back in
+// fixed size slabs using the .hsl layout (<nanotime 8><message>), so each
+// slab can be written out as-is. Clear keeps the slabs for reuse, so a game
+// that's flushed regularly stops allocating once it's warmed up.
+class MessageArena
+{
+public:
+	struct Entry
+	{
+		int64_t nanotime;
+		uint32_t slab;
+		uint32_t offset; // of the message (just past its nanotime)
+		uint32_t length;
+	};
+
+	explicit MessageArena(size_t slabSize);
+
+	// Reserves space for a message of length bytes (at most the slab size
+	// minus 8), returning where to write it.
+	uint8_t *Allocate(int64_t nanotime, size_t length);
+
+	void Add(int64_t nanotime, std::range<const uint8_t *> message);
+
+	size_t Size() const { return _index.size(); }
+	bool Empty() const { return _index.empty(); }
+	const Entry &operator[](size_t i) const { return _index[i]; }
+	std::range<const uint8_t *> Message(const Entry &entry) const;
+
+	// Total bytes of records stored
+	size_t Bytes() const { return _bytes; }
+
+	// Calls f(range) with the records of each slab in order
+	template <typename F> void ForEachSlab(F f) const
+	{
+		for (auto i = 0u; i < _used.size() && i <= _slab; i++) {
+			if (_used[i] > 0) {
+				f(std::make_range<const uint8_t *>(_slabs[i].data(), _slabs[i].data() + _used[i]));
+			}
+		}
+	}
+
+	void Clear();
+
+private:
+	const size_t _slabSize;
+	std::vector<std::vector<uint8_t>> _slabs;
+	std::vector<size_t> _used;
+	size_t _slab;
+	size_t _bytes;
+	std::vector<Entry> _index;
+
+	MessageArena(const MessageArena &);
+	MessageArena &operator=(const MessageArena &);
+};
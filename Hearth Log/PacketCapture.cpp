@@ -1,18 +1,104 @@
-// wx #includes must come first to prevent secure function warning from wxcrt.h
-#include <wx/log.h>
-#include <wx/translation.h>
-
 #include "PacketCapture.h"
+#include "CaptureLoop.h"
+#include "PacketRing.h"
+#include "Log.h"
 
 #include <pcap.h>
+#include <algorithm>
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <condition_variable>
 #include <set>
+#include <vector>
+
+// Seconds of capture between checks for dropped packets
+const int64_t DROP_CHECK_NANOS = 10 * int64_t(1e9);
+
+// See Configure
+PacketCapture::Options captureOptions;
 
 std::set<std::string> deviceNames;
 std::mutex mu;
 
+// Capture thread bookkeeping (guarded by mu) so Stop can break their loops and wait for them
+std::set<pcap_t *> activeHandles;
+std::vector<std::thread> workers;
+int runningWorkers = 0;
+bool stopping = false;
+std::condition_variable workerDone;
+
+// Registers a capture thread (and the handle it reads, if any), returning
+// false without starting it if capture is stopping
+template <typename F> bool startWorker(F f, pcap_t *pcap = nullptr)
+{
+	std::lock_guard<std::mutex> lock(mu);
+	if (stopping) {
+		return false;
+	}
+
+	if (pcap) {
+		activeHandles.insert(pcap);
+	}
+	runningWorkers++;
+	workers.emplace_back(f);
+	return true;
+}
+
+void endWorker()
+{
+	std::lock_guard<std::mutex> lock(mu);
+	runningWorkers--;
+	workerDone.notify_all();
+}
+
+#ifdef __linux__
+// Single-threaded engine used for live capture where epoll is available
+std::unique_ptr<CaptureLoop> captureLoop;
+
+bool startCaptureLoop(const std::string &filter, PacketCapture::Callback::Factory callbackFactory, const std::string &deviceName)
+{
+	{
+		// Nothing is started once capture has been stopped
+		std::lock_guard<std::mutex> lock(mu);
+		if (stopping) {
+			return true;
+		}
+	}
+
+	captureLoop.reset(new CaptureLoop(filter, callbackFactory, deviceName));
+	if (!captureLoop->Start()) {
+		LogWarning("falling back to a capture thread per device");
+		captureLoop.reset();
+		return false;
+	}
+	return true;
+}
+
+// Multi-threaded AF_PACKET engine, used when Options::ringThreads is set
+std::unique_ptr<PacketRing> packetRing;
+
+bool startPacketRing(const std::string &filter, PacketCapture::Callback::Factory callbackFactory, const std::string &deviceName)
+{
+	{
+		std::lock_guard<std::mutex> lock(mu);
+		if (stopping) {
+			return true;
+		}
+	}
+
+	packetRing.reset(new PacketRing(filter, callbackFactory, deviceName, captureOptions));
+	if (!packetRing->Start()) {
+		LogWarning("falling back to libpcap capture");
+		packetRing.reset();
+		return false;
+	}
+	return true;
+}
+#endif
+
+void openDevice(const std::string &filter, const std::string &deviceName, PacketCapture::Callback::Factory callbackFactory);
+
 int64_t toNanoTime(timeval ts) {
 	const int64_t NSEC_PER_SEC = 1e9;
 	const int64_t NSEC_PER_USEC = 1e3;
@@ -20,12 +106,30 @@ int64_t toNanoTime(timeval ts) {
 	return ts.tv_sec * NSEC_PER_SEC + ts.tv_usec * NSEC_PER_USEC;
 }
 
+void PacketCapture::Configure(const Options &newOptions)
+{
+	captureOptions = newOptions;
+	LogVerbose("capture snaplen %d, buffer %d bytes, timeout %d ms%s", captureOptions.snaplen, captureOptions.bufferSize, captureOptions.timeoutMs, captureOptions.immediate ? ", immediate" : "");
+	if (captureOptions.ringThreads > 0) {
+		LogVerbose("capture from %d AF_PACKET rings where available", captureOptions.ringThreads);
+	}
+}
+
 void PacketCapture::Start(const std::string &filter, Callback::Factory callbackFactory)
 {
-	wxCHECK2(callbackFactory, return);
+	CHECK2(callbackFactory, return);
+
+#ifdef __linux__
+	if (captureOptions.ringThreads > 0 && startPacketRing(filter, callbackFactory, "")) {
+		return;
+	}
+	if (startCaptureLoop(filter, callbackFactory, "")) {
+		return;
+	}
+#endif
 
 	// Start thread
-	auto thread = std::thread([filter, callbackFactory]() {
+	startWorker([filter, callbackFactory]() {
 		char errbuf[PCAP_ERRBUF_SIZE];
 
 		// Continually scan interfaces to handle waking from sleep other reason 
@@ -34,119 +138,334 @@ void PacketCapture::Start(const std::string &filter, Callback::Factory callbackF
 			// Get all devices
 			pcap_if_t *alldevs;
 			if (pcap_findalldevs(&alldevs, errbuf) == -1) {
-				wxLogError("pcap_findalldevs: %s", errbuf);
-				return;
+				LogError("pcap_findalldevs: %s", errbuf);
+				break;
 			}
 	
 			// Enumerate all devices and start a thread for each one
 			// we aren't already listening to.
+			std::vector<pcap_if_t *> added;
 			{
 				std::lock_guard<std::mutex> lock(mu);
 				for (auto dev = alldevs; dev != nullptr; dev = dev->next) {
+					// Skip Linux's "any" pseudo-device since every frame would be seen twice
+					// (use StartDevice to listen to it instead of individual devices).
+					if (std::string(dev->name) == "any") {
+						continue;
+					}
+
 					if (deviceNames.find(dev->name) == deviceNames.end()) {
 						deviceNames.insert(dev->name);
-
-						wxLogMessage("listening to %s (%s)", dev->name, dev->description);
-						Start(filter, dev, callbackFactory);
+						added.push_back(dev);
 					}
 				}
 			}
 
+			// Opened outside the lock since starting a thread takes it too
+			for (auto dev : added) {
+				LogMessage("listening to %s (%s)", dev->name, dev->description);
+				Start(filter, dev, callbackFactory);
+			}
+
 			// Done with the device list
 			pcap_freealldevs(alldevs);
 
-			// Wait a while until the next loop
-			std::this_thread::sleep_for(std::chrono::seconds(60));
+			// Wait a while until the next loop (or until capture is stopped)
+			std::unique_lock<std::mutex> lock(mu);
+			if (workerDone.wait_for(lock, std::chrono::seconds(60), []() { return stopping; })) {
+				break;
+			}
 		}
-	});
 
-	// <thread> will be deleted once it completes
-	thread.detach();
+		endWorker();
+	});
 }
 
 void PacketCapture::Start(const std::string &filter, pcap_if_t *device, Callback::Factory callbackFactory)
 {
-	wxCHECK2(device && callbackFactory, return);
+	CHECK2(device && callbackFactory, return);
+
+	openDevice(filter, device->name, callbackFactory);
+}
+
+void PacketCapture::StartDevice(const std::string &filter, const std::string &deviceName, Callback::Factory callbackFactory)
+{
+	CHECK2(!deviceName.empty() && callbackFactory, return);
+
+#ifdef __linux__
+	if (captureOptions.ringThreads > 0 && startPacketRing(filter, callbackFactory, deviceName)) {
+		return;
+	}
+	if (startCaptureLoop(filter, callbackFactory, deviceName)) {
+		return;
+	}
+#endif
+
+	openDevice(filter, deviceName, callbackFactory);
+}
+
+void openDevice(const std::string &filter, const std::string &deviceName, PacketCapture::Callback::Factory callbackFactory)
+{
+	auto pcap = PacketCapture::OpenLive(deviceName);
+	if (pcap) {
+		PacketCapture::Start(filter, pcap, callbackFactory, deviceName);
+	}
+}
 
+pcap_t *PacketCapture::OpenLive(const std::string &deviceName)
+{
 	char errbuf[PCAP_ERRBUF_SIZE] = "";
 
-	// Open device
-	pcap_t *pcap = pcap_open_live(device->name, 65535, 0, 1000, errbuf);
+	auto pcap = pcap_create(deviceName.c_str(), errbuf);
 	if (!pcap) {
-		wxLogError("pcap_open_live(%s): %s", device->name, errbuf);
-		return;
-	} else if (errbuf[0] != '\0') {
-		wxLogWarning("pcap_open_live(%s): %s", device->name, errbuf);
+		LogError("pcap_create(%s): %s", deviceName.c_str(), errbuf);
+		return nullptr;
 	}
 
-	Start(filter, pcap, callbackFactory, device->name);
+	pcap_set_snaplen(pcap, captureOptions.snaplen);
+	pcap_set_promisc(pcap, 0);
+	pcap_set_timeout(pcap, captureOptions.timeoutMs);
+	if (captureOptions.bufferSize > 0 && pcap_set_buffer_size(pcap, captureOptions.bufferSize) != 0) {
+		LogWarning("pcap_set_buffer_size(%s, %d) failed", deviceName.c_str(), captureOptions.bufferSize);
+	}
+#ifndef _WIN32
+	if (captureOptions.immediate && pcap_set_immediate_mode(pcap, 1) != 0) {
+		LogWarning("pcap_set_immediate_mode(%s) failed", deviceName.c_str());
+	}
+#endif
+
+	// Warnings (like the device not supporting the timeout) still leave it usable
+	auto status = pcap_activate(pcap);
+	if (status < 0) {
+		LogError("pcap_activate(%s): %s %s", deviceName.c_str(), pcap_statustostr(status), pcap_geterr(pcap));
+		pcap_close(pcap);
+		return nullptr;
+	} else if (status > 0) {
+		LogWarning("pcap_activate(%s): %s %s", deviceName.c_str(), pcap_statustostr(status), pcap_geterr(pcap));
+	}
+
+#ifdef _WIN32
+	// WinPcap has no immediate mode, but copying with nothing buffered is the same
+	if (captureOptions.immediate && pcap_setmintocopy(pcap, 0) != 0) {
+		LogWarning("pcap_setmintocopy(%s) failed", deviceName.c_str());
+	}
+#endif
+	return pcap;
 }
 
 void PacketCapture::Start(const std::string &filter, const std::string &file, Callback::Factory callbackFactory)
 {
-	wxCHECK2(!file.empty() && callbackFactory, return);
+	CHECK2(!file.empty() && callbackFactory, return);
 
 	char errbuf[PCAP_ERRBUF_SIZE];
 
 	// Open the file
 	pcap_t *pcap = pcap_open_offline(file.c_str(), errbuf);
 	if (!pcap) {
-		wxLogError("pcap_open_offline(%s): %s", file, errbuf);
+		LogError("pcap_open_offline(%s): %s", file.c_str(), errbuf);
 		return;
 	}
 
 	Start(filter, pcap, callbackFactory);
 }
 
-void PacketCapture::Start(const std::string &filter, pcap_t *pcap, Callback::Factory callbackFactory, std::string deviceName)
+bool PacketCapture::ReadFile(const std::string &filter, const std::string &file, Callback &callback)
 {
-	wxCHECK2(pcap && callbackFactory, return);
+	char errbuf[PCAP_ERRBUF_SIZE];
 
-	// Filter
-	if (!filter.empty()) {
-		bpf_program bpf;
-		if (pcap_compile(pcap, &bpf, filter.c_str(), 1, 0) == -1) {
-			wxLogError("pcap_compile(%s): %s", filter, pcap_geterr(pcap));
-			return;
-		}
+	pcap_t *pcap = pcap_open_offline(file.c_str(), errbuf);
+	if (!pcap) {
+		LogError("pcap_open_offline(%s): %s", file.c_str(), errbuf);
+		return false;
+	}
 
-		if (pcap_setfilter(pcap, &bpf) == -1) {
-			wxLogError("pcap_setfilter(%s): %s", filter, pcap_geterr(pcap));
-			return;
+	auto ok = SetFilter(pcap, filter);
+	if (ok) {
+		Context context = { &callback, pcap_datalink(pcap), nullptr, nullptr, 0, 0 };
+		if (pcap_loop(pcap, -1, Handler, (uint8_t*)&context) == -1) {
+			LogError("pcap_loop(%s): %s", file.c_str(), pcap_geterr(pcap));
+			ok = false;
 		}
 	}
 
-	// Start thread
-	auto thread = std::thread([pcap, callbackFactory, deviceName]() {
-		auto handler = [](uint8_t *user, const pcap_pkthdr *header, const uint8_t *packet) {
-			if (header->caplen < header->len) {
-				wxLogWarning("truncated packet (%d of %d bytes)", header->caplen, header->len);
-				// Will likely fail during packet parsing (truncated payload)
-			}
+	pcap_close(pcap);
+	return ok;
+}
 
-			auto&& time = toNanoTime(header->ts);
-			auto&& data = std::make_range(packet, packet + header->caplen);
+void PacketCapture::Start(const std::string &filter, pcap_t *pcap, Callback::Factory callbackFactory, std::string deviceName)
+{
+	CHECK2(pcap && callbackFactory, return);
 
-			(*(Callback*)user)(time, data);
-		};
+	// Filter
+	if (!SetFilter(pcap, filter)) {
+		pcap_close(pcap);
+		return;
+	}
+
+	// Link-layer header type, passed along with each frame so it can be decoded
+	auto linkType = pcap_datalink(pcap);
+	LogVerbose("%s link type: %d", deviceName.c_str(), linkType);
 
+	// Start thread
+	auto started = startWorker([pcap, linkType, callbackFactory, deviceName]() {
 		Callback::Ptr callback = callbackFactory();
-		// Read packets
-		if (pcap_loop(pcap, -1, handler, (uint8_t*)callback.get()) < 0) {
-			wxLogError("pcap_loop: %s", pcap_geterr(pcap));
+		Context context = { callback.get(), linkType, deviceName.empty() ? nullptr : pcap, deviceName.c_str(), 0, 0 };
+
+		// Read packets (until the device goes away or Stop breaks the loop)
+		auto result = pcap_loop(pcap, -1, Handler, (uint8_t*)&context);
+		if (result == -1) {
+			LogError("pcap_loop: %s", pcap_geterr(pcap));
 		}
 
-		wxLogWarning("pcap_loop exited");
+		// Unregister before closing so Stop never breaks a closed handle
+		{
+			std::lock_guard<std::mutex> lock(mu);
+			activeHandles.erase(pcap);
+		}
+
+		if (result != -2) {
+			LogWarning("pcap_loop exited");
+		}
+		if (context.pcap) {
+			CheckDrops(context, true);
+		}
 		pcap_close(pcap);
 
+		// Flush anything still buffered by the parser
+		callback.reset();
+
 		// We are no longer listening to this device, but if it becomes 
 		// available again the outter loop will start a new thread.
 		{
 			std::lock_guard<std::mutex> lock(mu);
 			deviceNames.erase(deviceName);
 		}
-	});
 
-	// <thread> will be deleted once it completes
-	thread.detach();
+		endWorker();
+	}, pcap);
+
+	if (!started) {
+		pcap_close(pcap);
+	}
+}
+
+bool PacketCapture::Stop(int timeoutMs)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+	auto stopped = true;
+
+#ifdef __linux__
+	// Each engine only gets what's left of the time
+	auto remainingMs = [deadline]() {
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		return int(std::max<long long>(0, left));
+	};
+
+	if (captureLoop) {
+		if (captureLoop->Stop(remainingMs())) {
+			captureLoop.reset();
+		} else {
+			// Still running, so it can't be destroyed (leaked on purpose since we're exiting)
+			captureLoop.release();
+			stopped = false;
+		}
+	}
+	if (packetRing) {
+		if (packetRing->Stop(remainingMs())) {
+			packetRing.reset();
+		} else {
+			packetRing.release();
+			stopped = false;
+		}
+	}
+#endif
+
+	std::vector<std::thread> threads;
+	{
+		std::unique_lock<std::mutex> lock(mu);
+		stopping = true;
+
+		// Wake the capture threads (and the device scan, which waits on workerDone)
+		for (auto pcap : activeHandles) {
+			pcap_breakloop(pcap);
+		}
+		workerDone.notify_all();
+
+		// Each thread flushes its parser before it finishes
+		if (!workerDone.wait_until(lock, deadline, []() { return runningWorkers == 0; })) {
+			LogWarning("%d capture threads still running after %d ms", runningWorkers, timeoutMs);
+			stopped = false;
+		}
+		threads.swap(workers);
+	}
+
+	for (auto &thread : threads) {
+		if (stopped) {
+			thread.join();
+		} else {
+			thread.detach();
+		}
+	}
+
+	return stopped;
+}
+
+void PacketCapture::Handler(uint8_t *user, const pcap_pkthdr *header, const uint8_t *packet)
+{
+	if (header->caplen < header->len) {
+		LogWarning("truncated packet (%d of %d bytes)", header->caplen, header->len);
+		// Will likely fail during packet parsing (truncated payload)
+	}
+
+	auto&& time = toNanoTime(header->ts);
+	auto&& data = std::make_range(packet, packet + header->caplen);
+
+	auto context = reinterpret_cast<Context *>(user);
+	(*context->callback)(time, context->linkType, data);
+
+	// Checked as packets arrive, since there's nothing to lose while none do
+	if (context->pcap && time >= context->nextCheck) {
+		context->nextCheck = time + DROP_CHECK_NANOS;
+		CheckDrops(*context);
+	}
+}
+
+void PacketCapture::CheckDrops(Context &context, bool closing)
+{
+	pcap_stat stats;
+	if (pcap_stats(context.pcap, &stats) != 0) {
+		return; // (not every platform has them)
+	}
+
+	// Counters may wrap, so compare the difference
+	auto drops = stats.ps_drop + stats.ps_ifdrop;
+	if (drops - context.drops > 0) {
+		LogWarning("%s dropped %u packets (%u received), a bigger capture buffer may help",
+			context.device, drops - context.drops, stats.ps_recv);
+		context.drops = drops;
+	}
+	if (closing) {
+		LogVerbose("%s: %u packets received, %u dropped by the kernel, %u by the interface",
+			context.device, stats.ps_recv, stats.ps_drop, stats.ps_ifdrop);
+	}
+}
+
+bool PacketCapture::SetFilter(pcap_t *pcap, const std::string &filter)
+{
+	if (filter.empty()) {
+		return true;
+	}
+
+	bpf_program bpf;
+	if (pcap_compile(pcap, &bpf, filter.c_str(), 1, 0) == -1) {
+		LogError("pcap_compile(%s): %s", filter.c_str(), pcap_geterr(pcap));
+		return false;
+	}
+
+	auto ok = pcap_setfilter(pcap, &bpf) != -1;
+	if (!ok) {
+		LogError("pcap_setfilter(%s): %s", filter.c_str(), pcap_geterr(pcap));
+	}
+	pcap_freecode(&bpf);
+	return ok;
 }
@@ -8,21 +8,74 @@
 // From pcap.h
 typedef struct pcap_if pcap_if_t;
 typedef struct pcap pcap_t;
+struct pcap_pkthdr;
 
 class PacketCapture
 {
 public:
 	struct Callback
 	{
-		virtual void operator()(int64_t nanotime, std::range<const uint8_t*> data) = 0;
+		// linkType is the pcap_datalink() value (DLT_*) of the capturing handle
+		virtual void operator()(int64_t nanotime, int linkType, std::range<const uint8_t*> data) = 0;
 		virtual ~Callback() { }
 
 		typedef std::unique_ptr<Callback> Ptr;
 		typedef Ptr (*Factory)();
 	};
 
+	// How live devices are opened
+	struct Options
+	{
+		Options() : snaplen(65535), bufferSize(0), timeoutMs(1000), immediate(false), ringThreads(0) { }
+
+		int snaplen;     // bytes kept of each frame
+		int bufferSize;  // kernel buffer in bytes (0 keeps libpcap's default, 2 MB on Linux)
+		int timeoutMs;   // how long the kernel may hold packets to deliver them together
+		bool immediate;  // deliver each packet as soon as it arrives
+		int ringThreads; // Linux: capture from AF_PACKET rings on this many threads instead of libpcap
+	};
+
+	// Set before starting capture
+	static void Configure(const Options &options);
+
 	static void Start(const std::string &filter,                           Callback::Factory callbackFactory);
 	static void Start(const std::string &filter, pcap_if_t *device,        Callback::Factory callbackFactory);
 	static void Start(const std::string &filter, const std::string &file,  Callback::Factory callbackFactory);
 	static void Start(const std::string &filter, pcap_t *pcap,             Callback::Factory callbackFactory, std::string deviceName = "");
+
+	// Listen to a single device by name (e.g. "any" on Linux to capture every interface with one handle)
+	static void StartDevice(const std::string &filter, const std::string &deviceName, Callback::Factory callbackFactory);
+
+	// Reads a whole capture file (pcap or pcapng) on the calling thread, returning
+	// false if it couldn't be opened or read. Independent of Start and Stop, so
+	// several files can be read at once on different threads.
+	static bool ReadFile(const std::string &filter, const std::string &file, Callback &callback);
+
+	// Stops all capture, waiting up to timeoutMs for the callbacks to be destroyed
+	// (flushing any buffered data). Returns false if capture didn't stop in time.
+	// Nothing can be started afterwards.
+	static bool Stop(int timeoutMs);
+
+	// Shared by the capture backends
+	struct Context
+	{
+		Callback *callback;
+		int linkType;
+		pcap_t *pcap;       // live devices only, checked for drops
+		const char *device;
+		unsigned drops;     // reported so far
+		int64_t nextCheck;  // nanotime to look for drops again
+	};
+
+	// pcap_handler passing each frame to the callback of the Context pointed to by user
+	static void Handler(uint8_t *user, const pcap_pkthdr *header, const uint8_t *packet);
+
+	// Opens a live device with the configured options (logging why if it can't)
+	static pcap_t *OpenLive(const std::string &deviceName);
+
+	// Warns about packets pcap_stats says were dropped since the last check,
+	// and when closing logs the totals
+	static void CheckDrops(Context &context, bool closing = false);
+
+	static bool SetFilter(pcap_t *pcap, const std::string &filter);
 };
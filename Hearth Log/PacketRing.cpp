@@ -0,0 +1,352 @@
+#include "PacketRing.h"
+#include "Log.h"
+
+#ifdef __linux__
+
+#include <pcap.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Frames come without their link-layer header (SOCK_DGRAM), so they're
+// raw IP whatever the device
+const int RING_LINK_TYPE = DLT_RAW;
+
+// Ring geometry: the kernel hands over a block once it's full or has been
+// open for the read timeout
+const size_t BLOCK_SIZE = 1 << 20;
+const size_t DEFAULT_RING_SIZE = 8 << 20;
+const unsigned FRAME_SIZE = 2048; // only for the kernel's checks, V3 frames are variable
+
+// Seconds of capture between checks for dropped packets
+const int64_t DROP_CHECK_NANOS = 10 * int64_t(1e9);
+
+namespace {
+
+// Compiles the pcap filter for raw IP (bpf_insn has sock_filter's layout).
+// The program returns snaplen for the frames it accepts, and the kernel
+// keeps that many bytes of each.
+bool compileFilter(const std::string &filter, int snaplen, bpf_program &bpf)
+{
+	auto dead = pcap_open_dead(RING_LINK_TYPE, snaplen);
+	if (!dead) {
+		LogError("pcap_open_dead failed");
+		return false;
+	}
+
+	auto ok = pcap_compile(dead, &bpf, filter.c_str(), 1, PCAP_NETMASK_UNKNOWN) != -1;
+	if (!ok) {
+		LogError("pcap_compile(%s): %s", filter.c_str(), pcap_geterr(dead));
+	}
+	pcap_close(dead);
+	return ok;
+}
+
+} // namespace
+
+PacketRing::Ring::Ring()
+	: fd(-1),
+	  map(nullptr),
+	  blockSize(0),
+	  blocks(0),
+	  name(),
+	  packets(0),
+	  drops(0)
+{
+}
+
+PacketRing::Ring::~Ring()
+{
+	if (map) {
+		munmap(map, blockSize * blocks);
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+}
+
+PacketRing::PacketRing(const std::string &filter, PacketCapture::Callback::Factory callbackFactory, const std::string &deviceName, const PacketCapture::Options &options)
+	: _filter(filter),
+	  _callbackFactory(callbackFactory),
+	  _deviceName(deviceName),
+	  _options(options),
+	  _wake(-1),
+	  _loopback(0),
+	  _rings(),
+	  _workers(),
+	  _mu(),
+	  _done(),
+	  _running(0)
+{
+}
+
+PacketRing::~PacketRing()
+{
+	Stop();
+
+	_rings.clear();
+	if (_wake != -1) {
+		close(_wake);
+	}
+}
+
+bool PacketRing::Start()
+{
+	CHECK(_callbackFactory && _options.ringThreads > 0 && _workers.empty(), false);
+
+	auto ifindex = 0;
+	if (!_deviceName.empty() && _deviceName != "any") {
+		ifindex = int(if_nametoindex(_deviceName.c_str()));
+		if (ifindex == 0) {
+			LogError("if_nametoindex(%s): %s", _deviceName.c_str(), strerror(errno));
+			return false;
+		}
+	}
+	_loopback = int(if_nametoindex("lo"));
+
+	// Used by Stop to wake every thread (it's never read, so it stays readable)
+	_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_wake == -1) {
+		LogError("eventfd: %s", strerror(errno));
+		return false;
+	}
+
+	// Every ring is opened before any thread starts so a failure can fall back cleanly
+	auto fanoutId = int(getpid() & 0xffff);
+	for (auto i = 0; i < _options.ringThreads; i++) {
+		std::unique_ptr<Ring> ring(new Ring);
+		ring->name = (_deviceName.empty() ? std::string("any") : _deviceName) + " ring " + std::to_string(static_cast<long long>(i));
+		if (!Open(*ring, ifindex, _options.ringThreads > 1 ? fanoutId : -1)) {
+			return false;
+		}
+		_rings.push_back(std::move(ring));
+	}
+
+	std::lock_guard<std::mutex> lock(_mu);
+	for (auto &ring : _rings) {
+		auto r = ring.get();
+		_running++;
+		_workers.emplace_back([this, r]() { Run(*r); });
+	}
+	LogMessage("capturing from %d TPACKET_V3 rings on %s", int(_rings.size()), _deviceName.empty() ? "every device" : _deviceName.c_str());
+	return true;
+}
+
+bool PacketRing::Open(Ring &ring, int ifindex, int fanoutId)
+{
+	// No protocol yet, so nothing is queued before the filter is attached
+	ring.fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (ring.fd == -1) {
+		LogError("socket(AF_PACKET): %s", strerror(errno));
+		return false;
+	}
+
+	int version = TPACKET_V3;
+	if (setsockopt(ring.fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+		LogError("setsockopt(PACKET_VERSION): %s", strerror(errno));
+		return false;
+	}
+
+	auto ringSize = _options.bufferSize > 0 ? size_t(_options.bufferSize) : DEFAULT_RING_SIZE;
+	ring.blockSize = BLOCK_SIZE;
+	ring.blocks = unsigned(std::max<size_t>(2, ringSize / BLOCK_SIZE));
+
+	tpacket_req3 req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = unsigned(ring.blockSize);
+	req.tp_block_nr = ring.blocks;
+	req.tp_frame_size = FRAME_SIZE;
+	req.tp_frame_nr = unsigned(ring.blockSize / FRAME_SIZE) * ring.blocks;
+	req.tp_retire_blk_tov = _options.immediate ? 1 : unsigned(std::max(1, _options.timeoutMs));
+	if (setsockopt(ring.fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+		LogError("setsockopt(PACKET_RX_RING, %u blocks): %s", ring.blocks, strerror(errno));
+		return false;
+	}
+
+	auto map = mmap(nullptr, ring.blockSize * ring.blocks, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, 0);
+	if (map == MAP_FAILED) {
+		LogError("mmap(packet ring): %s", strerror(errno));
+		return false;
+	}
+	ring.map = static_cast<uint8_t *>(map);
+
+	// Attached even without a filter, since it's what applies the snaplen
+	bpf_program bpf;
+	if (!compileFilter(_filter, _options.snaplen, bpf)) {
+		return false;
+	}
+
+	sock_fprog program;
+	program.len = static_cast<unsigned short>(bpf.bf_len);
+	program.filter = reinterpret_cast<sock_filter *>(bpf.bf_insns);
+	auto attached = setsockopt(ring.fd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) != -1;
+	pcap_freecode(&bpf);
+	if (!attached) {
+		LogError("setsockopt(SO_ATTACH_FILTER): %s", strerror(errno));
+		return false;
+	}
+
+	sockaddr_ll addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = ifindex;
+	if (bind(ring.fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+		LogError("bind(AF_PACKET): %s", strerror(errno));
+		return false;
+	}
+
+	// The kernel's flow hash is symmetric, so both directions of a
+	// connection go to the same ring
+	if (fanoutId >= 0) {
+		int fanout = fanoutId | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+		if (setsockopt(ring.fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) == -1) {
+			LogError("setsockopt(PACKET_FANOUT): %s", strerror(errno));
+			return false;
+		}
+	}
+
+	LogVerbose("%s: %u blocks of %d bytes", ring.name.c_str(), ring.blocks, int(ring.blockSize));
+	return true;
+}
+
+void PacketRing::Run(Ring &ring)
+{
+	// Each ring has its own callback (and so its own parser state)
+	auto callback = _callbackFactory();
+	int64_t nextCheck = 0;
+
+	pollfd fds[2];
+	fds[0].fd = ring.fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = _wake;
+	fds[1].events = POLLIN;
+
+	unsigned block = 0;
+	unsigned draining = 0; // blocks left to read once stopping (0 while running)
+	while (1) {
+		auto desc = reinterpret_cast<tpacket_block_desc *>(ring.map + block * ring.blockSize);
+
+		// Wait for the kernel to hand the block over
+		if (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			if (draining) {
+				break;
+			}
+			fds[0].revents = fds[1].revents = 0;
+			if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+				LogError("poll(%s): %s", ring.name.c_str(), strerror(errno));
+				break;
+			}
+			if (fds[1].revents) {
+				// Stopping: still parse the blocks already filled (at most one
+				// pass over the ring, so a busy device can't keep us here)
+				draining = ring.blocks;
+				continue;
+			}
+			if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+				LogError("%s: socket error", ring.name.c_str());
+				break;
+			}
+			continue;
+		}
+
+		// Every frame in the block goes to the callback straight from the ring
+		auto count = desc->hdr.bh1.num_pkts;
+		auto frame = reinterpret_cast<const uint8_t *>(desc) + desc->hdr.bh1.offset_to_first_pkt;
+		int64_t nanotime = 0;
+		for (auto i = 0u; i < count; i++) {
+			auto header = reinterpret_cast<const tpacket3_hdr *>(frame);
+			auto from = reinterpret_cast<const sockaddr_ll *>(frame + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+
+			// Loopback frames are seen going out and coming back in
+			if (!(from->sll_pkttype == PACKET_OUTGOING && from->sll_ifindex == _loopback)) {
+				nanotime = int64_t(header->tp_sec) * int64_t(1e9) + header->tp_nsec;
+				auto data = frame + header->tp_mac;
+				(*callback)(nanotime, RING_LINK_TYPE, std::make_range(data, data + header->tp_snaplen));
+			}
+			frame += header->tp_next_offset;
+		}
+		ring.packets += count;
+
+		// Give the block back
+		__atomic_store_n(&desc->hdr.bh1.block_status, unsigned(TP_STATUS_KERNEL), __ATOMIC_RELEASE);
+		block = (block + 1) % ring.blocks;
+		if (draining && --draining == 0) {
+			break;
+		}
+
+		if (nanotime >= nextCheck) {
+			nextCheck = nanotime + DROP_CHECK_NANOS;
+			CheckDrops(ring, false);
+		}
+	}
+
+	CheckDrops(ring, true);
+
+	// Flush anything still buffered by the parser before reporting that we're done
+	callback.reset();
+
+	std::lock_guard<std::mutex> lock(_mu);
+	_running--;
+	_done.notify_all();
+}
+
+void PacketRing::CheckDrops(Ring &ring, bool closing)
+{
+	// Reading the counters resets them
+	tpacket_stats_v3 stats;
+	socklen_t size = sizeof(stats);
+	if (getsockopt(ring.fd, SOL_PACKET, PACKET_STATISTICS, &stats, &size) == -1) {
+		return;
+	}
+
+	if (stats.tp_drops > 0) {
+		ring.drops += stats.tp_drops;
+		LogWarning("%s dropped %u packets (%u received), a bigger capture buffer may help",
+			ring.name.c_str(), stats.tp_drops, stats.tp_packets);
+	}
+	if (closing) {
+		LogVerbose("%s: %llu packets received, %llu dropped",
+			ring.name.c_str(), static_cast<unsigned long long>(ring.packets), static_cast<unsigned long long>(ring.drops));
+	}
+}
+
+bool PacketRing::Stop(int timeoutMs)
+{
+	if (_workers.empty()) {
+		return true;
+	}
+
+	uint64_t one = 1;
+	if (write(_wake, &one, sizeof(one)) != sizeof(one)) {
+		LogError("write(eventfd): %s", strerror(errno));
+	}
+
+	if (timeoutMs >= 0) {
+		std::unique_lock<std::mutex> lock(_mu);
+		if (!_done.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return _running == 0; })) {
+			LogWarning("%d capture rings still running after %d ms", _running, timeoutMs);
+			return false;
+		}
+	}
+
+	for (auto &worker : _workers) {
+		worker.join();
+	}
+	_workers.clear();
+	return true;
+}
+
+#endif // __linux__
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "PacketCapture.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+
+// Linux capture engine reading AF_PACKET TPACKET_V3 rings. The filter runs in
+// the kernel, which fills blocks of frames in memory shared with us, so
+// frames reach the callback a block at a time straight from the ring (no
+// copy or system call per packet). With more than one thread each has its
+// own socket and callback, and the sockets join a PACKET_FANOUT group that
+// hashes on the flow (the same both ways), so every connection is parsed on
+// one thread.
+class PacketRing
+{
+public:
+	// An empty deviceName (or "any") captures on every device. Runs
+	// options.ringThreads threads, each with a ring of options.bufferSize.
+	PacketRing(const std::string &filter, PacketCapture::Callback::Factory callbackFactory, const std::string &deviceName, const PacketCapture::Options &options);
+	~PacketRing();
+
+	bool Start();
+
+	// Waits up to timeoutMs (forever if negative) for the threads to exit and
+	// destroy their callbacks. Returns false if some are still running.
+	bool Stop(int timeoutMs = -1);
+
+private:
+	// A socket, its ring and the thread reading it (unmapped and closed on destruction)
+	struct Ring
+	{
+		Ring();
+		~Ring();
+
+		int fd;
+		uint8_t *map;
+		size_t blockSize;
+		unsigned blocks;
+		std::string name; // for logging
+		uint64_t packets;
+		uint64_t drops;
+
+	private:
+		Ring(const Ring &);
+		Ring &operator=(const Ring &);
+	};
+
+	const std::string _filter;
+	const PacketCapture::Callback::Factory _callbackFactory;
+	const std::string _deviceName;
+	const PacketCapture::Options _options;
+
+	int _wake;
+	int _loopback; // ifindex of lo, whose outgoing frames are also seen incoming
+	std::vector<std::unique_ptr<Ring>> _rings;
+	std::vector<std::thread> _workers;
+	std::mutex _mu;
+	std::condition_variable _done;
+	int _running;
+
+	bool Open(Ring &ring, int ifindex, int fanoutId);
+	void Run(Ring &ring);
+	void CheckDrops(Ring &ring, bool closing);
+
+	PacketRing(const PacketRing &);
+	PacketRing &operator=(const PacketRing &);
+};
+
+#endif // __linux__
@@ -3,8 +3,6 @@
 #include <wx/event.h>
 #include <wx/taskbar.h>
 
-wxDECLARE_EVENT(HSL_LOG_AVAILABLE_EVENT, wxCommandEvent);
-
 class wxFrame;
 
 class TaskBarIcon : public wxTaskBarIcon
@@ -17,10 +15,6 @@ public:
 	void OnLog(wxCommandEvent &event);
 	void OnUploadKey(wxCommandEvent &event);
 
-	void OnLogSaved(wxCommandEvent &event);
-
-	void UploadAll();
-
 protected:
 	virtual wxMenu *CreatePopupMenu();
 
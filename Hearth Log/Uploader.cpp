@@ -0,0 +1,473 @@
+#include "Uploader.h"
+#include "File.h"
+#include "Http.h"
+#include "Log.h"
+#include "hsl/Codec.h"
+#include "hsl/Index.h"
+#include "util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+// Wait after the first failure, doubled after each one after that
+const int FIRST_BACKOFF_SECONDS = 5;
+const int MAX_BACKOFF_SECONDS = 10 * 60;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+enum Result
+{
+	UPLOADED,
+	RETRY,   // the server couldn't be reached or had trouble
+	SKIPPED, // refused or unreadable, left in Logged/ until the next AddPending
+	DEFERRED, // didn't fit in the batch
+};
+
+// Uploader state (all guarded by uploadMutex)
+std::mutex uploadMutex;
+std::condition_variable uploadReady; // a game was queued, the key or backoff changed or we're stopping
+std::condition_variable uploadersDone;
+std::condition_variable uploadDone; // an upload finished or failed
+std::deque<std::string> uploadQueue;
+std::set<std::string> uploadQueued; // queued or being uploaded
+std::vector<std::thread> uploadThreads;
+Uploader::Settings uploadSettings;
+Clock::time_point retryAt;
+Clock::time_point failingSince; // when the current run of failures started
+int backoffSeconds = 0;
+int runningUploaders = 0;
+bool uploadStopping = false;
+bool warnedNoKey = false;
+Uploader::Stats uploadStats;
+
+std::string baseName(const std::string &path)
+{
+	auto slash = path.find_last_of("/\\");
+	return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// Whether the server speaks /upload/batch (cleared if it says it doesn't)
+bool batchSupported = true;
+
+// Tells the server how the file was compressed and whether it's indexed
+std::string contentType(std::range<const uint8_t *> data)
+{
+	hsl::Index index;
+	return std::string(index.Read(data) ? "application/hearthlog-indexed+" : "application/hearthlog+") + hsl::CodecName(hsl::DetectCodec(data));
+}
+
+// Maps a queued game so it's sent straight from the file (keeping memory use
+// flat however big it is). It's skipped if that fails.
+bool mapGame(const std::string &path, file::Mapping &game)
+{
+	if (game.Open(path)) {
+		return true;
+	}
+	if (file::Exists(path)) {
+		LogError("couldn't read %s", path.c_str());
+	}
+	return false; // (if it's gone it was already uploaded)
+}
+
+// What to do with a game the server answered status for
+Result statusResult(const std::string &name, int status)
+{
+	if (status / 100 == 2) {
+		return UPLOADED;
+	}
+	if (status == 408 || status == 429 || status / 100 == 5) {
+		LogWarning("server couldn't take %s (%d)", name.c_str(), status);
+		return RETRY;
+	}
+	LogError("server refused %s (%d)", name.c_str(), status);
+	return SKIPPED;
+}
+
+void moveToUploaded(const std::string &path, const std::string &dataDir)
+{
+	auto dir = file::Join(dataDir, "Uploaded");
+	auto dst = file::Join(dir, baseName(path));
+	if (!file::MakeDirs(dir)) {
+		LogError("error creating upload directory: %s", dir.c_str());
+		return;
+	}
+
+	// This should't happen, but check and log just in case
+	if (file::Exists(dst)) {
+		LogWarning("overwriting existing game: %s", dst.c_str());
+	}
+	if (!file::Rename(path, dst)) {
+		LogError("couldn't move %s to %s", path.c_str(), dst.c_str());
+	}
+}
+
+Result upload(HttpConnection &http, const std::string &path, const std::string &key)
+{
+	auto name = baseName(path);
+
+	file::Mapping game;
+	if (!mapGame(path, game)) {
+		return SKIPPED;
+	}
+
+	HttpConnection::Response response;
+	if (!http.Post("/upload?key=" + key, contentType(game.Data()), std::vector<HttpConnection::Piece>(1, game.Data()), response)) {
+		LogWarning("couldn't upload %s: %s", name.c_str(), http.Error().c_str());
+		return RETRY;
+	}
+	LogVerbose("upload %s: %d %s", name.c_str(), response.status, response.body.c_str());
+
+	auto result = statusResult(name, response.status);
+	if (result == UPLOADED) {
+		std::lock_guard<std::mutex> lock(uploadMutex);
+		uploadStats.bytes += game.Data().size();
+	}
+	return result;
+}
+
+template <typename T> void append(std::vector<uint8_t> &out, const T &value)
+{
+	auto p = reinterpret_cast<const uint8_t *>(&value);
+	out.insert(out.end(), p, p + sizeof(value));
+}
+
+void appendString(std::vector<uint8_t> &out, const std::string &s)
+{
+	append(out, uint32_t(s.size()));
+	out.insert(out.end(), s.begin(), s.end());
+}
+
+// Uploads several games in one request. The body is "HSLB" followed by
+//
+//   <name length 4><name><type length 4><content type><size 4><.hsl file>
+//
+// for each game (little endian, names without a directory). The server
+// answers 200 with a line per game it handled, "<status> <name>", where
+// status means what it would for the game on its own. Games it doesn't
+// mention are retried.
+void uploadBatch(HttpConnection &http, const std::vector<std::string> &paths, const std::string &key, size_t maxBytes, std::vector<Result> &results)
+{
+	static const char MAGIC[] = { 'H', 'S', 'L', 'B' };
+
+	// Only the framing is built here, the games are sent from their mappings.
+	// Games that don't fit go back in the queue.
+	results.assign(paths.size(), DEFERRED);
+	std::vector<size_t> sent;
+	std::vector<std::unique_ptr<file::Mapping>> games;
+	std::vector<uint8_t> frames(MAGIC, MAGIC + sizeof(MAGIC));
+	std::vector<size_t> frameEnds;
+	size_t bodySize = frames.size();
+	for (size_t i = 0; i < paths.size(); i++) {
+		auto game = std::make_unique<file::Mapping>();
+		if (!mapGame(paths[i], *game)) {
+			results[i] = SKIPPED;
+			continue;
+		}
+		auto data = game->Data();
+		if (!sent.empty() && bodySize + size_t(data.size()) > maxBytes) {
+			break;
+		}
+
+		auto start = frames.size();
+		appendString(frames, baseName(paths[i]));
+		appendString(frames, contentType(data));
+		append(frames, uint32_t(data.size()));
+		frameEnds.push_back(frames.size());
+		bodySize += frames.size() - start + size_t(data.size());
+
+		sent.push_back(i);
+		games.push_back(std::move(game));
+	}
+	if (sent.empty()) {
+		return;
+	}
+
+	std::vector<HttpConnection::Piece> body;
+	for (size_t n = 0, start = 0; n < games.size(); start = frameEnds[n++]) {
+		body.push_back(std::make_range<const uint8_t *>(frames.data() + start, frames.data() + frameEnds[n]));
+		body.push_back(games[n]->Data());
+	}
+
+	HttpConnection::Response response;
+	if (!http.Post("/upload/batch?key=" + key, "application/hearthlog-batch", body, response)) {
+		LogWarning("couldn't upload %d games: %s", int(sent.size()), http.Error().c_str());
+		for (auto i : sent) {
+			results[i] = RETRY;
+		}
+		return;
+	}
+	LogVerbose("upload %d games (%d bytes): %d", int(sent.size()), int(bodySize), response.status);
+
+	if (response.status == 404 || response.status == 405 || response.status == 501) {
+		std::lock_guard<std::mutex> lock(uploadMutex);
+		if (batchSupported) {
+			LogMessage("server doesn't take batches, uploading games one at a time");
+			batchSupported = false;
+		}
+		return;
+	}
+	if (response.status / 100 != 2) {
+		auto result = statusResult(std::to_string(static_cast<long long>(sent.size())) + " games", response.status);
+		for (auto i : sent) {
+			results[i] = result;
+		}
+		return;
+	}
+
+	// 200 1400001000.hsl
+	std::map<std::string, int> acks;
+	size_t start = 0;
+	while (start < response.body.size()) {
+		auto end = response.body.find('\n', start);
+		if (end == std::string::npos) {
+			end = response.body.size();
+		}
+		auto line = response.body.substr(start, end - start);
+		auto space = line.find(' ');
+		if (space != std::string::npos) {
+			auto name = line.substr(space + 1);
+			if (!name.empty() && name[name.size() - 1] == '\r') {
+				name.erase(name.size() - 1);
+			}
+			acks[name] = atoi(line.c_str());
+		}
+		start = end + 1;
+	}
+
+	uint64_t bytes = 0;
+	for (size_t n = 0; n < sent.size(); n++) {
+		auto i = sent[n];
+		auto name = baseName(paths[i]);
+		auto ack = acks.find(name);
+		if (ack == acks.end()) {
+			LogWarning("server didn't answer for %s", name.c_str());
+			results[i] = RETRY;
+			continue;
+		}
+		results[i] = statusResult(name, ack->second);
+		if (results[i] == UPLOADED) {
+			bytes += games[n]->Data().size();
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(uploadMutex);
+	uploadStats.bytes += bytes;
+}
+
+void uploaderLoop()
+{
+	std::unique_lock<std::mutex> lock(uploadMutex);
+	HttpConnection http(uploadSettings.host, uploadSettings.port, uploadSettings.timeoutSeconds);
+	auto dataDir = uploadSettings.dataDir;
+	std::vector<std::string> paths;
+	std::vector<Result> results;
+
+	while (!uploadStopping) {
+		if (uploadQueue.empty() || uploadSettings.key.empty()) {
+			uploadReady.wait(lock);
+			continue;
+		}
+		if (Clock::now() < retryAt) {
+			uploadReady.wait_until(lock, retryAt);
+			continue;
+		}
+
+		// Take as many games as a batch holds (other workers get the rest)
+		auto batchGames = batchSupported ? std::max(1, uploadSettings.batchGames) : 1;
+		paths.clear();
+		while (!uploadQueue.empty() && int(paths.size()) < batchGames) {
+			paths.push_back(uploadQueue.front());
+			uploadQueue.pop_front();
+		}
+		auto key = uploadSettings.key;
+		auto batchBytes = uploadSettings.batchBytes;
+		uploadStats.requests++;
+
+		// Uploading happens without the lock
+		lock.unlock();
+		if (paths.size() == 1) {
+			results.assign(1, upload(http, paths[0], key));
+		} else {
+			uploadBatch(http, paths, key, batchBytes, results);
+		}
+		for (size_t i = 0; i < paths.size(); i++) {
+			if (results[i] == UPLOADED) {
+				moveToUploaded(paths[i], dataDir);
+			}
+		}
+		lock.lock();
+		uploadDone.notify_all();
+
+		// Put back what's left in the same order
+		auto failed = false;
+		for (auto i = paths.size(); i-- > 0;) {
+			switch (results[i]) {
+			case UPLOADED:
+				uploadStats.uploaded++;
+				uploadQueued.erase(paths[i]);
+				break;
+			case SKIPPED:
+				uploadStats.rejected++;
+				uploadQueued.erase(paths[i]);
+				break;
+			case RETRY:
+				uploadStats.retries++;
+				failed = true;
+				uploadQueue.push_front(paths[i]);
+				break;
+			case DEFERRED:
+				uploadQueue.push_front(paths[i]);
+				break;
+			}
+		}
+		if (!failed) {
+			if (std::find(results.begin(), results.end(), UPLOADED) != results.end()) {
+				backoffSeconds = 0;
+			}
+			uploadReady.notify_all(); // for anything deferred
+			continue;
+		}
+
+		// Only back off once for failures that happen together
+		auto now = Clock::now();
+		if (now >= retryAt) {
+			if (!backoffSeconds) {
+				failingSince = now;
+			}
+			backoffSeconds = backoffSeconds ? std::min(backoffSeconds * 2, MAX_BACKOFF_SECONDS) : FIRST_BACKOFF_SECONDS;
+			retryAt = now + std::chrono::seconds(backoffSeconds);
+			LogMessage("retrying uploads in %d seconds", backoffSeconds);
+		}
+	}
+
+	runningUploaders--;
+	uploadersDone.notify_all();
+}
+
+void warnIfNoKey()
+{
+	if (uploadSettings.key.empty() && !warnedNoKey) {
+		LogWarning("can't upload logs without an upload key");
+		warnedNoKey = true;
+	}
+}
+
+} // namespace
+
+void Uploader::Start(const Settings &settings)
+{
+	CHECK2(settings.threads > 0, return);
+
+	std::lock_guard<std::mutex> lock(uploadMutex);
+	CHECK2(uploadThreads.empty(), return);
+
+	uploadSettings = settings;
+	uploadStopping = false;
+	warnIfNoKey();
+	for (auto i = 0; i < settings.threads; i++) {
+		runningUploaders++;
+		uploadThreads.emplace_back(uploaderLoop);
+	}
+	LogVerbose("started %d uploaders for %s:%d", settings.threads, settings.host.c_str(), settings.port);
+}
+
+bool Uploader::Drain(int giveUpSeconds)
+{
+	std::unique_lock<std::mutex> lock(uploadMutex);
+	while (!uploadQueued.empty() && !uploadSettings.key.empty() && !uploadThreads.empty()) {
+		if (backoffSeconds) {
+			auto giveUpAt = failingSince + std::chrono::seconds(giveUpSeconds);
+			if (Clock::now() >= giveUpAt) {
+				break;
+			}
+			uploadDone.wait_until(lock, giveUpAt);
+		} else {
+			uploadDone.wait(lock);
+		}
+	}
+	return uploadQueued.empty();
+}
+
+bool Uploader::Stop(int timeoutMs)
+{
+	std::vector<std::thread> threads;
+	auto stopped = true;
+	{
+		std::unique_lock<std::mutex> lock(uploadMutex);
+		uploadStopping = true;
+		uploadReady.notify_all();
+
+		if (!uploadersDone.wait_for(lock, std::chrono::milliseconds(timeoutMs), []() { return runningUploaders == 0; })) {
+			LogWarning("%d uploads still running after %d ms", runningUploaders, timeoutMs);
+			stopped = false;
+		}
+		threads.swap(uploadThreads);
+
+		LogVerbose("uploads: %llu games (%llu bytes) in %llu requests, %llu refused, %llu retries, %d left",
+			static_cast<unsigned long long>(uploadStats.uploaded), static_cast<unsigned long long>(uploadStats.bytes), static_cast<unsigned long long>(uploadStats.requests),
+			static_cast<unsigned long long>(uploadStats.rejected), static_cast<unsigned long long>(uploadStats.retries), int(uploadQueue.size()));
+	}
+
+	for (auto &thread : threads) {
+		if (stopped) {
+			thread.join();
+		} else {
+			thread.detach();
+		}
+	}
+	return stopped;
+}
+
+void Uploader::Add(const std::string &path)
+{
+	std::lock_guard<std::mutex> lock(uploadMutex);
+	if (uploadQueued.insert(path).second) {
+		uploadQueue.push_back(path);
+		warnIfNoKey();
+		uploadReady.notify_one();
+	}
+}
+
+void Uploader::AddPending()
+{
+	std::string dir;
+	{
+		std::lock_guard<std::mutex> lock(uploadMutex);
+		dir = file::Join(uploadSettings.dataDir, "Logged");
+	}
+
+	auto names = file::List(dir, ".hsl");
+	std::sort(names.begin(), names.end());
+	for (auto &name : names) {
+		Add(file::Join(dir, name));
+	}
+}
+
+void Uploader::SetKey(const std::string &key)
+{
+	std::lock_guard<std::mutex> lock(uploadMutex);
+	uploadSettings.key = key;
+	warnedNoKey = false;
+
+	// Try a new key right away
+	retryAt = Clock::time_point();
+	backoffSeconds = 0;
+	uploadReady.notify_all();
+}
+
+Uploader::Stats Uploader::GetStats()
+{
+	std::lock_guard<std::mutex> lock(uploadMutex);
+	return uploadStats;
+}
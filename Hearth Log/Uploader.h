@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Uploads saved games on background threads. The queue is Logged/ itself: a
+// game stays there until the server has accepted it and it's moved to
+// Uploaded/, so whatever isn't uploaded before exit is picked up next time.
+// Each worker keeps its connection open between games, and when several are
+// waiting (a backlog at startup) sends them together in one batch request.
+// When the server can't be reached (or has trouble) every worker backs off,
+// waiting 5 seconds at first and doubling up to 10 minutes.
+class Uploader
+{
+public:
+	struct Settings
+	{
+		Settings() : host("www.hearthlog.com"), port(80), key(), dataDir(), threads(2), timeoutSeconds(10), batchGames(32), batchBytes(4 << 20) { }
+
+		std::string host;
+		int port;
+		std::string key;     // nothing is uploaded until there's one
+		std::string dataDir; // UTF-8, holds Logged/ and Uploaded/
+		int threads;
+		int timeoutSeconds;  // for connecting and for each send or receive
+		int batchGames;      // most games in one request (1 turns batching off)
+		size_t batchBytes;   // a batch stops growing at this size
+	};
+
+	struct Stats
+	{
+		Stats() : requests(0), uploaded(0), rejected(0), retries(0), bytes(0) { }
+
+		uint64_t requests;
+		uint64_t uploaded;
+		uint64_t rejected; // refused by the server, left in Logged/
+		uint64_t retries;  // attempts that failed and will be tried again
+		uint64_t bytes;    // in games uploaded
+	};
+
+	static void Start(const Settings &settings);
+
+	// Waits until everything queued has been uploaded (or refused), returning
+	// false if it gives up after uploads have been failing for giveUpSeconds
+	static bool Drain(int giveUpSeconds);
+
+	// Stops the workers, waiting up to timeoutMs for uploads in progress.
+	// Returns false if some didn't finish (they're retried next time).
+	static bool Stop(int timeoutMs);
+
+	// Queues a saved game (a UTF-8 path). Called from any thread.
+	static void Add(const std::string &path);
+
+	// Queues every game in Logged/ that isn't queued already
+	static void AddPending();
+
+	static void SetKey(const std::string &key);
+
+	static Stats GetStats();
+};
@@ -0,0 +1,272 @@
+#include "WriterPool.h"
+#include "LogWriter.h"
+#include "MessageArena.h"
+#include "Log.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Emptied arenas kept for reuse
+const size_t MAX_FREE_ARENAS = 16;
+
+namespace {
+
+struct Job
+{
+	enum Action { Write, Finish, Cancel };
+
+	Job(Action action, std::shared_ptr<LogWriter> writer, std::unique_ptr<MessageArena> arena, WriterPool::SavedCallback saved)
+		: action(action), writer(std::move(writer)), arena(std::move(arena)), saved(saved) { }
+	Job(Job &&other)
+		: action(other.action), writer(std::move(other.writer)), arena(std::move(other.arena)), saved(other.saved) { }
+	Job &operator=(Job &&other)
+	{
+		action = other.action;
+		writer = std::move(other.writer);
+		arena = std::move(other.arena);
+		saved = other.saved;
+		return *this;
+	}
+
+	size_t Bytes() const { return arena ? arena->Bytes() : 0; }
+
+	void Run()
+	{
+		switch (action) {
+		case Write:
+			writer->Write(*arena);
+			break;
+		case Finish: {
+			auto filename = writer->Finish();
+			if (!filename.empty() && saved) {
+				saved(filename);
+			}
+			break;
+		}
+		case Cancel:
+			writer->Cancel();
+			break;
+		}
+	}
+
+	Action action;
+	std::shared_ptr<LogWriter> writer;
+	std::unique_ptr<MessageArena> arena;
+	WriterPool::SavedCallback saved;
+
+private:
+	Job(const Job &);
+	Job &operator=(const Job &);
+};
+
+// Pool state (all guarded by mutex). It lives on the heap so that when Stop
+// times out it can be left to the workers still using it: destroying it at
+// exit would pull the queues out from under them, and dropping their jobs'
+// writers would delete games that RecoverPending could still save.
+struct Pool
+{
+	Pool() : maxQueuedBytes(0), runningWriters(0), stopping(false) { }
+
+	std::mutex mutex;
+	std::condition_variable workReady;  // a queue has a job (or we're stopping)
+	std::condition_variable spaceReady; // queued bytes went down
+	std::condition_variable workersDone;
+	std::vector<std::deque<Job>> queues; // one per worker
+	std::vector<bool> workerRunning;     // false once a worker has emptied its queue and exited
+	std::vector<std::thread> threads;
+	std::vector<std::unique_ptr<MessageArena>> freeArenas;
+	size_t maxQueuedBytes;
+	int runningWriters;
+	bool stopping;
+	WriterPool::Stats stats;
+
+private:
+	Pool(const Pool &);
+	Pool &operator=(const Pool &);
+};
+
+std::unique_ptr<Pool> pool(new Pool);
+
+// Spreads writers over the workers (allocations are aligned, so the low bits don't vary)
+size_t workerFor(const LogWriter *writer, size_t workers)
+{
+	auto h = uint64_t(reinterpret_cast<uintptr_t>(writer));
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return size_t(h % workers);
+}
+
+void recycle(Pool &p, std::unique_ptr<MessageArena> arena)
+{
+	if (arena && p.freeArenas.size() < MAX_FREE_ARENAS) {
+		arena->Clear();
+		p.freeArenas.push_back(std::move(arena));
+	}
+}
+
+// Takes the pool it was started for, which outlives the workers if Stop gives up on them
+void workerLoop(Pool *p, size_t i)
+{
+	std::unique_lock<std::mutex> lock(p->mutex);
+	while (1) {
+		p->workReady.wait(lock, [p, i]() { return !p->queues[i].empty() || p->stopping; });
+		if (p->queues[i].empty()) {
+			break; // stopping and everything queued is done
+		}
+
+		auto job = std::move(p->queues[i].front());
+		p->queues[i].pop_front();
+
+		// Compression and I/O happen without the lock
+		lock.unlock();
+		job.Run();
+		lock.lock();
+
+		p->stats.queuedBytes -= job.Bytes();
+		recycle(*p, std::move(job.arena));
+		p->spaceReady.notify_all();
+	}
+
+	p->workerRunning[i] = false;
+	p->runningWriters--;
+	p->workersDone.notify_all();
+}
+
+// Queues the job (or runs it right away if the pool isn't running), blocking
+// while the queue is over its limit. Returns an arena for the caller to reuse.
+std::unique_ptr<MessageArena> submit(Job job)
+{
+	auto &p = *pool;
+	std::unique_lock<std::mutex> lock(p.mutex);
+
+	// The same writer always goes to the same worker. If that worker has
+	// exited its earlier jobs are all done, so it's safe to run this one here.
+	auto i = p.queues.empty() ? 0 : workerFor(job.writer.get(), p.queues.size());
+	if (p.queues.empty() || !p.workerRunning[i]) {
+		lock.unlock();
+		job.Run();
+		if (job.arena) {
+			job.arena->Clear();
+		}
+		return std::move(job.arena);
+	}
+
+	// Always let one job through so a single large one can't wait forever
+	auto bytes = job.Bytes();
+	if (bytes > 0 && p.stats.queuedBytes > 0 && p.stats.queuedBytes + bytes > p.maxQueuedBytes) {
+		auto start = std::chrono::steady_clock::now();
+		p.spaceReady.wait(lock, [&p, bytes]() { return p.stats.queuedBytes == 0 || p.stats.queuedBytes + bytes <= p.maxQueuedBytes; });
+
+		p.stats.stalls++;
+		p.stats.stallNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		if (p.stats.stalls == 1 || p.stats.stalls % 100 == 0) {
+			LogWarning("game writers falling behind (%llu stalls, %lld ms waiting)", static_cast<unsigned long long>(p.stats.stalls), static_cast<long long>(p.stats.stallNanos / 1000000));
+		}
+	}
+
+	p.stats.jobs++;
+	p.stats.queuedBytes += bytes;
+	if (p.stats.queuedBytes > p.stats.peakQueuedBytes) {
+		p.stats.peakQueuedBytes = p.stats.queuedBytes;
+	}
+
+	p.queues[i].push_back(std::move(job));
+	p.workReady.notify_all();
+
+	if (p.freeArenas.empty()) {
+		return nullptr;
+	}
+	auto arena = std::move(p.freeArenas.back());
+	p.freeArenas.pop_back();
+	return arena;
+}
+
+} // namespace
+
+void WriterPool::Start(int threads, size_t maxQueued)
+{
+	CHECK2(threads >= 0, return);
+
+	auto &p = *pool;
+	std::lock_guard<std::mutex> lock(p.mutex);
+	CHECK2(p.queues.empty(), return);
+
+	if (threads == 0) {
+		LogMessage("saving games on the capture threads");
+		return;
+	}
+
+	p.maxQueuedBytes = maxQueued;
+	std::vector<std::deque<Job>>(threads).swap(p.queues); // (resize would need to copy the queues)
+	p.workerRunning.assign(threads, true);
+	for (auto i = 0; i < threads; i++) {
+		p.runningWriters++;
+		p.threads.emplace_back(workerLoop, &p, i);
+	}
+	LogVerbose("started %d game writers", threads);
+}
+
+bool WriterPool::Stop(int timeoutMs)
+{
+	auto &p = *pool;
+	std::vector<std::thread> threads;
+	auto stopped = true;
+	{
+		std::unique_lock<std::mutex> lock(p.mutex);
+		p.stopping = true;
+		p.workReady.notify_all();
+
+		if (!p.workersDone.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&p]() { return p.runningWriters == 0; })) {
+			LogWarning("%d game writers still running after %d ms", p.runningWriters, timeoutMs);
+			stopped = false;
+		}
+		threads.swap(p.threads);
+
+		LogVerbose("game writers: %llu jobs, peak %d bytes queued, %llu stalls (%lld ms)",
+			static_cast<unsigned long long>(p.stats.jobs), int(p.stats.peakQueuedBytes), static_cast<unsigned long long>(p.stats.stalls), static_cast<long long>(p.stats.stallNanos / 1000000));
+	}
+
+	if (stopped) {
+		for (auto &thread : threads) {
+			thread.join();
+		}
+	} else {
+		// Still running, so the pool can't be destroyed (leaked on purpose
+		// since we're exiting). Anything after this is done on the calling thread.
+		for (auto &thread : threads) {
+			thread.detach();
+		}
+		pool.release();
+		pool.reset(new Pool);
+	}
+	return stopped;
+}
+
+std::unique_ptr<MessageArena> WriterPool::Write(const std::shared_ptr<LogWriter> &writer, std::unique_ptr<MessageArena> arena)
+{
+	CHECK(writer && arena, nullptr);
+	return submit(Job(Job::Write, writer, std::move(arena), nullptr));
+}
+
+void WriterPool::Finish(const std::shared_ptr<LogWriter> &writer, SavedCallback saved)
+{
+	CHECK2(writer, return);
+	submit(Job(Job::Finish, writer, nullptr, saved));
+}
+
+void WriterPool::Cancel(const std::shared_ptr<LogWriter> &writer)
+{
+	CHECK2(writer, return);
+	submit(Job(Job::Cancel, writer, nullptr, nullptr));
+}
+
+WriterPool::Stats WriterPool::GetStats()
+{
+	std::lock_guard<std::mutex> lock(pool->mutex);
+	return pool->stats;
+}
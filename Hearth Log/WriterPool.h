@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+class LogWriter;
+class MessageArena;
+
+// Background threads that compress and save games for the capture threads.
+// All of a game's work goes to the same worker so it's done in order. The
+// data waiting to be written is bounded: once the limit is reached Write
+// blocks (counted as a stall) until the workers catch up.
+class WriterPool
+{
+public:
+	struct Stats
+	{
+		Stats() : jobs(0), queuedBytes(0), peakQueuedBytes(0), stalls(0), stallNanos(0) { }
+
+		uint64_t jobs;
+		size_t queuedBytes;
+		size_t peakQueuedBytes;
+		uint64_t stalls;     // Write calls that had to wait for space
+		int64_t stallNanos;  // total time spent waiting
+	};
+
+	typedef void (*SavedCallback)(const std::string &filename); // UTF-8 path
+
+	// Until Start (and after Stop) work is done on the calling thread
+	static void Start(int threads, size_t maxQueuedBytes);
+
+	// Waits up to timeoutMs for queued work to be done. Returns false if
+	// some didn't finish (those games are recovered from Pending/ next time).
+	static bool Stop(int timeoutMs);
+
+	// Queues the arena's records to be written, returning an empty arena to
+	// use next (recycled from earlier writes when possible, otherwise null).
+	static std::unique_ptr<MessageArena> Write(const std::shared_ptr<LogWriter> &writer, std::unique_ptr<MessageArena> arena);
+
+	// Queues finishing the file, calling saved with its path if that succeeds
+	static void Finish(const std::shared_ptr<LogWriter> &writer, SavedCallback saved);
+
+	static void Cancel(const std::shared_ptr<LogWriter> &writer);
+
+	static Stats GetStats();
+};
@@ -0,0 +1,659 @@
+#include "Codec.h"
+#include "Header.h"
+#include "Index.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <zlib.h>
+#ifdef HSL_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HSL_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+using namespace hsl;
+
+// Size of the buffers compressed data passes through
+const size_t CHUNK_SIZE = 64 * 1024;
+
+// Magic numbers at the start of zstd and LZ4 frames (little endian)
+const uint8_t ZSTD_MAGIC[] = { 0x28, 0xb5, 0x2f, 0xfd };
+const uint8_t LZ4_MAGIC[]  = { 0x04, 0x22, 0x4d, 0x18 };
+
+// Written by a deflate full flush, and an empty final block to end a stream cut there
+const uint8_t DEFLATE_SYNC_MARKER[] = { 0x00, 0x00, 0xff, 0xff };
+const uint8_t DEFLATE_FINAL_BLOCK[] = { 0x03, 0x00 };
+
+// Passed when flushing (std::range's default constructor leaves it uninitialized)
+const std::range<const uint8_t *> NO_INPUT(nullptr, nullptr);
+
+// How many flush points to try (newest first) when recovering a deflate file
+const int MAX_RECOVERY_ATTEMPTS = 16;
+
+const char *hsl::CodecName(Codec codec)
+{
+	switch (codec) {
+	case CODEC_DEFLATE: return "deflate";
+	case CODEC_ZSTD:    return "zstd";
+	case CODEC_LZ4:     return "lz4";
+	default:            return "unknown";
+	}
+}
+
+bool hsl::ParseCodec(const std::string &name, Codec &codec)
+{
+	const Codec codecs[] = { CODEC_DEFLATE, CODEC_ZSTD, CODEC_LZ4 };
+	for (auto i = 0u; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+		if (name == CodecName(codecs[i])) {
+			codec = codecs[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+bool hsl::CodecAvailable(Codec codec)
+{
+	switch (codec) {
+	case CODEC_DEFLATE:
+		return true;
+#ifdef HSL_WITH_ZSTD
+	case CODEC_ZSTD:
+		return true;
+#endif
+#ifdef HSL_WITH_LZ4
+	case CODEC_LZ4:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+Codec hsl::DetectCodec(std::range<const uint8_t *> data)
+{
+	if (data.size() >= 4 && memcmp(data.begin(), ZSTD_MAGIC, 4) == 0) {
+		return CODEC_ZSTD;
+	}
+	if (data.size() >= 4 && memcmp(data.begin(), LZ4_MAGIC, 4) == 0) {
+		return CODEC_LZ4;
+	}
+	return CODEC_DEFLATE; // raw deflate has no magic number
+}
+
+namespace {
+
+class DeflateCompressor : public Compressor
+{
+public:
+	DeflateCompressor(int level, Sink &sink)
+		: _sink(sink),
+		  _init(false),
+		  _buffer(CHUNK_SIZE)
+	{
+		memset(&_z, 0, sizeof(_z));
+		_init = deflateInit2(&_z, level < 0 ? Z_BEST_COMPRESSION : level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+		if (!_init) {
+			_error = "deflateInit2 failed";
+		}
+	}
+
+	~DeflateCompressor()
+	{
+		if (_init) {
+			deflateEnd(&_z);
+		}
+	}
+
+	virtual bool Write(std::range<const uint8_t *> data) { return Run(data, Z_NO_FLUSH); }
+	virtual bool Flush() { return Run(NO_INPUT, Z_FULL_FLUSH); }
+	virtual bool Finish() { return Run(NO_INPUT, Z_FINISH); }
+
+private:
+	Sink &_sink;
+	z_stream _z;
+	bool _init;
+	std::vector<uint8_t> _buffer;
+
+	bool Run(std::range<const uint8_t *> data, int flush)
+	{
+		if (!_init || !_error.empty()) {
+			return false;
+		}
+
+		_z.next_in = const_cast<Bytef *>(data.begin());
+		_z.avail_in = uInt(data.size());
+		do {
+			_z.next_out = _buffer.data();
+			_z.avail_out = uInt(_buffer.size());
+			if (deflate(&_z, flush) == Z_STREAM_ERROR) {
+				_error = "deflate failed";
+				return false;
+			}
+
+			auto size = _buffer.size() - _z.avail_out;
+			if (size > 0 && !_sink.Write(_buffer.data(), size)) {
+				_error = "write failed";
+				return false;
+			}
+		} while (_z.avail_out == 0);
+		return true;
+	}
+};
+
+class DeflateDecompressor : public Decompressor
+{
+public:
+	DeflateDecompressor()
+		: Decompressor(),
+		  _init(false),
+		  _buffer(CHUNK_SIZE)
+	{
+		memset(&_z, 0, sizeof(_z));
+		_init = inflateInit2(&_z, -MAX_WBITS) == Z_OK;
+		if (!_init) {
+			_error = "inflateInit2 failed";
+		}
+	}
+
+	~DeflateDecompressor()
+	{
+		if (_init) {
+			inflateEnd(&_z);
+		}
+	}
+
+	virtual bool Write(std::range<const uint8_t *> data, std::vector<uint8_t> &out)
+	{
+		if (!_init || !_error.empty()) {
+			return false;
+		}
+		if (_ended) {
+			_inputBytes += data.size();
+			return data.empty() || _stopAtEnd;
+		}
+
+		_z.next_in = const_cast<Bytef *>(data.begin());
+		_z.avail_in = uInt(data.size());
+		do {
+			_z.next_out = _buffer.data();
+			_z.avail_out = uInt(_buffer.size());
+			auto ret = inflate(&_z, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				_error = _z.msg ? _z.msg : "inflate failed";
+				return false;
+			}
+			out.insert(out.end(), _buffer.data(), _buffer.data() + _buffer.size() - _z.avail_out);
+
+			if (ret == Z_STREAM_END) {
+				_ended = true;
+				_completeBytes = _inputBytes + data.size() - _z.avail_in;
+				break;
+			}
+		} while (_z.avail_out == 0);
+
+		_inputBytes += data.size();
+		return true;
+	}
+
+private:
+	z_stream _z;
+	bool _init;
+	std::vector<uint8_t> _buffer;
+};
+
+#ifdef HSL_WITH_ZSTD
+// Each Flush ends a frame so a damaged file can be cut back to whole frames
+class ZstdCompressor : public Compressor
+{
+public:
+	ZstdCompressor(int level, Sink &sink, const std::vector<uint8_t> *dictionary)
+		: _sink(sink),
+		  _cctx(ZSTD_createCCtx()),
+		  _inFrame(false),
+		  _buffer(ZSTD_CStreamOutSize())
+	{
+		if (!_cctx) {
+			_error = "ZSTD_createCCtx failed";
+			return;
+		}
+
+		Check(ZSTD_CCtx_setParameter(_cctx, ZSTD_c_compressionLevel, level < 0 ? ZSTD_CLEVEL_DEFAULT : level));
+		Check(ZSTD_CCtx_setParameter(_cctx, ZSTD_c_checksumFlag, 1));
+		if (dictionary && !dictionary->empty()) {
+			Check(ZSTD_CCtx_loadDictionary(_cctx, dictionary->data(), dictionary->size()));
+		}
+	}
+
+	~ZstdCompressor()
+	{
+		ZSTD_freeCCtx(_cctx);
+	}
+
+	virtual bool Write(std::range<const uint8_t *> data)
+	{
+		_inFrame = true;
+		return Run(data, ZSTD_e_continue);
+	}
+
+	virtual bool Flush() { return EndFrame(); }
+	virtual bool Finish() { return EndFrame(); }
+
+private:
+	Sink &_sink;
+	ZSTD_CCtx *_cctx;
+	bool _inFrame;
+	std::vector<uint8_t> _buffer;
+
+	bool Check(size_t ret)
+	{
+		if (ZSTD_isError(ret) && _error.empty()) {
+			_error = ZSTD_getErrorName(ret);
+		}
+		return _error.empty();
+	}
+
+	bool EndFrame()
+	{
+		if (!_inFrame) {
+			return _error.empty();
+		}
+		_inFrame = false;
+		return Run(NO_INPUT, ZSTD_e_end);
+	}
+
+	bool Run(std::range<const uint8_t *> data, ZSTD_EndDirective mode)
+	{
+		if (!_error.empty()) {
+			return false;
+		}
+
+		ZSTD_inBuffer in = { data.begin(), size_t(data.size()), 0 };
+		while (1) {
+			ZSTD_outBuffer out = { _buffer.data(), _buffer.size(), 0 };
+			auto remaining = ZSTD_compressStream2(_cctx, &out, &in, mode);
+			if (!Check(remaining)) {
+				return false;
+			}
+
+			if (out.pos > 0 && !_sink.Write(_buffer.data(), out.pos)) {
+				_error = "write failed";
+				return false;
+			}
+
+			if (mode == ZSTD_e_continue ? in.pos == in.size : remaining == 0) {
+				return true;
+			}
+		}
+	}
+};
+
+class ZstdDecompressor : public Decompressor
+{
+public:
+	explicit ZstdDecompressor(const std::vector<uint8_t> *dictionary)
+		: Decompressor(),
+		  _dctx(ZSTD_createDCtx()),
+		  _buffer(ZSTD_DStreamOutSize())
+	{
+		if (!_dctx) {
+			_error = "ZSTD_createDCtx failed";
+		} else if (dictionary && !dictionary->empty()) {
+			auto ret = ZSTD_DCtx_loadDictionary(_dctx, dictionary->data(), dictionary->size());
+			if (ZSTD_isError(ret)) {
+				_error = ZSTD_getErrorName(ret);
+			}
+		}
+	}
+
+	~ZstdDecompressor()
+	{
+		ZSTD_freeDCtx(_dctx);
+	}
+
+	virtual bool Write(std::range<const uint8_t *> data, std::vector<uint8_t> &out)
+	{
+		if (!_error.empty()) {
+			return false;
+		}
+		if (_ended) {
+			_inputBytes += data.size();
+			return true;
+		}
+
+		ZSTD_inBuffer in = { data.begin(), size_t(data.size()), 0 };
+		ZSTD_outBuffer buf = { _buffer.data(), _buffer.size(), 0 };
+		while (in.pos < in.size || buf.pos == buf.size) {
+			buf.pos = 0;
+			auto ret = ZSTD_decompressStream(_dctx, &buf, &in);
+			if (ZSTD_isError(ret)) {
+				_error = ZSTD_getErrorName(ret);
+				return false;
+			}
+			out.insert(out.end(), _buffer.data(), _buffer.data() + buf.pos);
+
+			// Decoding stops at the end of each frame
+			if (ret == 0) {
+				_completeBytes = _inputBytes + in.pos;
+				if (_stopAtEnd) {
+					_ended = true;
+					break;
+				}
+			}
+		}
+
+		_inputBytes += data.size();
+		return true;
+	}
+
+private:
+	ZSTD_DCtx *_dctx;
+	std::vector<uint8_t> _buffer;
+};
+#endif // HSL_WITH_ZSTD
+
+#ifdef HSL_WITH_LZ4
+// Each Flush ends a frame so a damaged file can be cut back to whole frames
+class Lz4Compressor : public Compressor
+{
+public:
+	Lz4Compressor(int level, Sink &sink)
+		: _sink(sink),
+		  _ctx(nullptr),
+		  _inFrame(false),
+		  _prefs(),
+		  _buffer()
+	{
+		memset(&_prefs, 0, sizeof(_prefs));
+		_prefs.compressionLevel = level < 0 ? 0 : level;
+		_prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+		_buffer.resize(LZ4F_compressBound(CHUNK_SIZE, &_prefs) + LZ4F_HEADER_SIZE_MAX);
+
+		if (!Check(LZ4F_createCompressionContext(&_ctx, LZ4F_VERSION))) {
+			_ctx = nullptr;
+		}
+	}
+
+	~Lz4Compressor()
+	{
+		if (_ctx) {
+			LZ4F_freeCompressionContext(_ctx);
+		}
+	}
+
+	virtual bool Write(std::range<const uint8_t *> data)
+	{
+		if (!_error.empty()) {
+			return false;
+		}
+
+		if (!_inFrame) {
+			if (!Check(Output(LZ4F_compressBegin(_ctx, _buffer.data(), _buffer.size(), &_prefs)))) {
+				return false;
+			}
+			_inFrame = true;
+		}
+
+		while (!data.empty()) {
+			auto size = std::min(size_t(data.size()), CHUNK_SIZE);
+			if (!Check(Output(LZ4F_compressUpdate(_ctx, _buffer.data(), _buffer.size(), data.begin(), size, nullptr)))) {
+				return false;
+			}
+			data.pop_front(size);
+		}
+		return true;
+	}
+
+	virtual bool Flush() { return EndFrame(); }
+	virtual bool Finish() { return EndFrame(); }
+
+private:
+	Sink &_sink;
+	LZ4F_cctx *_ctx;
+	bool _inFrame;
+	LZ4F_preferences_t _prefs;
+	std::vector<uint8_t> _buffer;
+
+	bool Check(size_t ret)
+	{
+		if (LZ4F_isError(ret) && _error.empty()) {
+			_error = LZ4F_getErrorName(ret);
+		}
+		return _error.empty();
+	}
+
+	// Passes the first size bytes of the buffer to the sink (size is an LZ4F return value)
+	size_t Output(size_t size)
+	{
+		if (!LZ4F_isError(size) && size > 0 && !_sink.Write(_buffer.data(), size)) {
+			_error = "write failed";
+		}
+		return size;
+	}
+
+	bool EndFrame()
+	{
+		if (!_inFrame || !_error.empty()) {
+			return _error.empty();
+		}
+		_inFrame = false;
+		return Check(Output(LZ4F_compressEnd(_ctx, _buffer.data(), _buffer.size(), nullptr)));
+	}
+};
+
+class Lz4Decompressor : public Decompressor
+{
+public:
+	Lz4Decompressor()
+		: Decompressor(),
+		  _ctx(nullptr),
+		  _buffer(CHUNK_SIZE)
+	{
+		auto ret = LZ4F_createDecompressionContext(&_ctx, LZ4F_VERSION);
+		if (LZ4F_isError(ret)) {
+			_error = LZ4F_getErrorName(ret);
+			_ctx = nullptr;
+		}
+	}
+
+	~Lz4Decompressor()
+	{
+		if (_ctx) {
+			LZ4F_freeDecompressionContext(_ctx);
+		}
+	}
+
+	virtual bool Write(std::range<const uint8_t *> data, std::vector<uint8_t> &out)
+	{
+		if (!_error.empty()) {
+			return false;
+		}
+		if (_ended) {
+			_inputBytes += data.size();
+			return true;
+		}
+
+		auto consumed = _inputBytes;
+		_inputBytes += data.size();
+
+		auto full = false;
+		while (!data.empty() || full) {
+			auto dstSize = _buffer.size();
+			size_t srcSize = data.size();
+			auto ret = LZ4F_decompress(_ctx, _buffer.data(), &dstSize, data.begin(), &srcSize, nullptr);
+			if (LZ4F_isError(ret)) {
+				_error = LZ4F_getErrorName(ret);
+				return false;
+			}
+			out.insert(out.end(), _buffer.data(), _buffer.data() + dstSize);
+			data.pop_front(srcSize);
+			consumed += srcSize;
+
+			// Decoding stops at the end of each frame
+			if (ret == 0) {
+				_completeBytes = consumed;
+				if (_stopAtEnd) {
+					_ended = true;
+					break;
+				}
+			}
+			full = dstSize == _buffer.size();
+		}
+		return true;
+	}
+
+private:
+	LZ4F_dctx *_ctx;
+	std::vector<uint8_t> _buffer;
+};
+#endif // HSL_WITH_LZ4
+
+} // namespace
+
+std::unique_ptr<Compressor> Compressor::Create(Codec codec, int level, Sink &sink, const std::vector<uint8_t> *dictionary)
+{
+#ifndef HSL_WITH_ZSTD
+	(void)dictionary; // only zstd uses one
+#endif
+	switch (codec) {
+	case CODEC_DEFLATE:
+		return std::unique_ptr<Compressor>(new DeflateCompressor(level, sink));
+#ifdef HSL_WITH_ZSTD
+	case CODEC_ZSTD:
+		return std::unique_ptr<Compressor>(new ZstdCompressor(level, sink, dictionary));
+#endif
+#ifdef HSL_WITH_LZ4
+	case CODEC_LZ4:
+		return std::unique_ptr<Compressor>(new Lz4Compressor(level, sink));
+#endif
+	default:
+		return nullptr;
+	}
+}
+
+std::unique_ptr<Decompressor> Decompressor::Create(Codec codec, const std::vector<uint8_t> *dictionary)
+{
+#ifndef HSL_WITH_ZSTD
+	(void)dictionary; // only zstd uses one
+#endif
+	switch (codec) {
+	case CODEC_DEFLATE:
+		return std::unique_ptr<Decompressor>(new DeflateDecompressor());
+#ifdef HSL_WITH_ZSTD
+	case CODEC_ZSTD:
+		return std::unique_ptr<Decompressor>(new ZstdDecompressor(dictionary));
+#endif
+#ifdef HSL_WITH_LZ4
+	case CODEC_LZ4:
+		return std::unique_ptr<Decompressor>(new Lz4Decompressor());
+#endif
+	default:
+		return nullptr;
+	}
+}
+
+bool hsl::Decompress(std::range<const uint8_t *> file, std::vector<uint8_t> &out, Codec &codec, std::string &error, const std::vector<uint8_t> *dictionary)
+{
+	codec = DetectCodec(file);
+
+	// Indexed files are read block by block
+	Index index;
+	if (index.Read(file)) {
+		for (auto &block : index.blocks) {
+			if (!ReadBlock(codec, file, block, out, error, dictionary)) {
+				return false;
+			}
+		}
+	} else {
+		auto decompressor = Decompressor::Create(codec, dictionary);
+		if (!decompressor) {
+			error = std::string(CodecName(codec)) + " support not compiled in";
+			return false;
+		}
+
+		if (!decompressor->Write(file, out)) {
+			error = decompressor->Error();
+			return false;
+		}
+		if (!decompressor->Complete()) {
+			error = "truncated file";
+			return false;
+		}
+	}
+
+	Header header;
+	if (!header.Parse(std::make_range<const uint8_t *>(out.data(), out.data() + out.size()))) {
+		error = "missing HSLH header";
+		return false;
+	}
+	if (header.codec != codec) {
+		error = std::string("header says ") + CodecName(header.codec) + " but the data is " + CodecName(codec);
+		return false;
+	}
+	return true;
+}
+
+namespace {
+
+// True if data decompresses to a complete stream
+bool decodes(Codec codec, const std::vector<uint8_t> &data)
+{
+	auto decompressor = Decompressor::Create(codec);
+	std::vector<uint8_t> out;
+	return decompressor && decompressor->Write(std::make_range<const uint8_t *>(data.data(), data.data() + data.size()), out) && decompressor->Complete();
+}
+
+} // namespace
+
+bool hsl::Recover(Codec codec, std::vector<uint8_t> &data, const std::vector<uint8_t> *dictionary)
+{
+	Header header;
+	if (ReadHeader(codec, std::make_range<const uint8_t *>(data.data(), data.data() + data.size()), header, dictionary) && header.format == Header::FORMAT_INDEXED) {
+		return RecoverIndexed(codec, data, dictionary);
+	}
+
+	if (codec == CODEC_DEFLATE) {
+		// Cut after a full flush and add an empty final block. The flush marker
+		// can also turn up by chance in compressed data, so check the result
+		// and try earlier markers if it doesn't decode.
+		auto end = data.size();
+		for (auto attempt = 0; attempt < MAX_RECOVERY_ATTEMPTS; attempt++) {
+			for (; end >= sizeof(DEFLATE_SYNC_MARKER); end--) {
+				if (memcmp(data.data() + end - sizeof(DEFLATE_SYNC_MARKER), DEFLATE_SYNC_MARKER, sizeof(DEFLATE_SYNC_MARKER)) == 0) {
+					break;
+				}
+			}
+			if (end < sizeof(DEFLATE_SYNC_MARKER)) {
+				return false;
+			}
+
+			std::vector<uint8_t> cut(data.begin(), data.begin() + end);
+			cut.insert(cut.end(), DEFLATE_FINAL_BLOCK, DEFLATE_FINAL_BLOCK + sizeof(DEFLATE_FINAL_BLOCK));
+			if (decodes(codec, cut)) {
+				data.swap(cut);
+				return true;
+			}
+			end--;
+		}
+		return false;
+	}
+
+	// Frame based codecs: keep the frames that decode completely (decoding
+	// stops at the first damaged one)
+	auto decompressor = Decompressor::Create(codec, dictionary);
+	if (!decompressor) {
+		return false;
+	}
+
+	std::vector<uint8_t> out;
+	decompressor->Write(std::make_range<const uint8_t *>(data.data(), data.data() + data.size()), out);
+	auto keep = decompressor->CompleteBytes();
+
+	if (keep == 0) {
+		return false;
+	}
+	data.resize(keep);
+	return true;
+}
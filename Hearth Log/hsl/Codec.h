@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include "../range.h"
+#include <string>
+#include <vector>
+
+// Compression for .hsl files. Deflate is always available; zstd and LZ4 are
+// compiled in with HSL_WITH_ZSTD and HSL_WITH_LZ4 (linking libzstd/liblz4).
+//
+// The codec is recorded in the HSLH header at the start of the uncompressed
+// data. Deflate files keep the original 9 byte header payload
+// (<format 1><game version 8>), the others add <codec 1>. Since the header
+// itself is compressed, readers find the codec from the magic number at the
+// start of the file (raw deflate has none) and then check it against the header.
+namespace hsl {
+
+enum Codec
+{
+	CODEC_DEFLATE = 0, // raw deflate, the original format
+	CODEC_ZSTD    = 1,
+	CODEC_LZ4     = 2, // fast, for low CPU mode
+};
+
+const char *CodecName(Codec codec);
+bool ParseCodec(const std::string &name, Codec &codec);
+
+// True if support for the codec was compiled in
+bool CodecAvailable(Codec codec);
+
+// Guesses the codec of a file from its first few bytes
+Codec DetectCodec(std::range<const uint8_t *> data);
+
+// Receives compressed output
+struct Sink
+{
+	virtual bool Write(const uint8_t *data, size_t size) = 0;
+	virtual ~Sink() { }
+};
+
+class Compressor
+{
+public:
+	virtual ~Compressor() { }
+
+	virtual bool Write(std::range<const uint8_t *> data) = 0;
+
+	// Makes everything written so far decodable from what's been passed to the
+	// sink, and marks a point that Recover can cut a damaged file back to.
+	virtual bool Flush() = 0;
+
+	// Ends the stream (nothing can be written afterwards)
+	virtual bool Finish() = 0;
+
+	const std::string &Error() const { return _error; }
+
+	// A negative level uses the codec's default. The dictionary (zstd only,
+	// e.g. from "zstd --train" over typical games) must outlive the compressor.
+	static std::unique_ptr<Compressor> Create(Codec codec, int level, Sink &sink, const std::vector<uint8_t> *dictionary = nullptr);
+
+protected:
+	std::string _error;
+};
+
+class Decompressor
+{
+public:
+	virtual ~Decompressor() { }
+
+	// Appends the decompressed data to out, returning false if it's corrupt
+	virtual bool Write(std::range<const uint8_t *> data, std::vector<uint8_t> &out) = 0;
+
+	// Stops decoding at the end of the first stream (or frame), ignoring
+	// anything after it. Used to read one block of an indexed file.
+	void StopAtEnd() { _stopAtEnd = true; }
+
+	// Input bytes up to the end of the last complete stream (or frame)
+	size_t CompleteBytes() const { return _completeBytes; }
+
+	// True if the data so far ended exactly at the end of the stream (or of a frame)
+	bool Complete() const { return _inputBytes > 0 && _completeBytes == _inputBytes; }
+
+	const std::string &Error() const { return _error; }
+
+	static std::unique_ptr<Decompressor> Create(Codec codec, const std::vector<uint8_t> *dictionary = nullptr);
+
+protected:
+	Decompressor() : _error(), _inputBytes(0), _completeBytes(0), _stopAtEnd(false), _ended(false) { }
+
+	std::string _error;
+	size_t _inputBytes;
+	size_t _completeBytes;
+	bool _stopAtEnd;
+	bool _ended;
+};
+
+// Decompresses a whole file, detecting its codec
+bool Decompress(std::range<const uint8_t *> file, std::vector<uint8_t> &out, Codec &codec, std::string &error, const std::vector<uint8_t> *dictionary = nullptr);
+
+// Cuts a file left unfinished by a crash back to its last Flush and ends it
+// there. Returns false if there's nothing to keep.
+bool Recover(Codec codec, std::vector<uint8_t> &data, const std::vector<uint8_t> *dictionary = nullptr);
+
+} // namespace hsl
@@ -0,0 +1,81 @@
+#include "Header.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Compressed bytes fed to the decompressor at a time while looking for the header
+const size_t READ_CHUNK = 256;
+
+const uint8_t MAGIC[] = { 'H', 'S', 'L', 'H' };
+
+const uint32_t PAYLOAD_SIZE = 9;              // <format 1><game version 8>
+const uint32_t PAYLOAD_SIZE_WITH_CODEC = 10;  // ... <codec 1>
+
+template <typename T> void append(std::vector<uint8_t> &out, const T &value)
+{
+	auto p = reinterpret_cast<const uint8_t *>(&value);
+	out.insert(out.end(), p, p + sizeof(T));
+}
+
+template <typename T> T read(const uint8_t *p)
+{
+	T value;
+	memcpy(&value, p, sizeof(T));
+	return value;
+}
+
+void hsl::Header::Write(std::vector<uint8_t> &out) const
+{
+	auto size = codec == CODEC_DEFLATE ? PAYLOAD_SIZE : PAYLOAD_SIZE_WITH_CODEC;
+
+	append(out, nanotime);
+	out.insert(out.end(), MAGIC, MAGIC + sizeof(MAGIC));
+	append(out, size);
+	append(out, format);
+	append(out, gameVersion);
+	if (size == PAYLOAD_SIZE_WITH_CODEC) {
+		append(out, uint8_t(codec));
+	}
+}
+
+size_t hsl::Header::Parse(std::range<const uint8_t *> data)
+{
+	const size_t FIXED = 8 + sizeof(MAGIC) + 4;
+	if (size_t(data.size()) < FIXED || memcmp(data.begin() + 8, MAGIC, sizeof(MAGIC)) != 0) {
+		return 0;
+	}
+
+	auto size = read<uint32_t>(data.begin() + 12);
+	if (size < PAYLOAD_SIZE || size_t(data.size()) < FIXED + size) {
+		return 0;
+	}
+
+	auto p = data.begin() + FIXED;
+	nanotime = read<int64_t>(data.begin());
+	format = p[0];
+	gameVersion = read<uint64_t>(p + 1);
+	codec = size >= PAYLOAD_SIZE_WITH_CODEC ? Codec(p[9]) : CODEC_DEFLATE;
+	return FIXED + size;
+}
+
+bool hsl::ReadHeader(Codec codec, std::range<const uint8_t *> file, Header &header, const std::vector<uint8_t> *dictionary)
+{
+	auto decompressor = Decompressor::Create(codec, dictionary);
+	if (!decompressor) {
+		return false;
+	}
+	decompressor->StopAtEnd();
+
+	std::vector<uint8_t> out;
+	while (!file.empty()) {
+		auto size = std::min(size_t(file.size()), READ_CHUNK);
+		if (!decompressor->Write(std::make_range(file.begin(), file.begin() + size), out)) {
+			return false;
+		}
+		if (header.Parse(std::make_range<const uint8_t *>(out.data(), out.data() + out.size()))) {
+			return true;
+		}
+		file.pop_front(size);
+	}
+	return false;
+}
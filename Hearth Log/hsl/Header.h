@@ -0,0 +1,39 @@
+#pragma once
+
+#include "Codec.h"
+
+#include <cstdint>
+#include "../range.h"
+#include <vector>
+
+namespace hsl {
+
+// The header at the start of an .hsl file's uncompressed data. It's laid out
+// like a message record with type "HSLH":
+//
+// <nanotime 8> 48 53 4C 48 <size 4> <format 1> <game version 8> [<codec 1>]
+//
+// The codec byte is only written for codecs other than deflate, so deflate
+// files are unchanged from the original format.
+struct Header
+{
+	Header() : nanotime(0), format(FORMAT), gameVersion(0), codec(CODEC_DEFLATE) { }
+
+	static const uint8_t FORMAT = 9;
+	static const uint8_t FORMAT_INDEXED = 10; // blocks and an index (see Index.h)
+
+	int64_t nanotime;
+	uint8_t format;
+	uint64_t gameVersion;
+	Codec codec;
+
+	void Write(std::vector<uint8_t> &out) const;
+
+	// Returns the number of bytes read, or 0 if data doesn't start with a valid header
+	size_t Parse(std::range<const uint8_t *> data);
+};
+
+// Decompresses just enough of a file to read its header
+bool ReadHeader(Codec codec, std::range<const uint8_t *> file, Header &header, const std::vector<uint8_t> *dictionary = nullptr);
+
+} // namespace hsl
@@ -0,0 +1,244 @@
+#include "Index.h"
+#include "Header.h"
+
+#include <cstring>
+
+// The index is a zstd/LZ4 skippable frame (either codec skips it)
+const uint8_t SKIPPABLE_MAGIC[] = { 0x50, 0x2a, 0x4d, 0x18 };
+const uint8_t INDEX_MAGIC[] = { 'H', 'S', 'L', 'I' };
+
+const size_t FRAME_HEADER_SIZE = 8;  // <magic 4><size 4>
+const size_t TRAILER_SIZE = 12;      // <index offset 8> HSLI
+const size_t ENTRY_SIZE = 8 + 4 + 4 + 8 + 4 + hsl::BlockInfo::TYPE_BITS / 8;
+
+// Bytes before the payload of a record (<nanotime 8><type 4><size 4>)
+const size_t RECORD_HEADER_SIZE = 16;
+
+namespace {
+
+template <typename T> void append(std::vector<uint8_t> &out, const T &value)
+{
+	auto p = reinterpret_cast<const uint8_t *>(&value);
+	out.insert(out.end(), p, p + sizeof(T));
+}
+
+template <typename T> T read(const uint8_t *&p)
+{
+	T value;
+	memcpy(&value, p, sizeof(T));
+	p += sizeof(T);
+	return value;
+}
+
+} // namespace
+
+hsl::BlockInfo::BlockInfo()
+	: offset(0),
+	  compressedSize(0),
+	  rawSize(0),
+	  firstNanotime(0),
+	  messages(0)
+{
+	memset(types, 0, sizeof(types));
+}
+
+void hsl::BlockInfo::Add(int64_t nanotime, uint32_t type)
+{
+	if (messages++ == 0) {
+		firstNanotime = nanotime;
+	}
+	if (type >= TYPE_BITS) {
+		type = TYPE_BITS - 1;
+	}
+	types[type / 8] |= uint8_t(1 << (type % 8));
+}
+
+bool hsl::BlockInfo::HasType(uint32_t type) const
+{
+	if (type >= TYPE_BITS) {
+		type = TYPE_BITS - 1;
+	}
+	return (types[type / 8] & (1 << (type % 8))) != 0;
+}
+
+size_t hsl::Index::Messages() const
+{
+	size_t messages = 0;
+	for (auto &block : blocks) {
+		messages += block.messages;
+	}
+	return messages;
+}
+
+size_t hsl::Index::FindMessage(size_t n, size_t &first) const
+{
+	first = 0;
+	for (auto i = 0u; i < blocks.size(); i++) {
+		if (n < first + blocks[i].messages) {
+			return i;
+		}
+		first += blocks[i].messages;
+	}
+	return blocks.size();
+}
+
+size_t hsl::Index::FindTime(int64_t nanotime) const
+{
+	size_t found = 0;
+	for (auto i = 0u; i < blocks.size(); i++) {
+		if (blocks[i].messages > 0) {
+			if (blocks[i].firstNanotime > nanotime) {
+				break;
+			}
+			found = i;
+		}
+	}
+	return found;
+}
+
+void hsl::Index::Write(std::vector<uint8_t> &out, uint64_t offset) const
+{
+	auto size = uint32_t(4 + blocks.size() * ENTRY_SIZE + TRAILER_SIZE);
+	out.reserve(out.size() + FRAME_HEADER_SIZE + size);
+
+	out.insert(out.end(), SKIPPABLE_MAGIC, SKIPPABLE_MAGIC + sizeof(SKIPPABLE_MAGIC));
+	append(out, size);
+	append(out, uint32_t(blocks.size()));
+	for (auto &block : blocks) {
+		append(out, block.offset);
+		append(out, block.compressedSize);
+		append(out, block.rawSize);
+		append(out, block.firstNanotime);
+		append(out, block.messages);
+		out.insert(out.end(), block.types, block.types + sizeof(block.types));
+	}
+	append(out, offset);
+	out.insert(out.end(), INDEX_MAGIC, INDEX_MAGIC + sizeof(INDEX_MAGIC));
+}
+
+bool hsl::Index::Read(std::range<const uint8_t *> file)
+{
+	auto fileSize = size_t(file.size());
+	if (fileSize < FRAME_HEADER_SIZE + 4 + TRAILER_SIZE || memcmp(file.end() - sizeof(INDEX_MAGIC), INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+		return false;
+	}
+
+	auto p = file.end() - TRAILER_SIZE;
+	auto offset = read<uint64_t>(p);
+	if (offset > fileSize - FRAME_HEADER_SIZE - 4 - TRAILER_SIZE) {
+		return false;
+	}
+
+	p = file.begin() + offset;
+	if (memcmp(p, SKIPPABLE_MAGIC, sizeof(SKIPPABLE_MAGIC)) != 0) {
+		return false;
+	}
+	p += sizeof(SKIPPABLE_MAGIC);
+	auto size = read<uint32_t>(p);
+	auto count = read<uint32_t>(p);
+	if (size != fileSize - offset - FRAME_HEADER_SIZE || size != 4 + count * ENTRY_SIZE + TRAILER_SIZE) {
+		return false;
+	}
+
+	std::vector<BlockInfo> entries(count);
+	for (auto &block : entries) {
+		block.offset = read<uint64_t>(p);
+		block.compressedSize = read<uint32_t>(p);
+		block.rawSize = read<uint32_t>(p);
+		block.firstNanotime = read<int64_t>(p);
+		block.messages = read<uint32_t>(p);
+		memcpy(block.types, p, sizeof(block.types));
+		p += sizeof(block.types);
+
+		if (block.offset > offset || block.compressedSize > offset - block.offset) {
+			return false;
+		}
+	}
+
+	blocks.swap(entries);
+	return true;
+}
+
+bool hsl::ReadBlock(Codec codec, std::range<const uint8_t *> file, const BlockInfo &block, std::vector<uint8_t> &out, std::string &error, const std::vector<uint8_t> *dictionary)
+{
+	if (block.offset + block.compressedSize > uint64_t(file.size())) {
+		error = "block past the end of the file";
+		return false;
+	}
+
+	auto decompressor = Decompressor::Create(codec, dictionary);
+	if (!decompressor) {
+		error = std::string(CodecName(codec)) + " support not compiled in";
+		return false;
+	}
+	decompressor->StopAtEnd();
+
+	auto start = out.size();
+	auto data = file.begin() + block.offset;
+	if (!decompressor->Write(std::make_range(data, data + block.compressedSize), out)) {
+		error = decompressor->Error();
+		return false;
+	}
+	if (!decompressor->Complete() || out.size() - start != block.rawSize) {
+		error = "damaged block";
+		return false;
+	}
+	return true;
+}
+
+bool hsl::RecoverIndexed(Codec codec, std::vector<uint8_t> &data, const std::vector<uint8_t> *dictionary)
+{
+	// Decode blocks until one is incomplete, rebuilding their index entries
+	Index index;
+	size_t offset = 0;
+	std::vector<uint8_t> raw;
+	while (offset < data.size()) {
+		auto decompressor = Decompressor::Create(codec, dictionary);
+		if (!decompressor) {
+			return false;
+		}
+		decompressor->StopAtEnd();
+
+		raw.clear();
+		decompressor->Write(std::make_range<const uint8_t *>(data.data() + offset, data.data() + data.size()), raw);
+		auto size = decompressor->CompleteBytes();
+		if (size == 0) {
+			break;
+		}
+
+		BlockInfo block;
+		block.offset = offset;
+		block.compressedSize = uint32_t(size);
+		block.rawSize = uint32_t(raw.size());
+
+		// Skip the header at the start of the first block
+		size_t pos = 0;
+		if (offset == 0) {
+			Header header;
+			pos = header.Parse(std::make_range<const uint8_t *>(raw.data(), raw.data() + raw.size()));
+			if (pos == 0) {
+				return false;
+			}
+		}
+
+		while (pos + RECORD_HEADER_SIZE <= raw.size()) {
+			const uint8_t *p = raw.data() + pos;
+			auto nanotime = read<int64_t>(p);
+			auto type = read<uint32_t>(p);
+			auto length = read<uint32_t>(p);
+			block.Add(nanotime, type);
+			pos += RECORD_HEADER_SIZE + length;
+		}
+
+		index.blocks.push_back(block);
+		offset += size;
+	}
+
+	if (index.blocks.empty()) {
+		return false;
+	}
+
+	data.resize(offset);
+	index.Write(data, offset);
+	return true;
+}
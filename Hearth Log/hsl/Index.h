@@ -0,0 +1,76 @@
+#pragma once
+
+#include "Codec.h"
+
+#include <cstdint>
+#include "../range.h"
+#include <string>
+#include <vector>
+
+// Indexed .hsl files (header format 10) are a series of independently
+// compressed blocks followed by an index of them, so a reader can seek to a
+// message or time and decode only the blocks it needs (in parallel if it
+// likes):
+//
+// <block 0> ... <block n-1> <index>
+//
+// Each block is a complete deflate stream (or zstd/LZ4 frame) of whole
+// records, and block 0 starts with the header. The index is laid out as a
+// skippable frame so the zstd and lz4 tools still decode the whole file:
+//
+// 50 2A 4D 18 <size 4> <block count 4> <entries> <index offset 8> 48 53 4C 49
+//
+// It ends with its own offset and "HSLI", so it can be found from the end
+// of the file.
+namespace hsl {
+
+struct BlockInfo
+{
+	BlockInfo();
+
+	// Message types at or above this all share the last bit
+	static const uint32_t TYPE_BITS = 1024;
+
+	uint64_t offset;         // of the compressed block in the file
+	uint32_t compressedSize;
+	uint32_t rawSize;        // of the records (including the header in block 0)
+	int64_t firstNanotime;   // of the first message
+	uint32_t messages;
+	uint8_t types[TYPE_BITS / 8];
+
+	// Counts a message
+	void Add(int64_t nanotime, uint32_t type);
+
+	// True if the block may contain messages of the type
+	bool HasType(uint32_t type) const;
+};
+
+struct Index
+{
+	std::vector<BlockInfo> blocks;
+
+	size_t Messages() const;
+
+	// Returns the block holding message n (counting from 0), setting first to
+	// the number of the block's first message, or blocks.size() if n is too big.
+	size_t FindMessage(size_t n, size_t &first) const;
+
+	// Returns the last block starting at or before nanotime (or the first block)
+	size_t FindTime(int64_t nanotime) const;
+
+	// Appends the index, which starts at offset in the file
+	void Write(std::vector<uint8_t> &out, uint64_t offset) const;
+
+	// Reads the index from the end of a file, returning false if there isn't one
+	bool Read(std::range<const uint8_t *> file);
+};
+
+// Decompresses one block of an indexed file, appending its records to out.
+// Blocks don't depend on each other, so they can be read on separate threads.
+bool ReadBlock(Codec codec, std::range<const uint8_t *> file, const BlockInfo &block, std::vector<uint8_t> &out, std::string &error, const std::vector<uint8_t> *dictionary = nullptr);
+
+// Cuts an indexed file left unfinished by a crash back to its last complete
+// block and adds an index. Returns false if there's nothing to keep.
+bool RecoverIndexed(Codec codec, std::vector<uint8_t> &data, const std::vector<uint8_t> *dictionary = nullptr);
+
+} // namespace hsl
@@ -0,0 +1,191 @@
+#include "Reader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+// Compressed bytes decoded at a time from unindexed files
+const size_t INPUT_CHUNK = 64 * 1024;
+
+// <nanotime 8><type 4><size 4>
+const size_t RECORD_HEADER_SIZE = 16;
+
+hsl::Reader::Reader()
+	: _data(),
+	  _file(),
+	  _input(),
+	  _dictionary(nullptr),
+	  _codec(CODEC_DEFLATE),
+	  _header(),
+	  _indexed(false),
+	  _index(),
+	  _block(0),
+	  _decompressor(),
+	  _buffer(),
+	  _pos(0),
+	  _types(),
+	  _error()
+{
+}
+
+bool hsl::Reader::Open(std::range<const uint8_t *> file, const std::vector<uint8_t> *dictionary)
+{
+	_file = file;
+	_input = file;
+	_dictionary = dictionary;
+	_codec = DetectCodec(file);
+	_indexed = _index.Read(file);
+	_block = 0;
+	_buffer.clear();
+	_pos = 0;
+	_error.clear();
+
+	if (_indexed) {
+		// Only decode the start of the first block, which might be skipped
+		if (!ReadHeader(_codec, file, _header, dictionary)) {
+			_error = "missing HSLH header";
+			return false;
+		}
+	} else {
+		_decompressor = Decompressor::Create(_codec, dictionary);
+		if (!_decompressor) {
+			_error = std::string(CodecName(_codec)) + " support not compiled in";
+			return false;
+		}
+
+		// The header is the first record
+		while (!(_pos = _header.Parse(std::make_range<const uint8_t *>(_buffer.data(), _buffer.data() + _buffer.size())))) {
+			if (!Fill()) {
+				if (_error.empty()) {
+					_error = "missing HSLH header";
+				}
+				return false;
+			}
+		}
+	}
+
+	if (_header.codec != _codec) {
+		_error = std::string("header says ") + CodecName(_header.codec) + " but the data is " + CodecName(_codec);
+		return false;
+	}
+	return true;
+}
+
+bool hsl::Reader::Open(const std::string &path, const std::vector<uint8_t> *dictionary)
+{
+	std::ifstream in(path.c_str(), std::ios::binary);
+	if (!in) {
+		_error = "couldn't open " + path;
+		return false;
+	}
+
+	in.seekg(0, std::ios::end);
+	_data.resize(size_t(in.tellg()));
+	in.seekg(0, std::ios::beg);
+	if (!in.read(reinterpret_cast<char *>(_data.data()), _data.size())) {
+		_error = "couldn't read " + path;
+		return false;
+	}
+
+	return Open(std::make_range<const uint8_t *>(_data.data(), _data.data() + _data.size()), dictionary);
+}
+
+void hsl::Reader::SetTypes(const std::vector<uint32_t> &types)
+{
+	_types = types;
+	std::sort(_types.begin(), _types.end());
+	_types.erase(std::unique(_types.begin(), _types.end()), _types.end());
+}
+
+bool hsl::Reader::Wanted(uint32_t type) const
+{
+	return _types.empty() || std::binary_search(_types.begin(), _types.end(), type);
+}
+
+bool hsl::Reader::Wanted(const BlockInfo &block) const
+{
+	if (_types.empty()) {
+		return true;
+	}
+	for (auto type : _types) {
+		if (block.HasType(type)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool hsl::Reader::Next(Record &record)
+{
+	while (1) {
+		auto available = _buffer.size() - _pos;
+		if (available >= RECORD_HEADER_SIZE) {
+			auto p = _buffer.data() + _pos;
+			memcpy(&record.nanotime, p, 8);
+			memcpy(&record.type, p + 8, 4);
+			memcpy(&record.size, p + 12, 4);
+
+			if (available - RECORD_HEADER_SIZE >= record.size) {
+				record.payload = std::make_range<const uint8_t *>(p + RECORD_HEADER_SIZE, p + RECORD_HEADER_SIZE + record.size);
+				_pos += RECORD_HEADER_SIZE + record.size;
+				if (Wanted(record.type)) {
+					return true;
+				}
+				continue;
+			}
+		}
+
+		if (!Fill()) {
+			if (_error.empty() && _pos < _buffer.size()) {
+				_error = "truncated record";
+			}
+			return false;
+		}
+	}
+}
+
+// Decodes more records into the buffer, returning false at the end of the file or on an error
+bool hsl::Reader::Fill()
+{
+	if (!_error.empty()) {
+		return false;
+	}
+
+	// Drop the records that have been read
+	_buffer.erase(_buffer.begin(), _buffer.begin() + _pos);
+	_pos = 0;
+
+	if (_indexed) {
+		while (_block < _index.blocks.size() && !Wanted(_index.blocks[_block])) {
+			_block++;
+		}
+		if (_block == _index.blocks.size()) {
+			return false;
+		}
+
+		// Records never span blocks, but skip the header at the start of the first one
+		auto start = _buffer.size();
+		if (!ReadBlock(_codec, _file, _index.blocks[_block], _buffer, _error, _dictionary)) {
+			return false;
+		}
+		if (_block++ == 0) {
+			_pos = start + _header.Parse(std::make_range<const uint8_t *>(_buffer.data() + start, _buffer.data() + _buffer.size()));
+		}
+		return true;
+	}
+
+	if (_input.empty()) {
+		if (!_decompressor->Complete()) {
+			_error = "truncated file";
+		}
+		return false;
+	}
+
+	auto size = std::min(size_t(_input.size()), INPUT_CHUNK);
+	if (!_decompressor->Write(std::make_range(_input.begin(), _input.begin() + size), _buffer)) {
+		_error = _decompressor->Error();
+		return false;
+	}
+	_input.pop_front(size);
+	return true;
+}
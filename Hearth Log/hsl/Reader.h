@@ -0,0 +1,119 @@
+#pragma once
+
+#include "Codec.h"
+#include "Header.h"
+#include "Index.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include "../range.h"
+#include <string>
+#include <vector>
+
+namespace hsl {
+
+struct Record
+{
+	int64_t nanotime;
+	uint32_t type;
+	uint32_t size;
+	std::range<const uint8_t *> payload; // valid until the next record is read
+};
+
+// Reads the records of an .hsl file (either format), decompressing as it
+// goes so memory use doesn't grow with the length of the game. Doesn't
+// depend on wxWidgets.
+//
+//	hsl::Reader reader;
+//	if (reader.Open(path)) {
+//		for (auto &record : reader) { ... }
+//	}
+//	if (!reader.Error().empty()) { ... }
+class Reader
+{
+public:
+	Reader();
+
+	// Reads a file in memory, which must outlive the reader (as must the dictionary)
+	bool Open(std::range<const uint8_t *> file, const std::vector<uint8_t> *dictionary = nullptr);
+
+	// Reads a file from disk
+	bool Open(const std::string &path, const std::vector<uint8_t> *dictionary = nullptr);
+
+	const Header &GetHeader() const { return _header; }
+	Codec GetCodec() const { return _codec; }
+	bool Indexed() const { return _indexed; }
+	const Index &GetIndex() const { return _index; }
+
+	// Only return records of these types. Blocks of indexed files that
+	// don't have any of them are skipped without being decompressed.
+	void SetTypes(const std::vector<uint32_t> &types);
+
+	// Reads the next record, returning false at the end of the file or on an error
+	bool Next(Record &record);
+
+	// Empty unless opening or reading failed
+	const std::string &Error() const { return _error; }
+
+	class iterator
+	{
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef Record value_type;
+		typedef ptrdiff_t difference_type;
+		typedef const Record *pointer;
+		typedef const Record &reference;
+
+		iterator() : _reader(nullptr), _record() { }
+		explicit iterator(Reader *reader) : _reader(reader), _record() { ++*this; }
+
+		const Record &operator*() const { return _record; }
+		const Record *operator->() const { return &_record; }
+
+		iterator &operator++()
+		{
+			if (!_reader->Next(_record)) {
+				_reader = nullptr;
+			}
+			return *this;
+		}
+
+		bool operator==(const iterator &other) const { return _reader == other._reader; }
+		bool operator!=(const iterator &other) const { return _reader != other._reader; }
+
+	private:
+		Reader *_reader;
+		Record _record;
+	};
+
+	// Reads from the current position (a reader can only be iterated once)
+	iterator begin() { return iterator(this); }
+	iterator end() { return iterator(); }
+
+private:
+	std::vector<uint8_t> _data; // when reading from disk
+	std::range<const uint8_t *> _file;
+	std::range<const uint8_t *> _input; // compressed data not read yet (unindexed files)
+	const std::vector<uint8_t> *_dictionary;
+	Codec _codec;
+	Header _header;
+	bool _indexed;
+	Index _index;
+	size_t _block;
+	std::unique_ptr<Decompressor> _decompressor;
+	std::vector<uint8_t> _buffer;
+	size_t _pos;
+	std::vector<uint32_t> _types; // sorted
+	std::string _error;
+
+	bool Fill();
+	bool Wanted(uint32_t type) const;
+	bool Wanted(const BlockInfo &block) const;
+
+	Reader(const Reader &);
+	Reader &operator=(const Reader &);
+};
+
+} // namespace hsl
@@ -1 +1,57 @@
 #include "Endpoint.h"
+
+#include <cstdio>
+
+std::string tcp::Endpoint::Ip() const
+{
+	char buf[48];
+
+	if (_family == FlowKey::IPv4) {
+		std::snprintf(buf, sizeof(buf), "%u.%u.%u.%u", _addr[0], _addr[1], _addr[2], _addr[3]);
+		return buf;
+	}
+
+	if (_family != FlowKey::IPv6) {
+		return "?";
+	}
+
+	// Read the eight 16-bit groups
+	uint16_t groups[8];
+	for (auto i = 0; i < 8; i++) {
+		groups[i] = uint16_t(_addr[2 * i] << 8 | _addr[2 * i + 1]);
+	}
+
+	// Find the longest run of zero groups (RFC 5952: only compress runs of 2+)
+	auto bestStart = -1, bestLen = 1;
+	for (auto i = 0; i < 8; ) {
+		if (groups[i] != 0) {
+			i++;
+			continue;
+		}
+		auto start = i;
+		while (i < 8 && groups[i] == 0) {
+			i++;
+		}
+		if (i - start > bestLen) {
+			bestStart = start;
+			bestLen = i - start;
+		}
+	}
+
+	auto out = buf;
+	for (auto i = 0; i < 8; i++) {
+		if (i == bestStart) {
+			*out++ = ':';
+			*out++ = ':';
+			i += bestLen - 1;
+			continue;
+		}
+		if (i > 0 && i != bestStart + bestLen) {
+			*out++ = ':';
+		}
+		out += std::sprintf(out, "%x", groups[i]);
+	}
+	*out = '\0';
+
+	return buf;
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "FlowKey.h"
+
 #include <cstdint>
 #include <ostream>
 #include <sstream>
@@ -10,18 +12,28 @@ namespace tcp {
 class Endpoint
 {
 public:
-	Endpoint() { } // = default;
-	Endpoint(std::string ip, uint16_t port) : _ip(std::move(ip)), _port(port) { }
+	Endpoint() : _family(0), _port(0) { std::memset(_addr, 0, sizeof(_addr)); }
+	Endpoint(uint8_t family, const void *addr, uint16_t port)
+		: _family(family), _port(port)
+	{
+		std::memset(_addr, 0, sizeof(_addr));
+		std::memcpy(_addr, addr, FlowKey::AddrLen(family));
+	}
 
-	const std::string &Ip() const { return _ip; }
+	uint8_t Family() const { return _family; }
+	const uint8_t *Addr() const { return _addr; }
 	uint16_t Port() const { return _port; }
 
+	// Formatted on demand (only needed for log output)
+	std::string Ip() const;
+
 private:
-	std::string _ip;
+	uint8_t _family; // FlowKey::IPv4 or FlowKey::IPv6
+	uint8_t _addr[16]; // network byte order
 	uint16_t _port;
 
 	friend std::ostream &operator<<(std::ostream &out, const Endpoint &endpoint)
-	{ return out << '[' << endpoint._ip << "]:" << endpoint._port; }
+	{ return out << '[' << endpoint.Ip() << "]:" << endpoint._port; }
 };
 
 class EndpointPair
@@ -33,6 +45,8 @@ public:
 	const Endpoint &Src() const { return _src; }
 	const Endpoint &Dst() const { return _dst; }
 
+	FlowKey Key() const { return FlowKey(_src.Family(), _src.Addr(), _dst.Addr(), _src.Port(), _dst.Port()); }
+
 	std::string SrcToDst(const std::string &sep = "->") const { return ToString(_src, sep, _dst); }
 	std::string DstToSrc(const std::string &sep = "->") const { return ToString(_dst, sep, _src); }
 
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+namespace tcp {
+
+// Packed binary 5-tuple identifying one direction of a TCP connection.
+// Addresses are stored raw in network byte order (IPv4 only uses the first
+// 4 bytes) and the whole struct is zeroed first so keys can be compared and
+// hashed as plain memory.
+struct FlowKey
+{
+	enum { IPv4 = 4, IPv6 = 6 };
+
+	uint8_t  src[16];
+	uint8_t  dst[16];
+	uint16_t srcPort;
+	uint16_t dstPort;
+	uint8_t  family;
+	uint8_t  proto;
+	uint8_t  pad[2];
+
+	FlowKey() { std::memset(this, 0, sizeof(*this)); }
+	FlowKey(uint8_t family, const void *srcAddr, const void *dstAddr, uint16_t srcPort, uint16_t dstPort, uint8_t proto = 6 /* IPPROTO_TCP */)
+	{
+		std::memset(this, 0, sizeof(*this));
+		auto len = AddrLen(family);
+		std::memcpy(src, srcAddr, len);
+		std::memcpy(dst, dstAddr, len);
+		this->srcPort = srcPort;
+		this->dstPort = dstPort;
+		this->family = family;
+		this->proto = proto;
+	}
+
+	static size_t AddrLen(uint8_t family) { return family == IPv6 ? 16 : 4; }
+
+	// Key for the opposite direction of the same connection
+	FlowKey Reverse() const
+	{
+		FlowKey key(*this);
+		std::memcpy(key.src, dst, sizeof(dst));
+		std::memcpy(key.dst, src, sizeof(src));
+		key.srcPort = dstPort;
+		key.dstPort = srcPort;
+		return key;
+	}
+
+	uint64_t Hash() const
+	{
+		uint64_t words[sizeof(FlowKey) / 8];
+		std::memcpy(words, this, sizeof(words));
+
+		uint64_t h = 0x9e3779b97f4a7c15ull;
+		for (auto i = 0u; i < sizeof(words) / 8; i++) {
+			h ^= words[i] * 0xff51afd7ed558ccdull;
+			h = (h << 27 | h >> 37) * 0xc4ceb9fe1a85ec53ull;
+		}
+
+		// fmix64 finalizer from MurmurHash3 so the low bits are usable as a table index
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	// The same for both directions of a connection, so they can be sent to the same thread
+	uint64_t ConnectionHash() const
+	{
+		auto a = Hash(), b = Reverse().Hash();
+		return a < b ? a : b;
+	}
+
+	friend bool operator==(const FlowKey &a, const FlowKey &b) { return std::memcmp(&a, &b, sizeof(FlowKey)) == 0; }
+	friend bool operator!=(const FlowKey &a, const FlowKey &b) { return !(a == b); }
+};
+
+static_assert(sizeof(FlowKey) == 40, "FlowKey must be tightly packed");
+
+} // namespace tcp
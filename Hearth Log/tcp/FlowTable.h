@@ -0,0 +1,164 @@
+#pragma once
+
+#include "FlowKey.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace tcp {
+
+// Open-addressing hash table keyed by FlowKey (linear probing with
+// backward-shift deletion, so there are no tombstones to clean up).
+//
+// NB: Pointers returned by Find/Insert are invalidated by any later
+// Insert or Erase.
+template <typename T>
+class FlowTable
+{
+public:
+	FlowTable() : _meta(), _values(), _size(0) { }
+
+	size_t Size() const { return _size; }
+	bool Empty() const { return _size == 0; }
+
+	T *Find(const FlowKey &key)
+	{
+		if (_size == 0) {
+			return nullptr;
+		}
+
+		auto hash = key.Hash();
+		for (auto i = size_t(hash) & Mask(); _meta[i].used; i = (i + 1) & Mask()) {
+			if (_meta[i].hash == hash && _meta[i].key == key) {
+				return &_values[i];
+			}
+		}
+		return nullptr;
+	}
+
+	// Returns the value for key, default constructing it if needed. The bool
+	// is true if the value was newly inserted.
+	std::pair<T *, bool> Insert(const FlowKey &key)
+	{
+		if ((_size + 1) * 4 > _meta.size() * 3) {
+			Rehash(_meta.empty() ? 16 : _meta.size() * 2);
+		}
+
+		auto hash = key.Hash();
+		auto i = size_t(hash) & Mask();
+		for (; _meta[i].used; i = (i + 1) & Mask()) {
+			if (_meta[i].hash == hash && _meta[i].key == key) {
+				return std::make_pair(&_values[i], false);
+			}
+		}
+
+		_meta[i].used = true;
+		_meta[i].hash = hash;
+		_meta[i].key = key;
+		_size++;
+		return std::make_pair(&_values[i], true);
+	}
+
+	bool Erase(const FlowKey &key)
+	{
+		auto value = Find(key);
+		if (!value) {
+			return false;
+		}
+
+		EraseAt(value - _values.data());
+		return true;
+	}
+
+	// Calls f(key, value) for every entry
+	template <typename F> void ForEach(F f)
+	{
+		for (auto i = 0u; i < _meta.size(); i++) {
+			if (_meta[i].used) {
+				f(_meta[i].key, _values[i]);
+			}
+		}
+	}
+
+	// Erases every entry where pred(key, value) returns true, returning the number erased
+	template <typename F> size_t EraseIf(F pred)
+	{
+		size_t erased = 0;
+		for (auto i = 0u; i < _meta.size(); ) {
+			if (_meta[i].used && pred(_meta[i].key, _values[i])) {
+				// Don't advance since a later entry may have been shifted into this slot
+				EraseAt(i);
+				erased++;
+			} else {
+				i++;
+			}
+		}
+		return erased;
+	}
+
+	// Erases every entry (values are destroyed while the table is still consistent)
+	void Clear()
+	{
+		_meta.clear();
+		_values.clear();
+		_size = 0;
+	}
+
+private:
+	struct Meta
+	{
+		Meta() : key(), hash(0), used(false) { }
+
+		FlowKey key;
+		uint64_t hash;
+		bool used;
+	};
+
+	std::vector<Meta> _meta;
+	std::vector<T> _values;
+	size_t _size;
+
+	size_t Mask() const { return _meta.size() - 1; }
+
+	void EraseAt(size_t i)
+	{
+		// Shift later entries of the probe sequence back into the hole so
+		// lookups never have to skip over deleted slots.
+		for (auto j = (i + 1) & Mask(); _meta[j].used; j = (j + 1) & Mask()) {
+			auto home = size_t(_meta[j].hash) & Mask();
+			auto distJ = (j - home) & Mask();
+			auto distI = (i - home) & Mask();
+			if (distI < distJ) {
+				_meta[i] = _meta[j];
+				_values[i] = std::move(_values[j]);
+				i = j;
+			}
+		}
+
+		_meta[i] = Meta();
+		_values[i] = T();
+		_size--;
+	}
+
+	void Rehash(size_t capacity)
+	{
+		std::vector<Meta> meta(capacity);
+		std::vector<T> values(capacity);
+		meta.swap(_meta);
+		values.swap(_values);
+
+		for (auto i = 0u; i < meta.size(); i++) {
+			if (meta[i].used) {
+				auto j = size_t(meta[i].hash) & Mask();
+				while (_meta[j].used) {
+					j = (j + 1) & Mask();
+				}
+				_meta[j] = meta[i];
+				_values[j] = std::move(values[i]);
+			}
+		}
+	}
+};
+
+} // namespace tcp
@@ -0,0 +1,110 @@
+#include "FrameRing.h"
+
+#include <cstring>
+
+namespace {
+
+struct FrameHeader
+{
+	int64_t nanotime;
+	int32_t linkType;
+	uint32_t length;
+};
+
+// Marks the unused end of the buffer when a frame wraps around to the start
+const uint32_t WRAP = 0xffffffff;
+
+// Records are aligned to the header size so there's always room for a WRAP
+// header at the end of the buffer
+size_t recordSize(size_t length)
+{
+	return (sizeof(FrameHeader) + length + sizeof(FrameHeader) - 1) & ~(sizeof(FrameHeader) - 1);
+}
+
+size_t roundUpPow2(size_t n)
+{
+	size_t size = 1024;
+	while (size < n) {
+		size *= 2;
+	}
+	return size;
+}
+
+} // namespace
+
+static_assert(sizeof(FrameHeader) == 16, "FrameHeader must be 16 bytes");
+
+tcp::FrameRing::FrameRing(size_t capacity)
+	: _buffer(roundUpPow2(capacity)),
+	  _mask(_buffer.size() - 1),
+	  _head(0),
+	  _tail(0)
+{
+}
+
+size_t tcp::FrameRing::MaxFrame() const
+{
+	// A frame may need to skip the end of the buffer, so it can't be more than half of it
+	return _buffer.size() / 2 - sizeof(FrameHeader);
+}
+
+bool tcp::FrameRing::Push(int64_t nanotime, int linkType, std::range<const uint8_t *> frame)
+{
+	auto length = size_t(frame.size());
+	auto size = recordSize(length);
+	auto tail = _tail.load(std::memory_order_relaxed);
+	auto head = _head.load(std::memory_order_acquire);
+
+	// Frames are never split, so skip the end of the buffer if it doesn't fit there
+	auto offset = tail & _mask;
+	auto contiguous = _buffer.size() - offset;
+	auto skip = size > contiguous ? contiguous : 0;
+	if (skip + size > _buffer.size() - (tail - head)) {
+		return false;
+	}
+
+	FrameHeader header;
+	if (skip) {
+		header.nanotime = 0;
+		header.linkType = 0;
+		header.length = WRAP;
+		memcpy(&_buffer[offset], &header, sizeof(header));
+		tail += skip;
+		offset = 0;
+	}
+
+	header.nanotime = nanotime;
+	header.linkType = linkType;
+	header.length = uint32_t(length);
+	memcpy(&_buffer[offset], &header, sizeof(header));
+	memcpy(&_buffer[offset + sizeof(header)], frame.begin(), length);
+
+	_tail.store(tail + size, std::memory_order_release);
+	return true;
+}
+
+size_t tcp::FrameRing::Drain(PacketCapture::Callback &callback)
+{
+	auto head = _head.load(std::memory_order_relaxed);
+	auto tail = _tail.load(std::memory_order_acquire);
+
+	size_t frames = 0;
+	while (head != tail) {
+		auto offset = head & _mask;
+		FrameHeader header;
+		memcpy(&header, &_buffer[offset], sizeof(header));
+
+		if (header.length == WRAP) {
+			head += _buffer.size() - offset;
+		} else {
+			auto data = _buffer.data() + offset + sizeof(header);
+			callback(header.nanotime, header.linkType, std::make_range<const uint8_t *>(data, data + header.length));
+			head += recordSize(header.length);
+			frames++;
+		}
+
+		// Free the space straight away so the producer isn't held up by a slow callback
+		_head.store(head, std::memory_order_release);
+	}
+	return frames;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "../PacketCapture.h"
+
+#include <atomic>
+#include <cstdint>
+#include "../range.h"
+#include <vector>
+
+namespace tcp {
+
+// Lock-free queue of captured frames between exactly one producer thread and
+// one consumer thread. Frames are copied into a fixed buffer back to back
+// (<nanotime 8><link type 4><length 4><frame>, padded to 16 bytes), so
+// nothing is allocated once it's created.
+class FrameRing
+{
+public:
+	// Capacity is rounded up to a power of two
+	explicit FrameRing(size_t capacity);
+
+	// Largest frame that can ever be pushed
+	size_t MaxFrame() const;
+
+	// Producer: copies the frame in, returning false if there isn't room for it yet
+	bool Push(int64_t nanotime, int linkType, std::range<const uint8_t *> frame);
+
+	// Consumer: passes the queued frames to callback in order (freeing their
+	// space as it goes), returning how many there were
+	size_t Drain(PacketCapture::Callback &callback);
+
+	bool Empty() const { return _head.load() == _tail.load(); }
+
+private:
+	std::vector<uint8_t> _buffer;
+	const size_t _mask;
+
+	// Total bytes ever consumed and produced (kept on separate cache lines
+	// since they're written by different threads)
+	char _pad0[64];
+	std::atomic<size_t> _head;
+	char _pad1[64];
+	std::atomic<size_t> _tail;
+	char _pad2[64];
+
+	FrameRing(const FrameRing &);
+	FrameRing &operator=(const FrameRing &);
+};
+
+} // namespace tcp
@@ -0,0 +1,216 @@
+#include "LinkLayer.h"
+#include "../Log.h"
+
+#include "pcap_tcp.h"
+
+// Link types (from pcap.h, which isn't needed here except on Windows) and
+// ones added to libpcap after some of the versions we build against
+#ifndef DLT_NULL
+#define DLT_NULL 0
+#endif
+#ifndef DLT_EN10MB
+#define DLT_EN10MB 1
+#endif
+#ifndef DLT_RAW
+#define DLT_RAW 12
+#endif
+#ifndef DLT_LOOP
+#define DLT_LOOP 108
+#endif
+#ifndef DLT_LINUX_SLL
+#define DLT_LINUX_SLL 113
+#endif
+#ifndef DLT_IPV4
+#define DLT_IPV4 228
+#endif
+#ifndef DLT_IPV6
+#define DLT_IPV6 229
+#endif
+#ifndef DLT_LINUX_SLL2
+#define DLT_LINUX_SLL2 276
+#endif
+
+#define ETHERTYPE_VLAN          0x8100  /* IEEE 802.1Q VLAN tag */
+#define ETHERTYPE_QINQ          0x88a8  /* IEEE 802.1ad service tag */
+#define ETHERTYPE_QINQ_OLD      0x9100  /* pre-standard QinQ tag */
+
+#define VLAN_HDRLEN             4
+#define NULL_HDRLEN             4
+#define SLL_HDRLEN              16
+#define SLL_PROTOCOL_OFFSET     14
+#define SLL2_HDRLEN             20
+#define SLL2_PROTOCOL_OFFSET    0
+
+namespace {
+
+inline uint16_t read16(const uint8_t *p) { return uint16_t(p[0] << 8 | p[1]); }
+
+// Skips any 802.1Q/802.1ad tags, leaving etherType set to the encapsulated protocol
+bool skipVlanTags(std::range<const uint8_t *> frame, uint16_t &etherType, ptrdiff_t &offset)
+{
+	while (etherType == ETHERTYPE_VLAN || etherType == ETHERTYPE_QINQ || etherType == ETHERTYPE_QINQ_OLD) {
+		if (offset + VLAN_HDRLEN > frame.size()) {
+			LogError("truncated VLAN tag (%d bytes)", int(frame.size()));
+			return false;
+		}
+		etherType = read16(frame.begin() + offset + 2);
+		offset += VLAN_HDRLEN;
+	}
+	return true;
+}
+
+bool decodeEthernet(std::range<const uint8_t *> frame, uint16_t &etherType, ptrdiff_t &offset)
+{
+	if (ETHER_HDRLEN > frame.size()) {
+		LogError("truncated Ethernet header (%d bytes)", int(frame.size()));
+		return false;
+	}
+
+	etherType = ntohs(reinterpret_cast<const ether_header *>(frame.begin())->ether_type);
+	offset = ETHER_HDRLEN;
+	return skipVlanTags(frame, etherType, offset);
+}
+
+// Maps a BSD address family to an ethertype (AF_INET6 differs between platforms)
+bool familyToEtherType(uint32_t family, uint16_t &etherType)
+{
+	switch (family) {
+	case 2: // AF_INET everywhere
+		etherType = ETHERTYPE_IP;
+		return true;
+	case 10: // Linux
+	case 23: // Windows
+	case 24: // NetBSD, OpenBSD
+	case 28: // FreeBSD
+	case 30: // Darwin
+		etherType = ETHERTYPE_IPV6;
+		return true;
+	default:
+		LogError("unsupported loopback address family: %d", family);
+		return false;
+	}
+}
+
+bool decodeNull(std::range<const uint8_t *> frame, uint16_t &etherType, ptrdiff_t &offset)
+{
+	if (NULL_HDRLEN > frame.size()) {
+		LogError("truncated loopback header (%d bytes)", int(frame.size()));
+		return false;
+	}
+
+	// The family is in the capturing host's byte order, which may not be ours
+	// if this came from a file, but valid values always fit in the low byte.
+	auto p = frame.begin();
+	uint32_t family = p[0] != 0 ? p[0] : p[3];
+
+	offset = NULL_HDRLEN;
+	return familyToEtherType(family, etherType);
+}
+
+bool decodeLoop(std::range<const uint8_t *> frame, uint16_t &etherType, ptrdiff_t &offset)
+{
+	if (NULL_HDRLEN > frame.size()) {
+		LogError("truncated loopback header (%d bytes)", int(frame.size()));
+		return false;
+	}
+
+	// Same as DLT_NULL but always in network byte order
+	auto p = frame.begin();
+	uint32_t family = uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+
+	offset = NULL_HDRLEN;
+	return familyToEtherType(family, etherType);
+}
+
+bool decodeLinuxSll(std::range<const uint8_t *> frame, uint16_t &etherType, ptrdiff_t &offset)
+{
+	if (SLL_HDRLEN > frame.size()) {
+		LogError("truncated Linux cooked header (%d bytes)", int(frame.size()));
+		return false;
+	}
+
+	etherType = read16(frame.begin() + SLL_PROTOCOL_OFFSET);
+	offset = SLL_HDRLEN;
+	return skipVlanTags(frame, etherType, offset);
+}
+
+bool decodeLinuxSll2(std::range<const uint8_t *> frame, uint16_t &etherType, ptrdiff_t &offset)
+{
+	if (SLL2_HDRLEN > frame.size()) {
+		LogError("truncated Linux cooked v2 header (%d bytes)", int(frame.size()));
+		return false;
+	}
+
+	etherType = read16(frame.begin() + SLL2_PROTOCOL_OFFSET);
+	offset = SLL2_HDRLEN;
+	return skipVlanTags(frame, etherType, offset);
+}
+
+bool decodeRaw(std::range<const uint8_t *> frame, uint16_t &etherType, ptrdiff_t &offset)
+{
+	if (frame.empty()) {
+		LogError("empty raw IP frame");
+		return false;
+	}
+
+	// No link-layer header, so use the IP version nibble
+	switch (frame[0] >> 4) {
+	case 4: etherType = ETHERTYPE_IP; break;
+	case 6: etherType = ETHERTYPE_IPV6; break;
+	default:
+		LogError("unknown raw IP version: %d", frame[0] >> 4);
+		return false;
+	}
+
+	offset = 0;
+	return true;
+}
+
+struct Decoder
+{
+	int linkType;
+	const char *name;
+	bool (*decode)(std::range<const uint8_t *> frame, uint16_t &etherType, ptrdiff_t &offset);
+};
+
+// Ethernet first since it's by far the most common
+const Decoder decoders[] = {
+	{ DLT_EN10MB,     "Ethernet",             decodeEthernet },
+	{ DLT_NULL,       "BSD loopback",         decodeNull },
+	{ DLT_LOOP,       "OpenBSD loopback",     decodeLoop },
+	{ DLT_LINUX_SLL,  "Linux cooked",         decodeLinuxSll },
+	{ DLT_LINUX_SLL2, "Linux cooked v2",      decodeLinuxSll2 },
+	{ DLT_RAW,        "raw IP",               decodeRaw },
+	{ 101,            "raw IP",               decodeRaw }, // LINKTYPE_RAW (from savefiles on platforms where DLT_RAW is 14)
+	{ DLT_IPV4,       "raw IPv4",             decodeRaw },
+	{ DLT_IPV6,       "raw IPv6",             decodeRaw },
+};
+
+const Decoder *findDecoder(int linkType)
+{
+	for (auto i = 0u; i < sizeof(decoders) / sizeof(decoders[0]); i++) {
+		if (decoders[i].linkType == linkType) {
+			return &decoders[i];
+		}
+	}
+	return nullptr;
+}
+
+} // namespace
+
+bool tcp::LinkLayer::Decode(int linkType, std::range<const uint8_t *> frame, uint16_t &etherType, ptrdiff_t &offset)
+{
+	auto decoder = findDecoder(linkType);
+	if (!decoder) {
+		LogError("unsupported link type: %d", linkType);
+		return false;
+	}
+
+	return decoder->decode(frame, etherType, offset);
+}
+
+const char *tcp::LinkLayer::Name(int linkType)
+{
+	auto decoder = findDecoder(linkType);
+	return decoder ? decoder->name : nullptr;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include "../range.h"
+
+namespace tcp {
+
+class LinkLayer
+{
+public:
+	// Strips the link-layer header for the given pcap_datalink() type (DLT_*),
+	// returning the ETHERTYPE_* of the network layer and its offset in frame.
+	// Returns false (after logging) if the frame can't be decoded.
+	static bool Decode(int linkType, std::range<const uint8_t *> frame, uint16_t &etherType, ptrdiff_t &offset);
+
+	// Name of a supported link type for log output (or nullptr if unsupported)
+	static const char *Name(int linkType);
+
+private:
+	LinkLayer() {}
+};
+
+} // namespace tcp
@@ -1,63 +1,125 @@
-// wx #includes must come first to prevent secure function warning from wxcrt.h
-#include <wx/log.h>
-
 #include "Parser.h"
 #include "Segment.h"
 #include "Stream.h"
+#include "../Log.h"
 
 #include "../util.h"
 
+// How often (in capture time) to check for idle flows
+const int64_t EXPIRE_INTERVAL = int64_t(10e9);
+
+tcp::Parser::Flow::Flow(Flow &&other)
+	: stream(std::move(other.stream)),
+	  lastSeen(other.lastSeen)
+{
+}
+
+tcp::Parser::Flow &tcp::Parser::Flow::operator=(Flow &&other)
+{
+	stream = std::move(other.stream);
+	lastSeen = other.lastSeen;
+	return *this;
+}
+
 tcp::Parser::Parser(Callback::Factory callbackFactory)
 	: _streams(),
-	  _callbackFactory(callbackFactory)
+	  _callbackFactory(callbackFactory),
+	  _maxStreamBuffer(1 << 20),
+	  _maxBufferedBytes(64 << 20),
+	  _bufferedBytes(0),
+	  _streamTimeout(int64_t(600e9)),
+	  _ignoredTimeout(int64_t(60e9)),
+	  _lastExpire(0),
+	  _resync(false),
+	  _draining(false),
+	  _stats()
+{
+}
+
+tcp::Parser::~Parser()
 {
+	// Close streams while the parser is still intact since they call back into it
+	Drain();
 }
 
-void tcp::Parser::operator()(int64_t nanotime, std::range<const uint8_t*> data)
+void tcp::Parser::Drain()
 {
-	tcp::Segment segment(data);
+	if (_streams.Empty()) {
+		return;
+	}
+
+	LogVerbose("draining %d flows", int(_streams.Size()));
+	_draining = true;
+	_streams.Clear();
+	_draining = false;
+}
+
+void tcp::Parser::operator()(int64_t nanotime, int linkType, std::range<const uint8_t*> data)
+{
+	// Periodically drop flows that have gone quiet without a FIN/RST
+	if (nanotime - _lastExpire >= EXPIRE_INTERVAL) {
+		Expire(nanotime);
+		_lastExpire = nanotime;
+	}
+
+	// Enforce the global budget for out-of-order data (checked before any stream
+	// pointers are held, since eviction moves entries around in the table)
+	if (_bufferedBytes > _maxBufferedBytes) {
+		Evict();
+	}
+
+	tcp::Segment segment(linkType, data);
 	if (!segment.WasParsed() || segment.IsRst()) {
 		// Try to reset/clear the TcpStream
-		wxLogVerbose("%s: %s", segment.IsRst() ? "connection reset" : "segment parse error", segment.Endpoints().SrcToDst());
-		_streams.erase(segment.Endpoints().SrcToDst());
-		_streams.erase(segment.Endpoints().DstToSrc());
+		LogVerbose("%s: %s", segment.IsRst() ? "connection reset" : "segment parse error", segment.Endpoints().SrcToDst().c_str());
+		auto key = segment.Key();
+		_streams.Erase(key);
+		_streams.Erase(key.Reverse());
 		return;
 	}
 
-	auto key = segment.Endpoints().SrcToDst();
+	auto key = segment.Key();
 	auto seq = segment.SeqNum();
 
 	// Get the current stream or reserve space for a new one
-	auto prevSize = _streams.size();
-	auto &stream = _streams[key];
+	auto inserted = _streams.Insert(key);
+	auto &stream = inserted.first->stream;
+	inserted.first->lastSeen = nanotime;
 
 	if (segment.IsSyn()) {
 		// This is a SYN packet, so create a new stream if there wasn't one already
 		// or if this starting sequence number doesn't match.
 		if (!stream || stream->FirstSeq() != seq) {
 			// Get the reverse stream if it already exists
-			auto it = _streams.find(segment.Endpoints().DstToSrc());
-			auto other = it != _streams.end() ? it->second.get() : nullptr;
+			auto it = _streams.Find(key.Reverse());
+			auto other = it ? it->stream.get() : nullptr;
 
 			// Create a new stream if there wasn't one or the starting sequence number didn't match
 			stream = std::make_unique<Stream>(this, segment.Endpoints(), other, nanotime, seq);
 		}
-	} else {
-		// Not a SYN packet, if this is the first time we've seen this connection
-		// report that it will be ignored (map now contains a null Stream for that key).
-		if (_streams.size() > prevSize) {
-			wxLogVerbose("ignoring %s (no SYN)", key);
-		}
+	} else if (!stream) {
+		if (_resync && segment.Payload().size() > 0) {
+			// Pick the connection up mid-stream starting from this segment and let
+			// the callback find the message framing (Stream::IsMidStream).
+			LogVerbose("resyncing %s (no SYN)", segment.Endpoints().SrcToDst().c_str());
+
+			auto it = _streams.Find(key.Reverse());
+			auto other = it ? it->stream.get() : nullptr;
+			stream = std::make_unique<Stream>(this, segment.Endpoints(), other, nanotime, seq - 1, true);
+		} else {
+			// Not a SYN packet, if this is the first time we've seen this connection
+			// report that it will be ignored (table now contains a null Stream for that key).
+			if (inserted.second) {
+				LogVerbose("ignoring %s (no SYN)", segment.Endpoints().SrcToDst().c_str());
+			}
 
-		// In any case, stop now if this stream is being ignored (null Stream).
-		if (!stream) {
 			// Stop ignoring if this is a FIN packet. This isn't strictly needed
 			// (if a SYN is seen a new Stream will be created) and it may not always
 			// work (if data is seen after the FIN a null will be re-inserted) but
 			// most of the time this should work to keep only active connections in
-			// this map to save space for long-running programs.
+			// this table to save space for long-running programs.
 			if (segment.IsFin()) {
-				_streams.erase(key);
+				_streams.Erase(key);
 			}
 			return;
 		}
@@ -66,16 +128,67 @@ void tcp::Parser::operator()(int64_t nanotime, std::range<const uint8_t*> data)
 	// Pass the data along for reassembly
 	auto payload = segment.Payload();
 	if (payload.size() > 0) {
-		stream->Add(nanotime, seq, payload);
+		stream->Add(nanotime, seq, payload); // NB: stream may be invalid after this returns (a cached FIN calls Remove)
 	}
 
 	// Handle final packets
 	if (segment.IsFin()) {
-		stream->Close(nanotime, seq + payload.size()); // NB: stream may be invalid after this returns (usually calls Remove)
+		// Look the stream up again since Add may have removed it (and moved other entries around)
+		auto current = _streams.Find(key);
+		if (current && current->stream) {
+			current->stream->Close(nanotime, seq + payload.size()); // NB: stream may be invalid after this returns (usually calls Remove)
+		}
 	}
 }
 
 void tcp::Parser::Remove(Stream *stream)
 {
-	_streams.erase(stream->Endpoints().SrcToDst());
+	_streams.Erase(stream->Key());
+}
+
+void tcp::Parser::Expire(int64_t nanotime)
+{
+	auto streamCutoff = nanotime - _streamTimeout;
+	auto ignoredCutoff = nanotime - _ignoredTimeout;
+
+	auto expired = _streams.EraseIf([&](const FlowKey &, const Flow &flow) -> bool {
+		if (flow.lastSeen >= (flow.stream ? streamCutoff : ignoredCutoff)) {
+			return false;
+		}
+		if (flow.stream) {
+			LogVerbose("%s expiring idle stream", flow.stream->Endpoints().SrcToDst().c_str());
+		}
+		return true;
+	});
+
+	if (expired > 0) {
+		_stats.expiredFlows += expired;
+		LogVerbose("expired %d idle flows (%d remaining)", int(expired), int(_streams.Size()));
+	}
+}
+
+void tcp::Parser::Evict()
+{
+	while (_bufferedBytes > _maxBufferedBytes) {
+		// Find the least recently active stream that is holding buffered data
+		const FlowKey *lruKey = nullptr;
+		int64_t lruTime = 0;
+		_streams.ForEach([&](const FlowKey &key, const Flow &flow) {
+			if (flow.stream && flow.stream->WindowBytes() > 0 && (!lruKey || flow.lastSeen < lruTime)) {
+				lruKey = &key;
+				lruTime = flow.lastSeen;
+			}
+		});
+
+		if (!lruKey) {
+			break; // shouldn't happen, but don't spin if the accounting is off
+		}
+
+		auto key = *lruKey;
+		auto flow = _streams.Find(key);
+		LogWarning("%s evicting stream (%d bytes buffered, %d total)", flow->stream->Endpoints().SrcToDst().c_str(), int(flow->stream->WindowBytes()), int(_bufferedBytes));
+
+		_streams.Erase(key);
+		_stats.evictedFlows++;
+	}
 }
@@ -2,9 +2,10 @@
 
 #include "../PacketCapture.h"
 
+#include "FlowTable.h"
+
 #include <cstdint>
 #include "../range.h"
-#include <map>
 #include <memory>
 
 namespace tcp {
@@ -23,17 +24,80 @@ public:
 		typedef Ptr (*Factory)(int64_t, Stream*);
 	};
 
+	// Counters for flows dropped before they were closed normally
+	struct Stats
+	{
+		Stats() : expiredFlows(0), evictedFlows(0) { }
+
+		uint64_t expiredFlows; // idle for longer than the idle timeout
+		uint64_t evictedFlows; // least recently used when over the buffer budget
+	};
+
 	explicit Parser(Callback::Factory callbackFactory);
+	virtual ~Parser();
 
-	virtual void operator()(int64_t nanotime, std::range<const uint8_t*> data);
+	virtual void operator()(int64_t nanotime, int linkType, std::range<const uint8_t*> data);
 
 	Callback::Factory Factory() const { return _callbackFactory; }
 
+	// Limit on out-of-order data buffered by each stream (segments beyond it are dropped)
+	size_t MaxStreamBuffer() const { return _maxStreamBuffer; }
+	void SetMaxStreamBuffer(size_t bytes) { _maxStreamBuffer = bytes; }
+
+	// Limit on out-of-order data buffered across all streams (least recently
+	// active streams are dropped to get back under it)
+	size_t MaxBufferedBytes() const { return _maxBufferedBytes; }
+	void SetMaxBufferedBytes(size_t bytes) { _maxBufferedBytes = bytes; }
+
+	// Flows with no packets for this long (in capture time) are dropped. Ignored
+	// flows (no SYN seen) only need to be remembered long enough to avoid
+	// logging them repeatedly, so they use a shorter timeout.
+	void SetIdleTimeout(int64_t streamNanos, int64_t ignoredNanos) { _streamTimeout = streamNanos; _ignoredTimeout = ignoredNanos; }
+
+	// Opt-in: start streams for connections whose SYN wasn't seen (e.g. the app
+	// started mid-game) instead of ignoring them. Such streams report
+	// IsMidStream() so the callback can find its framing in the byte stream.
+	bool Resync() const { return _resync; }
+	void SetResync(bool resync) { _resync = resync; }
+
+	// Closes every stream (as if it had ended) so callbacks can persist what
+	// they have. Done automatically when the parser is destroyed.
+	void Drain();
+	bool Draining() const { return _draining; }
+
+	const Stats &GetStats() const { return _stats; }
+	size_t BufferedBytes() const { return _bufferedBytes; }
+
+	// Called by streams as their reassembly buffers grow and shrink
+	void UpdateBuffered(ptrdiff_t delta) { _bufferedBytes += delta; }
+
 	void Remove(Stream *stream);
 
 private:
-	std::map<std::string, std::unique_ptr<Stream>> _streams;
+	struct Flow
+	{
+		Flow() : stream(), lastSeen(0) { }
+		Flow(Flow &&other);
+		Flow &operator=(Flow &&other);
+
+		std::unique_ptr<Stream> stream; // null if the flow is being ignored
+		int64_t lastSeen;
+	};
+
+	FlowTable<Flow> _streams;
 	const Callback::Factory _callbackFactory;
+	size_t _maxStreamBuffer;
+	size_t _maxBufferedBytes;
+	size_t _bufferedBytes;
+	int64_t _streamTimeout;
+	int64_t _ignoredTimeout;
+	int64_t _lastExpire;
+	bool _resync;
+	bool _draining;
+	Stats _stats;
+
+	void Expire(int64_t nanotime);
+	void Evict();
 };
 
 } // namespace tcp
@@ -1,34 +1,38 @@
-// wx #includes must come first to prevent secure function warning from wxcrt.h
-#include <wx/log.h>
-
 #include "Segment.h"
+#include "LinkLayer.h"
+#include "../Log.h"
 
 #include "pcap_tcp.h"
 
-tcp::Segment::Segment(std::range<const uint8_t *> frame)
+tcp::Segment::Segment(int linkType, std::range<const uint8_t *> frame)
+	: _endpoints(),
+	  _seq(0),
+	  _flags(0),
+	  _ok(false),
+	  _payload()
 {
 	//-------------------------------------------------------------------------
-	// Ethernet
-	auto ether = reinterpret_cast<const ether_header *>(frame.begin());
-	ptrdiff_t offset = ETHER_HDRLEN;
+	// Link layer
+	uint16_t etherType;
+	ptrdiff_t offset;
 
-	if (offset > frame.size()) {
-		wxLogError("truncated Ethernet header (%d bytes)", frame.size());
+	if (!LinkLayer::Decode(linkType, frame, etherType, offset)) {
 		return;
 	}
 
 	//-------------------------------------------------------------------------
 	// IP
-	std::string ipSrc, ipDst;
+	uint8_t ipFamily;
+	const void *ipSrcAddr, *ipDstAddr;
 	u_int8_t ipPayloadType;
 	ptrdiff_t ipPayloadLen;
 
-	switch (ntohs(ether->ether_type)) {
+	switch (etherType) {
 	case ETHERTYPE_IP: { // IPv4
 			// Check minimum header size before reading the actual length
 			auto ip4HeaderLen = 20; // default (min) size
 			if (offset + ip4HeaderLen > frame.size()) {
-				wxLogError("truncated IPv4 header (%d bytes)", frame.size());
+				LogError("truncated IPv4 header (%d bytes)", int(frame.size()));
 				return;
 			}
 
@@ -36,45 +40,116 @@ tcp::Segment::Segment(std::range<const uint8_t *> frame)
 
 			// Parse out the info we care about
 			ip4HeaderLen = IP_HL(ipv4) * 4;
+			if (ip4HeaderLen < 20) {
+				LogError("bad IPv4 header length (%d bytes)", ip4HeaderLen);
+				return;
+			}
 
 			ipPayloadType = ipv4->ip_p;
 			ipPayloadLen = ntohs(ipv4->ip_len) - ip4HeaderLen;
 
-			ipSrc = inet_ntoa(ipv4->ip_src);
-			ipDst = inet_ntoa(ipv4->ip_dst);
+			ipFamily = FlowKey::IPv4;
+			ipSrcAddr = &ipv4->ip_src;
+			ipDstAddr = &ipv4->ip_dst;
 
 			// Check actual packet size
 			offset += ip4HeaderLen;
 			if (offset > frame.size()) {
-				wxLogError("truncated IPv4 header (%d bytes)", frame.size());
+				LogError("truncated IPv4 header (%d bytes)", int(frame.size()));
 				return;
 			}
 		}
 		break;
 
 	case ETHERTYPE_IPV6: {
-			// TODO
-			wxLogError("NYI: IPv6");
-			return;
+			if (offset + IP6_HDRLEN > frame.size()) {
+				LogError("truncated IPv6 header (%d bytes)", int(frame.size()));
+				return;
+			}
+
+			auto ipv6 = reinterpret_cast<const ip6_hdr *>(frame.begin() + offset);
+
+			ipFamily = FlowKey::IPv6;
+			ipSrcAddr = ipv6->ip6_src;
+			ipDstAddr = ipv6->ip6_dst;
+
+			// NB: payload length includes any extension headers (0 means a jumbogram, which is dropped below)
+			ipPayloadType = ipv6->ip6_nxt;
+			ipPayloadLen = ntohs(ipv6->ip6_plen);
+			offset += IP6_HDRLEN;
+
+			// Skip over any extension headers to find the upper layer protocol
+			auto done = false;
+			while (!done) {
+				ptrdiff_t extLen;
+				switch (ipPayloadType) {
+				case IPPROTO_HOPOPTS:
+				case IPPROTO_ROUTING:
+				case IPPROTO_DSTOPTS:
+				case IPPROTO_MH:
+				case IPPROTO_AH:
+				case IPPROTO_FRAGMENT: {
+						if (offset + ptrdiff_t(sizeof(ip6_ext)) > frame.size()) {
+							LogError("truncated IPv6 extension header (%d bytes)", int(frame.size()));
+							return;
+						}
+						auto ext = reinterpret_cast<const ip6_ext *>(frame.begin() + offset);
+
+						if (ipPayloadType == IPPROTO_FRAGMENT) {
+							if (offset + ptrdiff_t(sizeof(ip6_frag)) > frame.size()) {
+								LogError("truncated IPv6 fragment header (%d bytes)", int(frame.size()));
+								return;
+							}
+
+							// TCP segments shouldn't be fragmented, so only accept atomic fragments
+							auto frag = reinterpret_cast<const ip6_frag *>(ext);
+							if ((ntohs(frag->ip6f_offlg) & (IP6F_OFF_MASK | IP6F_MORE_FRAG)) != 0) {
+								LogError("NYI: IPv6 fragment reassembly");
+								return;
+							}
+							extLen = sizeof(ip6_frag);
+						} else if (ipPayloadType == IPPROTO_AH) {
+							extLen = (ext->ip6e_len + 2) * 4;
+						} else {
+							extLen = (ext->ip6e_len + 1) * 8;
+						}
+
+						ipPayloadType = ext->ip6e_nxt;
+						ipPayloadLen -= extLen;
+						offset += extLen;
+					}
+					break;
+
+				default:
+					done = true;
+					break;
+				}
+			}
+
+			// Check actual packet size
+			if (offset > frame.size() || ipPayloadLen < 0) {
+				LogError("truncated IPv6 extension header (%d bytes)", int(frame.size()));
+				return;
+			}
 		}
 		break;
 
 	default:
-		wxLogError("expected IP packet (ether_type: 0x%04x)", ntohs(ether->ether_type));
+		LogError("expected IP packet (ether_type: 0x%04x)", etherType);
 		return;
 	}
 
 	//-------------------------------------------------------------------------
 	// TCP
 	if (ipPayloadType != IPPROTO_TCP) {
-		wxLogError("expected TCP packet (ip_proto: %d)", ipPayloadType);
+		LogError("expected TCP packet (ip_proto: %d)", ipPayloadType);
 		return;
 	}
 
 	// Check minimum header size before reading the actual length
 	auto tcpHeaderLen = 20; // default (min) size
 	if (offset + tcpHeaderLen > frame.size()) {
-		wxLogError("truncated TCP header (%d bytes)", frame.size());
+		LogError("truncated TCP header (%d bytes)", int(frame.size()));
 		return;
 	}
 
@@ -82,10 +157,14 @@ tcp::Segment::Segment(std::range<const uint8_t *> frame)
 
 	// Parse out the info we care about
 	tcpHeaderLen = TH_OFF(tcp) * 4;
+	if (tcpHeaderLen < 20) {
+		LogError("bad TCP header length (%d bytes)", tcpHeaderLen);
+		return;
+	}
 
 	_endpoints = EndpointPair(
-		Endpoint(std::move(ipSrc), ntohs(tcp->th_sport)),
-		Endpoint(std::move(ipDst), ntohs(tcp->th_dport))
+		Endpoint(ipFamily, ipSrcAddr, ntohs(tcp->th_sport)),
+		Endpoint(ipFamily, ipDstAddr, ntohs(tcp->th_dport))
 	);
 
 	_seq = ntohl(tcp->th_seq);
@@ -94,7 +173,7 @@ tcp::Segment::Segment(std::range<const uint8_t *> frame)
 	// Check actual packet size
 	offset += tcpHeaderLen;
 	if (offset > frame.size()) {
-		wxLogError("truncated TCP header (%d bytes)", frame.size());
+		LogError("truncated TCP header (%d bytes)", int(frame.size()));
 		return;
 	}
 
@@ -102,8 +181,15 @@ tcp::Segment::Segment(std::range<const uint8_t *> frame)
 	// Payload
 	auto payloadLen = ipPayloadLen - tcpHeaderLen;
 
+	// A length field shorter than the headers (or an IPv6 jumbogram, whose
+	// payload length is 0) would give a reversed range
+	if (payloadLen < 0) {
+		LogError("bad IP payload length (%d bytes for %d bytes of TCP header)", int(ipPayloadLen), tcpHeaderLen);
+		return;
+	}
+
 	if (offset + payloadLen > frame.size()) {
-		wxLogError("truncated TCP payload (%d bytes)", frame.size());
+		LogError("truncated TCP payload (%d bytes)", int(frame.size()));
 		return;
 	}
 
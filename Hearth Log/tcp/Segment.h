@@ -10,9 +10,13 @@ namespace tcp {
 class Segment
 {
 public:
-	Segment(std::range<const uint8_t *> frame);
+	// Decodes the headers in place (no allocations), so segments can be
+	// decoded concurrently on any number of capture threads. linkType is the
+	// pcap_datalink() value of the handle the frame was captured on.
+	Segment(int linkType, std::range<const uint8_t *> frame);
 
 	const EndpointPair &Endpoints() const { return _endpoints; }
+	FlowKey Key() const { return _endpoints.Key(); }
 
 	const Endpoint &Src() const { return _endpoints.Src(); }
 	const Endpoint &Dst() const { return _endpoints.Dst(); }
@@ -0,0 +1,142 @@
+#include "ShardedParser.h"
+#include "FrameRing.h"
+#include "Segment.h"
+#include "../Log.h"
+
+#include "../util.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+class tcp::ShardedParser::Shard
+{
+public:
+	Shard(PacketCapture::Callback::Factory factory, size_t queueBytes)
+		: _factory(factory),
+		  _ring(queueBytes),
+		  _mu(),
+		  _ready(),
+		  _waiting(false),
+		  _finished(false),
+		  _thread()
+	{
+		_thread = std::thread([this]() { Run(); });
+	}
+
+	~Shard()
+	{
+		_finished = true;
+		Wake();
+		_thread.join();
+	}
+
+	FrameRing &Ring() { return _ring; }
+
+	// Called by the capture thread after queueing frames
+	void Notify()
+	{
+		// Pairs with the fence in Run: either the shard sees the frame or we
+		// see that it's waiting, so it's never left asleep with frames queued
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (_waiting.load(std::memory_order_relaxed)) {
+			Wake();
+		}
+	}
+
+private:
+	const PacketCapture::Callback::Factory _factory;
+	FrameRing _ring;
+	std::mutex _mu;
+	std::condition_variable _ready;
+	std::atomic<bool> _waiting;
+	std::atomic<bool> _finished;
+	std::thread _thread;
+
+	void Wake()
+	{
+		std::lock_guard<std::mutex> lock(_mu);
+		_ready.notify_one();
+	}
+
+	void Run()
+	{
+		auto callback = _factory();
+		while (1) {
+			// Frames queued before finishing was set are always drained
+			auto finished = _finished.load();
+			if (_ring.Drain(*callback) > 0) {
+				continue;
+			}
+			if (finished) {
+				break;
+			}
+
+			// Sleep until Notify (or the destructor) wakes us. Parsers expire
+			// idle flows on packet time, so there's nothing to do until then.
+			std::unique_lock<std::mutex> lock(_mu);
+			_waiting.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (_ring.Empty() && !_finished) {
+				_ready.wait(lock);
+			}
+			_waiting = false;
+		}
+
+		// Flush anything still buffered by the parser
+		callback.reset();
+	}
+
+	Shard(const Shard &);
+	Shard &operator=(const Shard &);
+};
+
+tcp::ShardedParser::ShardedParser(int shards, PacketCapture::Callback::Factory shardFactory, size_t queueBytes)
+	: _shards(),
+	  _stats()
+{
+	for (auto i = 0; i < shards; i++) {
+		_shards.push_back(std::make_unique<Shard>(shardFactory, queueBytes));
+	}
+	LogVerbose("parsing on %d threads", shards);
+}
+
+tcp::ShardedParser::~ShardedParser()
+{
+	_shards.clear();
+	LogVerbose("sharded parser: %llu frames, %llu stalls, %llu dropped", static_cast<unsigned long long>(_stats.frames),
+		static_cast<unsigned long long>(_stats.stalls), static_cast<unsigned long long>(_stats.dropped));
+}
+
+void tcp::ShardedParser::operator()(int64_t nanotime, int linkType, std::range<const uint8_t*> data)
+{
+	_stats.frames++;
+
+	// Frames that don't decode are dropped here (Segment has logged why)
+	// rather than passed on to be decoded and logged again
+	tcp::Segment segment(linkType, data);
+	if (!segment.WasParsed()) {
+		_stats.dropped++;
+		return;
+	}
+
+	auto &shard = *_shards[segment.Key().ConnectionHash() % _shards.size()];
+	auto &ring = shard.Ring();
+	if (size_t(data.size()) > ring.MaxFrame()) {
+		LogWarning("dropping %d byte frame (too big to queue)", int(data.size()));
+		_stats.dropped++;
+		return;
+	}
+
+	// Wait for the shard to catch up rather than drop part of a stream (the
+	// kernel's capture buffer absorbs the delay)
+	if (!ring.Push(nanotime, linkType, data)) {
+		_stats.stalls++;
+		do {
+			shard.Notify();
+			std::this_thread::yield();
+		} while (!ring.Push(nanotime, linkType, data));
+	}
+	shard.Notify();
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "../PacketCapture.h"
+
+#include <cstdint>
+#include <memory>
+#include "../range.h"
+#include <vector>
+
+namespace tcp {
+
+// Spreads reassembly and message framing over several threads for busy
+// capture hosts. The capture thread only decodes enough of each frame to find
+// its connection and copies it into the queue of that connection's shard
+// (both directions hash the same way). Each shard's thread owns its own
+// callback (normally a tcp::Parser), so they share no state.
+class ShardedParser : public PacketCapture::Callback
+{
+public:
+	struct Stats
+	{
+		Stats() : frames(0), stalls(0), dropped(0) { }
+
+		uint64_t frames;
+		uint64_t stalls;  // frames that had to wait for space in a shard's queue
+		uint64_t dropped; // frames that didn't decode or were too big to queue
+	};
+
+	// shardFactory is called once on each shard's thread. queueBytes is the
+	// size of each shard's frame queue.
+	ShardedParser(int shards, PacketCapture::Callback::Factory shardFactory, size_t queueBytes = 4 << 20);
+
+	// Waits for the shards to finish the queued frames and destroy their
+	// callbacks (so parsers drain their streams)
+	virtual ~ShardedParser();
+
+	virtual void operator()(int64_t nanotime, int linkType, std::range<const uint8_t*> data);
+
+	const Stats &GetStats() const { return _stats; }
+
+private:
+	class Shard;
+	std::vector<std::unique_ptr<Shard>> _shards;
+	Stats _stats;
+
+	ShardedParser(const ShardedParser &);
+	ShardedParser &operator=(const ShardedParser &);
+};
+
+} // namespace tcp
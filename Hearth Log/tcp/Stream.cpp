@@ -1,101 +1,218 @@
-// wx #includes must come first to prevent secure function warning from wxcrt.h
-#include <wx/log.h>
-
 #include "Stream.h"
+#include "../Log.h"
+
+#include <algorithm>
 
-const std::vector<const uint8_t> EMPTY_VECTOR;
+// Initial ring size once a stream first needs to buffer data
+const size_t MIN_WINDOW = 4096;
 
-tcp::Stream::Stream(Parser *parser, const EndpointPair &endpoints, Stream *other, int64_t nanotime, uint32_t seq)
+tcp::Stream::Stream(Parser *parser, const EndpointPair &endpoints, Stream *other, int64_t nanotime, uint32_t seq, bool midStream)
 	: _parser(parser),
 	  _endpoints(endpoints),
 	  _other(other),
 	  _firstSeq(seq),
+	  _midStream(midStream),
 	  _nextSeq(seq + 1),
-	  _cache(),
+	  _window(),
+	  _head(0),
+	  _ranges(),
+	  _finSeen(false),
+	  _finSeq(0),
 	  _callback(parser->Factory()(nanotime, this))
 {
 	// Link other stream
 	if (_other) {
-		wxCHECK2(!_other->_other, return);
+		CHECK2(!_other->_other, return);
 
-		wxLogVerbose("pairing %s with %s", _endpoints.SrcToDst(), _other->_endpoints.SrcToDst());
+		LogVerbose("pairing %s with %s", _endpoints.SrcToDst().c_str(), _other->_endpoints.SrcToDst().c_str());
 		_other->_other = this;
 	}
 }
 
 tcp::Stream::~Stream()
 {
+	ReleaseWindow();
+
 	if (_other) {
 		_other->_other = nullptr;
 		_other = nullptr;
 	}
 }
 
+size_t tcp::Stream::BufferedBytes() const
+{
+	size_t total = 0;
+	for (auto &r : _ranges) {
+		total += r.second - r.first;
+	}
+	return total;
+}
+
 void tcp::Stream::Add(int64_t nanotime, uint32_t seq, std::range<const uint8_t *> data)
 {
-	wxCHECK2(data.size() > 0, return);
+	CHECK2(data.size() > 0, return);
 
 	auto offset = int32_t(seq - _nextSeq);
 	if (offset < 0) {
-		// Duplicate packet that's already been processed (ignore)
-		wxLogVerbose("%s dropping duplicate segment: seq=%d, next=%d, size=%d", _endpoints.SrcToDst(), seq, _nextSeq, data.size());
+		if (-offset >= data.size()) {
+			// Duplicate packet that's already been processed (ignore)
+			LogVerbose("%s dropping duplicate segment: seq=%u, next=%u, size=%d", _endpoints.SrcToDst().c_str(), seq, _nextSeq, int(data.size()));
+			return;
+		}
+
+		// Retransmission overlapping data that's already been passed along, so
+		// trim off the old part and treat the rest as the next in-order data.
+		LogVerbose("%s trimming overlapping segment: seq=%u, next=%u, size=%d", _endpoints.SrcToDst().c_str(), seq, _nextSeq, int(data.size()));
+		data.pop_front(-offset);
+		seq = _nextSeq;
+		offset = 0;
+	}
+
+	if (offset > 0) {
+		// Data out of order so save it for later
+		Store(seq, data);
 		return;
 	}
 
-	if (seq == _nextSeq) {
-		(*_callback)(nanotime, data);
-		_nextSeq += data.size();
+	// In order, so pass it straight along without buffering
+	(*_callback)(nanotime, data);
+	Advance(uint32_t(data.size()));
 
-		// Check cache for additional data
-		while (1) {
-			auto it = _cache.find(_nextSeq);
-			if (it == _cache.end()) {
-				return; // wait for more frames
-			}
+	// Check the window for data that is now contiguous
+	Deliver(nanotime); // NB: this may be invalid after this returns (if a buffered FIN was reached)
+}
+
+bool tcp::Stream::Store(uint32_t seq, std::range<const uint8_t *> data)
+{
+	auto begin = Offset(seq);
+	auto end = begin + uint32_t(data.size());
 
-			if (it->second.size() <= 0) {
-				Close(nanotime, _nextSeq);
-				return;
-			}
+	if (end > _parser->MaxStreamBuffer()) {
+		LogWarning("%s dropping segment beyond reassembly window: seq=%u, next=%u, size=%d", _endpoints.SrcToDst().c_str(), seq, _nextSeq, int(data.size()));
+		return false;
+	}
 
-			auto &v = it->second;
-			(*_callback)(nanotime, std::make_range(v.data(), v.data() + v.size()));
-			_nextSeq += it->second.size();
+	// Grow the ring if needed, unwrapping the current contents so the head is at 0
+	if (end > _window.size()) {
+		auto size = std::max(_window.size(), MIN_WINDOW);
+		while (size < end) {
+			size *= 2;
+		}
 
-			_cache.erase(it);
+		std::vector<uint8_t> window(size);
+		if (!_window.empty()) {
+			std::copy(_window.begin() + _head, _window.end(), window.begin());
+			std::copy(_window.begin(), _window.begin() + _head, window.begin() + (_window.size() - _head));
 		}
+		_parser->UpdateBuffered(ptrdiff_t(window.size()) - ptrdiff_t(_window.size()));
+		_window.swap(window);
+		_head = 0;
 	}
 
-	auto current = _cache.find(seq);
-	if (current != _cache.end()) {
-		// There's already data stored there (duplicate packet?)
-		wxLogVerbose("%s dropping duplicate segment: seq=%d, size=%d)", _endpoints.SrcToDst(), seq, current->second.size());
-		if (current->second.size() != data.size()) {
-			wxLogWarning("%s duplicate frames not the same size: seq=%d (%d vs %d)", _endpoints.SrcToDst(), seq, current->second.size(), data.size());
+	// Copy the data in, wrapping around the end of the ring if needed
+	auto mask = _window.size() - 1;
+	auto pos = (_head + begin) & mask;
+	auto first = std::min(size_t(data.size()), _window.size() - pos);
+	std::copy(data.begin(), data.begin() + first, _window.begin() + pos);
+	std::copy(data.begin() + first, data.end(), _window.begin());
+
+	// Insert the new range, merging with any it overlaps or touches
+	auto it = _ranges.begin();
+	while (it != _ranges.end() && Offset(it->second) < begin) {
+		++it;
+	}
+	auto merged = std::make_pair(seq, seq + uint32_t(data.size()));
+	auto last = it;
+	while (last != _ranges.end() && Offset(last->first) <= end) {
+		if (Offset(last->first) < Offset(merged.first)) {
+			merged.first = last->first;
 		}
-		// TODO: could verify that the data is the same as well
-		return;
+		if (Offset(last->second) > Offset(merged.second)) {
+			merged.second = last->second;
+		}
+		++last;
 	}
+	it = _ranges.erase(it, last);
+	_ranges.insert(it, merged);
 
-	// Data out of order so save it for later
-	_cache.emplace(seq, std::vector<const uint8_t>(data.begin(), data.end()));
+	return true;
+}
+
+void tcp::Stream::Advance(uint32_t size)
+{
+	_nextSeq += size;
+	if (!_window.empty()) {
+		_head = (_head + size) & (_window.size() - 1);
+	}
+
+	// Forget buffered bytes that are now behind the next sequence number
+	while (!_ranges.empty() && int32_t(_ranges.front().second - _nextSeq) <= 0) {
+		_ranges.erase(_ranges.begin());
+	}
+	if (!_ranges.empty() && int32_t(_ranges.front().first - _nextSeq) < 0) {
+		_ranges.front().first = _nextSeq;
+	}
+}
+
+bool tcp::Stream::Deliver(int64_t nanotime)
+{
+	while (!_ranges.empty() && _ranges.front().first == _nextSeq) {
+		// Pass along the contiguous span (in two parts if it wraps around the ring)
+		auto size = _ranges.front().second - _ranges.front().first;
+		auto first = std::min(size_t(size), _window.size() - _head);
+
+		auto data = _window.data() + _head;
+		(*_callback)(nanotime, std::make_range<const uint8_t *>(data, data + first));
+		if (first < size) {
+			data = _window.data();
+			(*_callback)(nanotime, std::make_range<const uint8_t *>(data, data + (size - first)));
+		}
+
+		Advance(size);
+	}
+
+	// Release the window as soon as there is nothing left waiting in it
+	if (_ranges.empty()) {
+		ReleaseWindow();
+	}
+
+	if (_finSeen && _finSeq == _nextSeq) {
+		Close(nanotime, _nextSeq);
+		return false;
+	}
+	return true;
+}
+
+void tcp::Stream::ReleaseWindow()
+{
+	if (!_window.empty()) {
+		_parser->UpdateBuffered(-ptrdiff_t(_window.size()));
+		std::vector<uint8_t>().swap(_window);
+		_head = 0;
+	}
 }
 
 void tcp::Stream::Close(int64_t nanotime, uint32_t seq)
 {
-	if (seq != _nextSeq) {
+	if (int32_t(seq - _nextSeq) < 0) {
+		// Retransmitted (or late) FIN for data that's already been passed
+		// along, so there's nothing left to wait for
+		LogVerbose("%s late FIN: seq=%u, next=%u", _endpoints.SrcToDst().c_str(), seq, _nextSeq);
+	} else if (seq != _nextSeq) {
 		// Mark the end of the stream, but wait for missing data
-		auto r = _cache.emplace(seq, EMPTY_VECTOR);
-		if (!r.second) {
-			// Already a frame in the cache there...
-			if (r.first->second.empty()) {
-				wxLogVerbose("%d duplicate FIN: seq=%d", _endpoints.SrcToDst(), seq);
-				return; // just ignore it
-			} else {
-				wxLogError("%s FIN seq matches existing data: seq=%d, size=%d", _endpoints.SrcToDst(), seq, r.first->second.size());
-				// Shouldn't happen, so go ahead and close the stream anyway (below)
-			}
+		if (_finSeen && _finSeq == seq) {
+			LogVerbose("%s duplicate FIN: seq=%u", _endpoints.SrcToDst().c_str(), seq);
+			return; // just ignore it
 		}
+
+		if (_ranges.empty() || int32_t(_ranges.back().second - seq) <= 0) {
+			_finSeen = true;
+			_finSeq = seq;
+			return;
+		}
+
+		// Shouldn't happen, so go ahead and close the stream anyway (below)
+		LogError("%s FIN seq before buffered data: seq=%u, end=%u", _endpoints.SrcToDst().c_str(), seq, _ranges.back().second);
 	}
 
 	// Close right now
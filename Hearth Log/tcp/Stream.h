@@ -5,10 +5,11 @@
 
 #include <cstdint>
 #include "../range.h"
-#include <map>
 #include <memory>
 #include <ostream>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace tcp {
 
@@ -17,9 +18,10 @@ class Parser;
 class Stream
 {
 public:
-	Stream(Parser *parser, const EndpointPair &endpoints, Stream *other, int64_t nanotime, uint32_t seq);
+	Stream(Parser *parser, const EndpointPair &endpoints, Stream *other, int64_t nanotime, uint32_t seq, bool midStream = false);
 	~Stream();
 
+	FlowKey Key() const { return _endpoints.Key(); }
 	const EndpointPair &Endpoints() const { return _endpoints; }
 
 	const Endpoint &Src() const { return _endpoints.Src(); }
@@ -27,6 +29,18 @@ public:
 
 	uint32_t FirstSeq() const { return _firstSeq; }
 
+	// True if the SYN wasn't seen, so data starts at an arbitrary point in the stream
+	bool IsMidStream() const { return _midStream; }
+
+	// True while the parser is closing every stream because capture is stopping
+	bool IsDraining() const { return _parser->Draining(); }
+
+	// Bytes of out-of-order data currently held for reassembly
+	size_t BufferedBytes() const;
+
+	// Memory allocated for the reassembly window (what the parser's budget counts)
+	size_t WindowBytes() const { return _window.size(); }
+
 	void Add(int64_t nanotime, uint32_t seq, std::range<const uint8_t *> data);
 	void Close(int64_t nanotime, uint32_t seq);
 
@@ -38,8 +52,29 @@ private:
 	const EndpointPair _endpoints;
 	Stream *_other;
 	const uint32_t _firstSeq;
+	const bool _midStream;
 	uint32_t _nextSeq;
-	std::map<uint32_t, const std::vector<const uint8_t>> _cache;
+
+	// Out-of-order data waiting for a hole to be filled. The window is a ring
+	// where _window[(_head + i) & mask] holds the byte at _nextSeq + i, and
+	// _ranges lists the [begin, end) sequence ranges actually present (sorted,
+	// never overlapping or adjacent). The window is sized on demand up to the
+	// parser's MaxStreamBuffer().
+	std::vector<uint8_t> _window;
+	size_t _head;
+	std::vector<std::pair<uint32_t, uint32_t>> _ranges;
+
+	// Sequence number of a FIN that arrived ahead of missing data
+	bool _finSeen;
+	uint32_t _finSeq;
+
+	uint32_t Offset(uint32_t seq) const { return seq - _nextSeq; }
+
+	void ReleaseWindow();
+
+	bool Store(uint32_t seq, std::range<const uint8_t *> data);
+	void Advance(uint32_t size);
+	bool Deliver(int64_t nanotime);
 
 	// This should come last so its constructor is called last and destructor is called first
 	const Parser::Callback::Ptr _callback;
@@ -32,10 +32,12 @@
  * SUCH DAMAGE.
  */
 
-#include <pcap.h>
-
-
-#ifdef MAC_OS_X_VERSION_MIN_REQUIRED
+#ifdef _WIN32
+#include <pcap.h> // (WinPcap's headers define the u_int types and include winsock)
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #endif
 
@@ -207,11 +209,75 @@ struct	ip_timestamp {
 /* in print-ip.c */
 extern u_int32_t ip_finddst(const struct ip *);
 
+/*************************************************************************************************/
+/* @(#) $Header: /tcpdump/master/tcpdump/ip6.h,v 1.8 2007/08/29 02:31:44 mcr Exp $ (LBL)          */
 /*************************************************************************************************/
 
+/*
+ * Definition for internet protocol version 6.
+ * RFC 2460
+ */
+struct ip6_hdr {
+	union {
+		struct ip6_hdrctl {
+			u_int32_t ip6_un1_flow;	/* 20 bits of flow-ID */
+			u_int16_t ip6_un1_plen;	/* payload length */
+			u_int8_t  ip6_un1_nxt;	/* next header */
+			u_int8_t  ip6_un1_hlim;	/* hop limit */
+		} ip6_un1;
+		u_int8_t ip6_un2_vfc;	/* 4 bits version, top 4 bits class */
+	} ip6_ctlun;
+	u_int8_t ip6_src[16];	/* source address */
+	u_int8_t ip6_dst[16];	/* destination address */
+};
 
+#define ip6_vfc		ip6_ctlun.ip6_un2_vfc
+#define ip6_flow	ip6_ctlun.ip6_un1.ip6_un1_flow
+#define ip6_plen	ip6_ctlun.ip6_un1.ip6_un1_plen
+#define ip6_nxt		ip6_ctlun.ip6_un1.ip6_un1_nxt
+#define ip6_hlim	ip6_ctlun.ip6_un1.ip6_un1_hlim
+#define ip6_hops	ip6_ctlun.ip6_un1.ip6_un1_hlim
+
+#define IP6_HDRLEN	40
+
+/*
+ * Extension Headers
+ */
+struct	ip6_ext {
+	u_int8_t ip6e_nxt;
+	u_int8_t ip6e_len;
+};
 
+/* Fragment header */
+struct ip6_frag {
+	u_int8_t  ip6f_nxt;		/* next header */
+	u_int8_t  ip6f_reserved;	/* reserved field */
+	u_int16_t ip6f_offlg;		/* offset, reserved, and flag */
+	u_int32_t ip6f_ident;		/* identification */
+};
+
+#define IP6F_OFF_MASK		0xfff8	/* mask out offset from ip6f_offlg */
+#define IP6F_MORE_FRAG		0x0001	/* more-fragments flag */
+
+/*************************************************************************************************/
+
+
+
+#ifndef IPPROTO_HOPOPTS
+#define IPPROTO_HOPOPTS         0               /* IPv6 hop-by-hop options */
+#define IPPROTO_ROUTING         43              /* IPv6 routing header */
+#define IPPROTO_FRAGMENT        44              /* IPv6 fragmentation header */
+#define IPPROTO_ESP             50              /* encapsulating security payload */
+#define IPPROTO_AH              51              /* authentication header */
+#define IPPROTO_NONE            59              /* IPv6 no next header */
+#define IPPROTO_DSTOPTS         60              /* IPv6 destination options */
+#endif
+#ifndef IPPROTO_MH
+#define IPPROTO_MH              135             /* IPv6 mobility header */
+#endif
+#ifndef IPPROTO_TCP
 #define IPPROTO_TCP             6               /* tcp */
+#endif
 
 
 
@@ -0,0 +1,328 @@
+// Captures games to .hsl files without the app, for running on a server.
+//
+// hearthlogd [-i device] [-f filter] [-s snaplen] [-B KB] [-t ms] [-n] [-R threads] [-d dir] [-c codec] [-l level] [-I] [-w threads] [-p threads] [-m] [-k key [-H host[:port]] [-u threads] [-b games]] [-S] [-v]
+// hearthlogd -r [-j jobs] [options] file-or-dir...
+//
+// Games are saved under dir/Logged/ (dir/Pending/ while they're in progress).
+// Stops cleanly (saving games in progress) on SIGINT or SIGTERM. With an
+// upload key games are uploaded as they're saved (and moved to dir/Uploaded/).
+//
+// With -r it extracts the games from capture files (pcap or pcapng, or every
+// one in a directory) instead, reading several files at once, and exits when
+// they're all saved.
+
+#include "File.h"
+#include "GameLogger.h"
+#include "Log.h"
+#include "LogWriter.h"
+#include "PacketCapture.h"
+#include "Uploader.h"
+#include "WriterPool.h"
+#include "tcp/Parser.h"
+#include "tcp/ShardedParser.h"
+#include "util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <syslog.h>
+
+// How long to wait for capture to stop and in-progress games to be saved
+const int SHUTDOWN_TIMEOUT_MS = 5000;
+
+// Game data waiting to be compressed before capture threads have to wait for it
+const size_t MAX_QUEUED_BYTES = 32 << 20;
+
+// How long -r keeps retrying uploads before leaving them for next time
+const int UPLOAD_GIVE_UP_SECONDS = 60;
+
+bool resyncMidStream = false;
+int parserThreads = 1;
+
+std::atomic<int> gamesSaved(0);
+
+// Saved games are uploaded too
+bool uploading = false;
+
+void usage()
+{
+	fprintf(stderr,
+		"usage: hearthlogd [options]\n"
+		"  -i DEVICE  capture from this device (default: every device)\n"
+		"  -f FILTER  pcap filter (default: tcp port 3724 or tcp port 1119)\n"
+		"  -s BYTES   snaplen, bytes kept of each frame (default: 65535)\n"
+		"  -B KB      kernel capture buffer (default: libpcap's)\n"
+		"  -t MS      read timeout, how long the kernel may hold packets (default: 1000)\n"
+		"  -n         immediate mode, deliver each packet as it arrives\n"
+		"  -R COUNT   Linux: capture from AF_PACKET rings on this many threads\n"
+		"  -d DIR     where to save games (default: .)\n"
+		"  -c CODEC   deflate, zstd or lz4 (default: deflate)\n"
+		"  -l LEVEL   compression level (default: the codec's)\n"
+		"  -I         write indexed files\n"
+		"  -w COUNT   game writer threads (default: 2)\n"
+		"  -p COUNT   threads to parse each device's packets on (default: 1)\n"
+		"  -m         pick up games already in progress\n"
+		"  -k KEY     upload games with this key\n"
+		"  -H HOST    server to upload to, as host or host:port (default: www.hearthlog.com)\n"
+		"  -u COUNT   upload threads (default: 2)\n"
+		"  -b COUNT   most games uploaded in one request (default: 32)\n"
+		"  -S         log to syslog instead of stderr\n"
+		"  -v         verbose logging\n"
+		"  -r         read games from the capture files (or directories) given\n"
+		"  -j COUNT   capture files read at once with -r (default: one per core)\n");
+}
+
+void logToSyslog(LogLevel level, const char *message)
+{
+	static const int PRIORITIES[] = { LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+	syslog(PRIORITIES[level], "%s", message);
+}
+
+void gameSaved(const std::string &filename)
+{
+	gamesSaved++;
+	LogMessage("saved %s", filename.c_str());
+	if (uploading) {
+		Uploader::Add(filename);
+	}
+}
+
+PacketCapture::Callback::Ptr newParser()
+{
+	auto parser = std::make_unique<tcp::Parser>(
+		[](int64_t nanotime, tcp::Stream *stream) -> tcp::Parser::Callback::Ptr {
+			return std::make_unique<GameLogger>(nanotime, stream, gameSaved);
+		});
+	parser->SetResync(resyncMidStream);
+	return parser;
+}
+
+// Parses on the capture thread, or spreads connections over parserThreads threads
+PacketCapture::Callback::Ptr newCaptureCallback()
+{
+	if (parserThreads > 1) {
+		return std::make_unique<tcp::ShardedParser>(parserThreads, newParser);
+	}
+	return newParser();
+}
+
+bool isCaptureFile(const std::string &name)
+{
+	static const char *const SUFFIXES[] = { ".pcap", ".pcapng", ".cap" };
+	for (auto suffix : SUFFIXES) {
+		auto n = strlen(suffix);
+		if (name.size() > n && name.compare(name.size() - n, n, suffix) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Expands directories into the capture files in them
+std::vector<std::string> captureFiles(const std::vector<std::string> &paths)
+{
+	std::vector<std::string> files;
+	for (auto &path : paths) {
+		if (!file::DirExists(path)) {
+			files.push_back(path);
+			continue;
+		}
+
+		auto names = file::List(path, "");
+		std::sort(names.begin(), names.end());
+		for (auto &name : names) {
+			if (isCaptureFile(name)) {
+				files.push_back(file::Join(path, name));
+			}
+		}
+	}
+	return files;
+}
+
+// Reads the files on a pool of threads, each with its own parser so they
+// don't share any state, returning the number that couldn't be read. A
+// file's games are saved once its parser is destroyed at the end of it.
+int readFiles(const std::string &filter, const std::vector<std::string> &files, int jobs)
+{
+	std::atomic<size_t> next(0);
+	std::atomic<int> failed(0);
+
+	std::vector<std::thread> workers;
+	for (auto i = 0; i < jobs; i++) {
+		workers.emplace_back([&]() {
+			size_t n;
+			while ((n = next++) < files.size()) {
+				LogVerbose("reading %s", files[n].c_str());
+				auto parser = newCaptureCallback();
+				if (!PacketCapture::ReadFile(filter, files[n], *parser)) {
+					failed++;
+				}
+			}
+		});
+	}
+
+	for (auto &worker : workers) {
+		worker.join();
+	}
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	std::string device;
+	std::string filter = "tcp port 3724 or tcp port 1119";
+	PacketCapture::Options capture;
+	LogWriter::Settings settings;
+	settings.dataDir = ".";
+	Uploader::Settings upload;
+	auto threads = 2;
+	auto readMode = false;
+	auto jobs = int(std::thread::hardware_concurrency());
+	std::vector<std::string> paths;
+
+	for (auto i = 1; i < argc; i++) {
+		std::string arg(argv[i]);
+		auto hasValue = i + 1 < argc;
+		if (arg == "-i" && hasValue) {
+			device = argv[++i];
+		} else if (arg == "-f" && hasValue) {
+			filter = argv[++i];
+		} else if (arg == "-s" && hasValue) {
+			capture.snaplen = atoi(argv[++i]);
+		} else if (arg == "-B" && hasValue) {
+			capture.bufferSize = atoi(argv[++i]) * 1024;
+		} else if (arg == "-t" && hasValue) {
+			capture.timeoutMs = atoi(argv[++i]);
+		} else if (arg == "-n") {
+			capture.immediate = true;
+		} else if (arg == "-R" && hasValue) {
+			capture.ringThreads = atoi(argv[++i]);
+		} else if (arg == "-d" && hasValue) {
+			settings.dataDir = argv[++i];
+		} else if (arg == "-c" && hasValue) {
+			if (!hsl::ParseCodec(argv[++i], settings.codec)) {
+				fprintf(stderr, "unknown codec: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (arg == "-l" && hasValue) {
+			settings.level = atoi(argv[++i]);
+		} else if (arg == "-I") {
+			settings.indexed = true;
+		} else if (arg == "-w" && hasValue) {
+			threads = atoi(argv[++i]);
+		} else if (arg == "-p" && hasValue) {
+			parserThreads = atoi(argv[++i]);
+		} else if (arg == "-m") {
+			resyncMidStream = true;
+		} else if (arg == "-k" && hasValue) {
+			upload.key = argv[++i];
+		} else if (arg == "-H" && hasValue) {
+			std::string host(argv[++i]);
+			auto colon = host.rfind(':');
+			if (colon != std::string::npos) {
+				upload.port = atoi(host.c_str() + colon + 1);
+				host.erase(colon);
+			}
+			upload.host = host;
+		} else if (arg == "-u" && hasValue) {
+			upload.threads = atoi(argv[++i]);
+		} else if (arg == "-b" && hasValue) {
+			upload.batchGames = atoi(argv[++i]);
+		} else if (arg == "-S") {
+			openlog("hearthlogd", LOG_PID, LOG_DAEMON);
+			SetLogHandler(logToSyslog);
+		} else if (arg == "-v") {
+			SetLogVerbose(true);
+		} else if (arg == "-r") {
+			readMode = true;
+		} else if (arg == "-j" && hasValue) {
+			jobs = atoi(argv[++i]);
+		} else if (readMode && arg[0] != '-') {
+			paths.push_back(arg);
+		} else {
+			usage();
+			return 1;
+		}
+	}
+
+	upload.dataDir = settings.dataDir;
+	uploading = !upload.key.empty();
+
+	if (readMode) {
+		auto files = captureFiles(paths);
+		if (files.empty()) {
+			usage();
+			return 1;
+		}
+
+		LogWriter::Configure(settings);
+		WriterPool::Start(threads, MAX_QUEUED_BYTES);
+		if (uploading) {
+			Uploader::Start(upload);
+		}
+		auto failed = readFiles(filter, files, std::max(1, std::min(jobs, int(files.size()))));
+
+		// Wait for every game to be saved
+		WriterPool::Stop(INT_MAX);
+		LogMessage("read %d files (%d failed), saved %d games", int(files.size()), failed, int(gamesSaved));
+		if (uploading) {
+			if (!Uploader::Drain(UPLOAD_GIVE_UP_SECONDS)) {
+				LogWarning("couldn't upload every game, the rest are left in Logged/");
+			}
+			Uploader::Stop(SHUTDOWN_TIMEOUT_MS);
+		}
+		return failed ? 1 : 0;
+	}
+
+	// Handle the stop signals on this thread (the capture and writer
+	// threads inherit the mask, so they never see them)
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	// Games cut short last time are saved first
+	LogWriter::Configure(settings);
+	LogWriter::RecoverPending();
+	WriterPool::Start(threads, MAX_QUEUED_BYTES);
+	if (uploading) {
+		Uploader::Start(upload);
+		Uploader::AddPending();
+	}
+
+	PacketCapture::Configure(capture);
+	if (device.empty()) {
+		PacketCapture::Start(filter, newCaptureCallback);
+	} else {
+		LogMessage("listening to %s", device.c_str());
+		PacketCapture::StartDevice(filter, device, newCaptureCallback);
+	}
+
+	int signal;
+	sigwait(&signals, &signal);
+	LogMessage("stopping capture (signal %d)", signal);
+
+	auto ok = true;
+	if (!PacketCapture::Stop(SHUTDOWN_TIMEOUT_MS)) {
+		LogWarning("capture didn't stop cleanly, games in progress may be lost");
+		ok = false;
+	}
+	if (!WriterPool::Stop(SHUTDOWN_TIMEOUT_MS)) {
+		LogWarning("games still being saved will be recovered on the next start");
+		ok = false;
+	}
+	if (uploading && !Uploader::Stop(SHUTDOWN_TIMEOUT_MS)) {
+		LogWarning("games still being uploaded will be uploaded on the next start");
+		ok = false;
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+// Dumps the records of .hsl files, or reports how many bytes each message type uses.
+//
+// hsldump [-t type,...] [-x] [-s] [-D dictionary] file.hsl...
+
+#include "../Hearth Log/hsl/Reader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+struct TypeStats
+{
+	TypeStats() : count(0), bytes(0), largest(0) { }
+
+	uint64_t count;
+	uint64_t bytes;
+	uint32_t largest;
+};
+
+void usage()
+{
+	fprintf(stderr,
+		"usage: hsldump [options] file.hsl...\n"
+		"  -t TYPE[,TYPE...]  only records of these message types\n"
+		"  -x                 include a hex dump of each payload\n"
+		"  -s                 print per-type statistics instead of the records\n"
+		"  -D FILE            zstd dictionary the files were compressed with\n");
+}
+
+bool parseTypes(const char *arg, std::vector<uint32_t> &types)
+{
+	while (*arg) {
+		char *end;
+		errno = 0;
+		auto type = strtoul(arg, &end, 0);
+		if (end == arg || (*end && *end != ',') || *arg == '-' || errno == ERANGE || type > UINT32_MAX) {
+			return false;
+		}
+		types.push_back(uint32_t(type));
+		arg = *end ? end + 1 : end;
+	}
+	return !types.empty();
+}
+
+bool readFile(const char *name, std::vector<uint8_t> &data)
+{
+	std::ifstream in(name, std::ios::binary);
+	if (!in) {
+		return false;
+	}
+	data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	return true;
+}
+
+void dump(const std::string &name, const hsl::Record &record, bool hex)
+{
+	printf("%s\t%lld\t%u\t%u\n", name.c_str(), static_cast<long long>(record.nanotime), record.type, record.size);
+	if (!hex) {
+		return;
+	}
+
+	static const char digits[] = "0123456789abcdef";
+	char line[3 * 32 + 2];
+	for (auto p = record.payload.begin(); p < record.payload.end(); p += 32) {
+		auto n = std::min<ptrdiff_t>(32, record.payload.end() - p);
+		auto out = line;
+		*out++ = '\t';
+		for (auto i = 0; i < n; i++) {
+			*out++ = digits[p[i] >> 4];
+			*out++ = digits[p[i] & 15];
+			*out++ = ' ';
+		}
+		out[-1] = '\n';
+		fwrite(line, 1, out - line, stdout);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<uint32_t> types;
+	std::vector<uint8_t> dictionary;
+	auto hex = false;
+	auto stats = false;
+
+	auto i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		std::string arg(argv[i]);
+		if (arg == "-t" && i + 1 < argc) {
+			if (!parseTypes(argv[++i], types)) {
+				fprintf(stderr, "bad message types: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (arg == "-D" && i + 1 < argc) {
+			if (!readFile(argv[++i], dictionary)) {
+				fprintf(stderr, "couldn't read dictionary: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (arg == "-x") {
+			hex = true;
+		} else if (arg == "-s") {
+			stats = true;
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if (i == argc) {
+		usage();
+		return 1;
+	}
+
+	// Output can be large, so buffer it generously
+	static char outBuffer[1 << 16];
+	setvbuf(stdout, outBuffer, _IOFBF, sizeof(outBuffer));
+
+	std::map<uint32_t, TypeStats> byType;
+	auto failed = false;
+	for (; i < argc; i++) {
+		std::string name(argv[i]);
+		hsl::Reader reader;
+		if (!reader.Open(name, dictionary.empty() ? nullptr : &dictionary)) {
+			fprintf(stderr, "%s: %s\n", name.c_str(), reader.Error().c_str());
+			failed = true;
+			continue;
+		}
+		reader.SetTypes(types);
+
+		for (auto &record : reader) {
+			if (stats) {
+				auto &s = byType[record.type];
+				s.count++;
+				s.bytes += record.size;
+				s.largest = std::max(s.largest, record.size);
+			} else {
+				dump(name, record, hex);
+			}
+		}
+
+		if (!reader.Error().empty()) {
+			fprintf(stderr, "%s: %s\n", name.c_str(), reader.Error().c_str());
+			failed = true;
+		}
+	}
+
+	if (stats) {
+		uint64_t count = 0, bytes = 0;
+		for (auto &entry : byType) {
+			count += entry.second.count;
+			bytes += entry.second.bytes;
+		}
+
+		// Biggest first
+		std::vector<std::pair<uint32_t, TypeStats>> sorted(byType.begin(), byType.end());
+		std::sort(sorted.begin(), sorted.end(), [](const std::pair<uint32_t, TypeStats> &a, const std::pair<uint32_t, TypeStats> &b) {
+			return a.second.bytes > b.second.bytes;
+		});
+
+		printf("type\tcount\tbytes\t%%bytes\tavg\tmax\n");
+		for (auto &entry : sorted) {
+			auto &s = entry.second;
+			printf("%u\t%llu\t%llu\t%.1f\t%.1f\t%u\n", entry.first,
+				static_cast<unsigned long long>(s.count), static_cast<unsigned long long>(s.bytes),
+				bytes ? 100.0 * s.bytes / bytes : 0.0, double(s.bytes) / s.count, s.largest);
+		}
+		printf("total\t%llu\t%llu\n", static_cast<unsigned long long>(count), static_cast<unsigned long long>(bytes));
+	}
+
+	fflush(stdout);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,174 @@
+// tcp::FlowKey and tcp::FlowTable, including probe sequences that wrap
+// around the end of the table and backward-shift deletion
+
+#include "Test.h"
+#include "tcp/FlowTable.h"
+
+#include <map>
+
+namespace {
+
+tcp::FlowKey key(uint32_t n, uint16_t port = 3724)
+{
+	uint8_t src[4] = { 10, uint8_t(n >> 16), uint8_t(n >> 8), uint8_t(n) };
+	uint8_t dst[4] = { 12, 130, 244, 193 };
+	return tcp::FlowKey(tcp::FlowKey::IPv4, src, dst, uint16_t(40000 + n % 1000), port);
+}
+
+void testFlowKey()
+{
+	auto k = key(1);
+	EXPECT(k == key(1));
+	EXPECT(k != key(2));
+	EXPECT(k.Reverse() != k);
+	EXPECT(k.Reverse().Reverse() == k);
+	EXPECT_EQ(k.Reverse().srcPort, k.dstPort);
+	EXPECT_EQ(k.Hash(), key(1).Hash());
+	EXPECT(k.Hash() != k.Reverse().Hash());
+	EXPECT_EQ(k.ConnectionHash(), k.Reverse().ConnectionHash());
+
+	// IPv4 keys only use 4 bytes of each address, the rest stays zero
+	uint8_t padded[16] = { 10, 0, 0, 1, 0xff, 0xff };
+	uint8_t dst[4] = { 12, 130, 244, 193 };
+	EXPECT(tcp::FlowKey(tcp::FlowKey::IPv4, padded, dst, 1, 2) == tcp::FlowKey(tcp::FlowKey::IPv4, padded, dst, 1, 2));
+	EXPECT_EQ(tcp::FlowKey(tcp::FlowKey::IPv4, padded, dst, 1, 2).src[4], 0);
+}
+
+void testInsertFindErase()
+{
+	tcp::FlowTable<int> table;
+	EXPECT(table.Empty());
+	EXPECT(table.Find(key(0)) == nullptr);
+	EXPECT(!table.Erase(key(0)));
+
+	// Enough to rehash several times
+	const uint32_t COUNT = 1000;
+	for (auto i = 0u; i < COUNT; i++) {
+		auto inserted = table.Insert(key(i));
+		EXPECT(inserted.second);
+		*inserted.first = int(i);
+	}
+	EXPECT_EQ(table.Size(), COUNT);
+
+	// Inserting again finds the existing value
+	auto again = table.Insert(key(7));
+	EXPECT(!again.second);
+	EXPECT_EQ(*again.first, 7);
+
+	for (auto i = 0u; i < COUNT; i++) {
+		auto value = table.Find(key(i));
+		EXPECT(value != nullptr && *value == int(i));
+	}
+	EXPECT(table.Find(key(COUNT)) == nullptr);
+
+	// Erase the odd ones, the rest must still be found after the shifting
+	for (auto i = 1u; i < COUNT; i += 2) {
+		EXPECT(table.Erase(key(i)));
+	}
+	EXPECT_EQ(table.Size(), COUNT / 2);
+	for (auto i = 0u; i < COUNT; i++) {
+		auto value = table.Find(key(i));
+		if (i % 2) {
+			EXPECT(value == nullptr);
+		} else {
+			EXPECT(value != nullptr && *value == int(i));
+		}
+	}
+
+	auto erased = table.EraseIf([](const tcp::FlowKey &, int value) { return value % 4 == 0; });
+	EXPECT_EQ(erased, COUNT / 4);
+	EXPECT_EQ(table.Size(), COUNT / 4);
+
+	size_t visited = 0;
+	table.ForEach([&](const tcp::FlowKey &k, int value) {
+		EXPECT(value % 4 == 2);
+		EXPECT(k == key(uint32_t(value)));
+		visited++;
+	});
+	EXPECT_EQ(visited, table.Size());
+
+	table.Clear();
+	EXPECT(table.Empty());
+	EXPECT(table.Find(key(2)) == nullptr);
+}
+
+void testWraparound()
+{
+	// The first table has 16 slots, so keys whose hash lands in the last slot
+	// probe past the end into slot 0 and onward
+	const size_t SLOTS = 16;
+	std::vector<tcp::FlowKey> last, first;
+	for (auto n = 0u; last.size() < 3 || first.size() < 2; n++) {
+		auto k = key(n, 1119);
+		auto home = size_t(k.Hash()) & (SLOTS - 1);
+		if (home == SLOTS - 1 && last.size() < 3) {
+			last.push_back(k);
+		} else if (home == 0 && first.size() < 2) {
+			first.push_back(k);
+		}
+	}
+
+	tcp::FlowTable<int> table;
+	auto n = 0;
+	for (auto &k : last) {
+		*table.Insert(k).first = n++;
+	}
+	for (auto &k : first) {
+		*table.Insert(k).first = n++;
+	}
+	EXPECT_EQ(table.Size(), 5u);
+
+	// Slots 15, 0, 1 hold the wrapped keys and 2, 3 the ones homed at 0. Erasing
+	// from the front of the run shifts everything back across the end.
+	EXPECT(table.Erase(last[0]));
+	EXPECT(table.Find(last[0]) == nullptr);
+	EXPECT(table.Find(last[1]) != nullptr && *table.Find(last[1]) == 1);
+	EXPECT(table.Find(last[2]) != nullptr && *table.Find(last[2]) == 2);
+	EXPECT(table.Find(first[0]) != nullptr && *table.Find(first[0]) == 3);
+	EXPECT(table.Find(first[1]) != nullptr && *table.Find(first[1]) == 4);
+
+	EXPECT(table.Erase(first[0]));
+	EXPECT(table.Find(last[1]) != nullptr && *table.Find(last[1]) == 1);
+	EXPECT(table.Find(last[2]) != nullptr && *table.Find(last[2]) == 2);
+	EXPECT(table.Find(first[1]) != nullptr && *table.Find(first[1]) == 4);
+	EXPECT_EQ(table.Size(), 3u);
+}
+
+void testRandomized()
+{
+	// Compare against std::map over a long run of random operations
+	tcp::FlowTable<int> table;
+	std::map<uint32_t, int> expected;
+	uint32_t state = 12345;
+	for (auto i = 0; i < 200000; i++) {
+		state = state * 1103515245 + 12345;
+		auto n = (state >> 8) % 512;
+		if ((state >> 4) % 3 == 0) {
+			EXPECT_EQ(table.Erase(key(n)), expected.erase(n) == 1);
+		} else {
+			*table.Insert(key(n)).first = i;
+			expected[n] = i;
+		}
+	}
+
+	EXPECT_EQ(table.Size(), expected.size());
+	for (auto n = 0u; n < 512; n++) {
+		auto value = table.Find(key(n));
+		auto it = expected.find(n);
+		EXPECT((value == nullptr) == (it == expected.end()));
+		if (value && it != expected.end()) {
+			EXPECT_EQ(*value, it->second);
+		}
+	}
+}
+
+} // namespace
+
+int main()
+{
+	testFlowKey();
+	testInsertFindErase();
+	testWraparound();
+	testRandomized();
+	return TEST_RESULT();
+}
@@ -0,0 +1,192 @@
+// tcp::FrameRing: frames wrapping around the end of the buffer from every
+// starting offset, refusing frames that don't fit, MaxFrame-sized frames and
+// a producer and consumer on two threads.
+
+#include "Test.h"
+#include "tcp/FrameRing.h"
+
+#include <algorithm>
+#include <thread>
+
+using namespace test;
+
+namespace {
+
+const size_t CAPACITY = 1024; // the smallest ring
+const size_t RECORD_ALIGN = 16;
+
+// Frame number n: its length, link type and contents all follow from n
+std::vector<uint8_t> frameData(uint32_t n, size_t length)
+{
+	std::vector<uint8_t> data(length);
+	for (size_t i = 0; i < length; i++) {
+		data[i] = uint8_t(n * 31 + i);
+	}
+	return data;
+}
+
+bool push(tcp::FrameRing &ring, uint32_t n, size_t length)
+{
+	auto data = frameData(n, length);
+	return ring.Push(int64_t(n) * 1000, int(n % 7), std::make_range<const uint8_t *>(data.data(), data.data() + data.size()));
+}
+
+// Checks each drained frame is the next one expected
+class Checker : public PacketCapture::Callback
+{
+public:
+	Checker() : next(0), lengths(), failed(false) { }
+
+	virtual void operator()(int64_t nanotime, int linkType, std::range<const uint8_t *> data)
+	{
+		auto expected = frameData(next, next < lengths.size() ? lengths[next] : 0);
+		auto ok = next < lengths.size() && nanotime == int64_t(next) * 1000 && linkType == int(next % 7) &&
+			size_t(data.size()) == expected.size() && std::equal(data.begin(), data.end(), expected.begin());
+		if (!ok && !failed) {
+			EXPECT(ok);
+			fprintf(stderr, "frame %u: %d bytes\n", next, int(data.size()));
+			failed = true; // once is enough
+		}
+		next++;
+	}
+
+	uint32_t next;
+	std::vector<size_t> lengths; // of every frame pushed, in order
+	bool failed;
+};
+
+// Moves the ring's write position offset bytes on (in empty frames)
+void advance(tcp::FrameRing &ring, Checker &checker, size_t offset)
+{
+	for (size_t i = 0; i < offset / RECORD_ALIGN; i++) {
+		EXPECT(push(ring, checker.next + uint32_t(i), 0));
+		checker.lengths.push_back(0);
+	}
+	ring.Drain(checker);
+	EXPECT(ring.Empty());
+}
+
+void testWrapAtEveryOffset()
+{
+	size_t lengths[] = { 0, 1, 15, 16, 17, 100, 300, 480, 481, 495, 496 };
+	for (size_t offset = 0; offset < CAPACITY; offset += RECORD_ALIGN) {
+		for (auto length : lengths) {
+			tcp::FrameRing ring(CAPACITY);
+			Checker checker;
+			advance(ring, checker, offset);
+
+			// Two frames in a row, so one of them runs into the end of the buffer
+			for (auto i = 0; i < 2; i++) {
+				EXPECT(push(ring, uint32_t(checker.lengths.size()), length));
+				checker.lengths.push_back(length);
+				EXPECT_EQ(ring.Drain(checker), 1u);
+			}
+			EXPECT_EQ(checker.next, checker.lengths.size());
+			EXPECT(ring.Empty());
+		}
+	}
+}
+
+void testMaxFrame()
+{
+	tcp::FrameRing ring(CAPACITY);
+	EXPECT_EQ(ring.MaxFrame(), CAPACITY / 2 - RECORD_ALIGN);
+	EXPECT_EQ(tcp::FrameRing(CAPACITY + 1).MaxFrame(), CAPACITY - RECORD_ALIGN);
+
+	// An empty ring takes a MaxFrame frame wherever its write position is
+	Checker checker;
+	for (size_t offset = 0; offset < 2 * CAPACITY; offset += RECORD_ALIGN) {
+		EXPECT(push(ring, uint32_t(checker.lengths.size()), ring.MaxFrame()));
+		checker.lengths.push_back(ring.MaxFrame());
+		ring.Drain(checker);
+		advance(ring, checker, RECORD_ALIGN);
+	}
+	EXPECT_EQ(checker.next, checker.lengths.size());
+	EXPECT(!checker.failed);
+}
+
+void testFull()
+{
+	tcp::FrameRing ring(CAPACITY);
+	Checker checker;
+
+	// 100 bytes take 128 with the header, so 8 fit and the 9th doesn't
+	uint32_t n = 0;
+	while (push(ring, n, 100)) {
+		checker.lengths.push_back(100);
+		n++;
+	}
+	EXPECT_EQ(n, 8u);
+	EXPECT(!push(ring, n, 0));
+	EXPECT(!ring.Empty());
+
+	// Nothing refused was queued, and the space comes back once drained
+	EXPECT_EQ(ring.Drain(checker), 8u);
+	EXPECT(ring.Empty());
+	EXPECT(push(ring, n, 100));
+	checker.lengths.push_back(100);
+	n++;
+	ring.Drain(checker);
+
+	// 96 bytes are left before the end of the buffer and 496 free in all. A
+	// 480 byte record fits in the free space, but not with the 96 it has to
+	// skip to get to the start, so it waits until the ring is drained.
+	tcp::FrameRing ring2(CAPACITY);
+	Checker checker2;
+	advance(ring2, checker2, 400);
+	EXPECT(push(ring2, checker2.next, 496));
+	checker2.lengths.push_back(496);
+	EXPECT(push(ring2, checker2.next + 1, 0));
+	checker2.lengths.push_back(0);
+	EXPECT(!push(ring2, checker2.next + 2, 464));
+	EXPECT_EQ(ring2.Drain(checker2), 2u);
+	EXPECT(push(ring2, checker2.next, 464));
+	checker2.lengths.push_back(464);
+	EXPECT_EQ(ring2.Drain(checker2), 1u);
+	EXPECT(!checker.failed && !checker2.failed);
+}
+
+void testTwoThreads()
+{
+	const uint32_t FRAMES = 200000;
+	tcp::FrameRing ring(16 * 1024);
+
+	// The lengths are decided up front so the consumer can check them
+	Checker checker;
+	uint32_t state = 1;
+	for (uint32_t n = 0; n < FRAMES; n++) {
+		state = state * 1103515245 + 12345;
+		auto length = (state >> 8) % 8 == 0 ? ring.MaxFrame() - (state >> 16) % 64 : (state >> 8) % 1500;
+		checker.lengths.push_back(length);
+	}
+
+	std::thread producer([&]() {
+		for (uint32_t n = 0; n < FRAMES; n++) {
+			while (!push(ring, n, checker.lengths[n])) {
+				std::this_thread::yield();
+			}
+		}
+	});
+
+	while (checker.next < FRAMES) {
+		if (ring.Drain(checker) == 0) {
+			std::this_thread::yield();
+		}
+	}
+	producer.join();
+
+	EXPECT(!checker.failed);
+	EXPECT_EQ(checker.next, FRAMES);
+	EXPECT(ring.Empty());
+}
+
+} // namespace
+
+int main()
+{
+	testWrapAtEveryOffset();
+	testMaxFrame();
+	testFull();
+	testTwoThreads();
+	return TEST_RESULT();
+}
@@ -0,0 +1,155 @@
+// Allocations made while the games in a recorded capture are framed and
+// saved: frames go through tcp::Parser to GameLogger and on to LogWriter (on
+// this thread, since the WriterPool isn't started), and a replacement
+// operator new counts the calls. Fails if messages take more than
+// MAX_PER_MESSAGE allocations on average, so a regression shows up in ctest.
+//
+//   GameLoggerBench capture.pcap[.gz]
+
+#include "File.h"
+#include "GameLogger.h"
+#include "LogWriter.h"
+#include "hsl/Reader.h"
+#include "tcp/Parser.h"
+
+#include "util.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+namespace {
+
+const std::string DATA_DIR = "GameLoggerBench.data";
+
+// Per-game work (flows, streams, files and the arena's first slabs) spread
+// over the capture's messages. Storing a message costs nothing once a game
+// is warmed up.
+const double MAX_PER_MESSAGE = 0.1;
+
+std::atomic<uint64_t> allocations(0);
+
+struct Frame
+{
+	int64_t nanotime;
+	size_t offset;
+	size_t size;
+};
+
+// Reads a classic little-endian pcap file (zlib reads it whether or not it's gzipped)
+bool readCapture(const char *path, int &linkType, std::vector<uint8_t> &data, std::vector<Frame> &frames)
+{
+	auto file = gzopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "can't open %s\n", path);
+		return false;
+	}
+
+	uint32_t header[6];
+	auto ok = gzread(file, header, sizeof(header)) == int(sizeof(header)) && (header[0] == 0xa1b2c3d4 || header[0] == 0xa1b23c4d);
+	auto nanos = header[0] == 0xa1b23c4d;
+	linkType = int(header[5]);
+
+	uint32_t record[4]; // seconds, micro or nanoseconds, captured length, original length
+	while (ok && gzread(file, record, sizeof(record)) == int(sizeof(record))) {
+		Frame frame = { int64_t(record[0]) * int64_t(1e9) + int64_t(record[1]) * (nanos ? 1 : 1000), data.size(), record[2] };
+		data.resize(data.size() + frame.size);
+		ok = gzread(file, data.data() + frame.offset, unsigned(frame.size)) == int(frame.size);
+		frames.push_back(frame);
+	}
+	gzclose(file);
+
+	if (!ok) {
+		fprintf(stderr, "%s isn't a pcap file (or it's truncated)\n", path);
+	}
+	return ok;
+}
+
+std::vector<std::string> saved;
+
+void gameSaved(const std::string &filename)
+{
+	saved.push_back(filename);
+}
+
+tcp::Parser::Callback::Ptr newLogger(int64_t nanotime, tcp::Stream *stream)
+{
+	return std::make_unique<GameLogger>(nanotime, stream, gameSaved);
+}
+
+} // namespace
+
+void *operator new(size_t size)
+{
+	allocations++;
+	auto p = malloc(size ? size : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) throw()
+{
+	free(p);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: GameLoggerBench capture.pcap[.gz]\n");
+		return 1;
+	}
+
+	int linkType;
+	std::vector<uint8_t> data;
+	std::vector<Frame> frames;
+	if (!readCapture(argv[1], linkType, data, frames)) {
+		return 1;
+	}
+
+	LogWriter::Settings settings;
+	settings.dataDir = DATA_DIR;
+	LogWriter::Configure(settings);
+	saved.reserve(1024);
+
+	// Everything from the first frame until the last game is saved
+	auto before = allocations.load();
+	auto start = std::chrono::steady_clock::now();
+	{
+		tcp::Parser parser(newLogger);
+		for (auto &frame : frames) {
+			parser(frame.nanotime, linkType, std::make_range<const uint8_t *>(data.data() + frame.offset, data.data() + frame.offset + frame.size));
+		}
+	}
+	auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	auto allocated = allocations.load() - before;
+
+	size_t messages = 0;
+	for (auto &path : saved) {
+		hsl::Reader reader;
+		hsl::Record record;
+		if (reader.Open(path)) {
+			while (reader.Next(record)) {
+				messages++;
+			}
+		}
+		file::Remove(path);
+	}
+
+	auto perMessage = messages ? double(allocated) / messages : 0.0;
+	printf("%d frames, %d games, %d messages in %.1f ms\n", int(frames.size()), int(saved.size()), int(messages), elapsed / 1000.0);
+	printf("%llu allocations, %.4f per message\n", static_cast<unsigned long long>(allocated), perMessage);
+
+	if (messages == 0 || perMessage > MAX_PER_MESSAGE) {
+		fprintf(stderr, "expected games with at most %.2f allocations per message\n", MAX_PER_MESSAGE);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,259 @@
+// GameLogger framing end to end: segments go through tcp::Parser to the
+// logger, games are saved (on this thread, since the WriterPool isn't
+// started) and read back with hsl::Reader. Covers messages split across and
+// packed into segments, canceling on corrupted framing and finding the
+// framing of a connection picked up mid-stream.
+
+#include "Test.h"
+#include "File.h"
+#include "GameLogger.h"
+#include "LogWriter.h"
+#include "hsl/Reader.h"
+#include "tcp/Parser.h"
+
+#include "util.h"
+
+#include <random>
+#include <string>
+
+using namespace test;
+
+namespace {
+
+const std::string DATA_DIR = "GameLoggerTest.data";
+
+const std::vector<uint8_t> CLIENT = { 10, 0, 0, 1 };
+const std::vector<uint8_t> SERVER = { 12, 130, 244, 193 };
+const uint16_t CLIENT_PORT = 40000;
+const uint16_t SERVER_PORT = 3724;
+
+std::vector<std::string> saved;
+
+void gameSaved(const std::string &filename)
+{
+	saved.push_back(filename);
+}
+
+tcp::Parser::Callback::Ptr newLogger(int64_t nanotime, tcp::Stream *stream)
+{
+	return std::make_unique<GameLogger>(nanotime, stream, gameSaved);
+}
+
+struct Message
+{
+	uint32_t type;
+	std::vector<uint8_t> body;
+};
+
+std::vector<uint8_t> frame(const Message &message)
+{
+	std::vector<uint8_t> out(8);
+	auto size = uint32_t(message.body.size());
+	memcpy(out.data(), &message.type, 4);
+	memcpy(out.data() + 4, &size, 4);
+	out.insert(out.end(), message.body.begin(), message.body.end());
+	return out;
+}
+
+std::vector<Message> randomMessages(std::mt19937 &rng, int count)
+{
+	std::vector<Message> messages(count);
+	for (auto &m : messages) {
+		m.type = 1 + rng() % 300;
+		m.body.resize(rng() % 2000);
+		for (auto &b : m.body) {
+			b = uint8_t(rng());
+		}
+	}
+	return messages;
+}
+
+// One direction of a connection
+class Side
+{
+public:
+	Side(tcp::Parser &parser, bool client, uint32_t isn)
+		: _parser(parser), _client(client), _seq(isn)
+	{
+	}
+
+	void Send(uint8_t flags, const std::vector<uint8_t> &payload = std::vector<uint8_t>())
+	{
+		auto f = _client
+			? TcpFrame(LINK_RAW, CLIENT, SERVER, CLIENT_PORT, SERVER_PORT, _seq, flags, payload)
+			: TcpFrame(LINK_RAW, SERVER, CLIENT, SERVER_PORT, CLIENT_PORT, _seq, flags, payload);
+		_parser(_time += 1000, LINK_RAW, std::make_range<const uint8_t *>(f.data(), f.data() + f.size()));
+		_seq += uint32_t(payload.size()) + (flags & (TCP_SYN | TCP_FIN) ? 1 : 0);
+	}
+
+	// Sends the bytes in segments of random sizes, so messages are split
+	// across segments and several share one
+	void SendStream(std::mt19937 &rng, const std::vector<uint8_t> &bytes)
+	{
+		for (size_t pos = 0; pos < bytes.size(); ) {
+			auto n = std::min(bytes.size() - pos, size_t(1 + rng() % 3000));
+			Send(TCP_ACK, std::vector<uint8_t>(bytes.begin() + pos, bytes.begin() + pos + n));
+			pos += n;
+		}
+	}
+
+private:
+	tcp::Parser &_parser;
+	bool _client;
+	uint32_t _seq;
+	static int64_t _time;
+};
+
+int64_t Side::_time = int64_t(1400000000e9);
+
+std::vector<uint8_t> join(const std::vector<Message> &messages)
+{
+	std::vector<uint8_t> bytes;
+	for (auto &m : messages) {
+		auto f = frame(m);
+		bytes.insert(bytes.end(), f.begin(), f.end());
+	}
+	return bytes;
+}
+
+// Checks the saved game holds exactly these messages
+void expectGame(const std::string &path, const std::vector<Message> &messages)
+{
+	hsl::Reader reader;
+	EXPECT(reader.Open(path));
+
+	size_t n = 0;
+	hsl::Record record;
+	while (reader.Next(record)) {
+		if (n < messages.size()) {
+			EXPECT_EQ(record.type, messages[n].type);
+			EXPECT_EQ(record.size, messages[n].body.size());
+			EXPECT(size_t(record.payload.size()) == messages[n].body.size() &&
+				std::equal(record.payload.begin(), record.payload.end(), messages[n].body.begin()));
+		}
+		n++;
+	}
+	EXPECT(reader.Error().empty());
+	EXPECT_EQ(n, messages.size());
+}
+
+void clean()
+{
+	for (auto dir : { "Pending", "Logged" }) {
+		auto path = file::Join(DATA_DIR, dir);
+		for (auto &name : file::List(path, dir == std::string("Pending") ? ".part" : ".hsl")) {
+			file::Remove(file::Join(path, name));
+		}
+	}
+	saved.clear();
+}
+
+void testGame()
+{
+	clean();
+	std::mt19937 rng(1);
+	auto messages = randomMessages(rng, 200);
+	{
+		tcp::Parser parser(newLogger);
+		Side client(parser, true, 1000), server(parser, false, 0xfffff000u);
+		client.Send(TCP_SYN);
+		server.Send(TCP_SYN | TCP_ACK);
+		server.SendStream(rng, join(messages));
+		client.Send(TCP_FIN | TCP_ACK);
+		server.Send(TCP_FIN | TCP_ACK);
+	}
+
+	EXPECT_EQ(saved.size(), 1u);
+	if (saved.size() == 1) {
+		expectGame(saved[0], messages);
+	}
+}
+
+void testCorruptedFraming()
+{
+	clean();
+	std::mt19937 rng(2);
+	auto messages = randomMessages(rng, 20);
+
+	// A header that isn't plausible cancels the whole game, since the
+	// framing can't be trusted after it
+	auto bytes = join(messages);
+	auto bad = frame(messages[0]);
+	bad[3] = 0x7f; // type far too big
+	auto middle = join(std::vector<Message>(messages.begin(), messages.begin() + 10)).size();
+	bytes.insert(bytes.begin() + middle, bad.begin(), bad.end());
+	{
+		tcp::Parser parser(newLogger);
+		Side client(parser, true, 1), server(parser, false, 2);
+		client.Send(TCP_SYN);
+		server.Send(TCP_SYN | TCP_ACK);
+		server.SendStream(rng, bytes);
+		client.Send(TCP_FIN | TCP_ACK);
+		server.Send(TCP_FIN | TCP_ACK);
+	}
+
+	EXPECT(saved.empty());
+	EXPECT(file::List(file::Join(DATA_DIR, "Pending"), ".part").empty());
+	EXPECT(file::List(file::Join(DATA_DIR, "Logged"), ".hsl").empty());
+}
+
+void testMidStreamResync()
+{
+	clean();
+	std::mt19937 rng(3);
+	auto messages = randomMessages(rng, 50);
+
+	// Capture starts partway through a message: the tail of it comes first
+	auto tail = frame(messages[0]);
+	tail.erase(tail.begin(), tail.begin() + 3);
+	std::fill(tail.begin(), tail.begin() + 5, uint8_t(0xff)); // not a plausible header at any offset
+	auto bytes = join(std::vector<Message>(messages.begin() + 1, messages.end()));
+	bytes.insert(bytes.begin(), tail.begin(), tail.end());
+	{
+		tcp::Parser parser(newLogger);
+		parser.SetResync(true);
+		Side server(parser, false, 12345);
+		server.SendStream(rng, bytes);
+		server.Send(TCP_FIN | TCP_ACK);
+	}
+
+	EXPECT_EQ(saved.size(), 1u);
+	if (saved.size() == 1) {
+		expectGame(saved[0], std::vector<Message>(messages.begin() + 1, messages.end()));
+	}
+}
+
+void testClosedMidMessage()
+{
+	clean();
+	std::mt19937 rng(4);
+	auto messages = randomMessages(rng, 10);
+	auto bytes = join(messages);
+	bytes.resize(bytes.size() - 1);
+	{
+		tcp::Parser parser(newLogger);
+		Side client(parser, true, 1), server(parser, false, 2);
+		client.Send(TCP_SYN);
+		server.Send(TCP_SYN | TCP_ACK);
+		server.SendStream(rng, bytes);
+		server.Send(TCP_FIN | TCP_ACK);
+		client.Send(TCP_FIN | TCP_ACK);
+	}
+	EXPECT(saved.empty());
+}
+
+} // namespace
+
+int main()
+{
+	LogWriter::Settings settings;
+	settings.dataDir = DATA_DIR;
+	LogWriter::Configure(settings);
+
+	testGame();
+	testCorruptedFraming();
+	testMidStreamResync();
+	testClosedMidMessage();
+	clean();
+	return TEST_RESULT();
+}
@@ -0,0 +1,462 @@
+// The hsl library: round trips through every codec compiled in, the header,
+// cutting truncated files back with Recover, indexed files (and
+// RecoverIndexed) and reading both formats with hsl::Reader.
+
+#include "Test.h"
+#include "hsl/Codec.h"
+#include "hsl/Header.h"
+#include "hsl/Index.h"
+#include "hsl/Reader.h"
+
+#include <algorithm>
+#include <random>
+
+using namespace test;
+
+namespace {
+
+const int64_t START = int64_t(1400000000) * int64_t(1e9);
+
+struct Message
+{
+	int64_t nanotime;
+	uint32_t type;
+	std::vector<uint8_t> body;
+};
+
+// An .hsl file built in memory, with what went into it
+struct File
+{
+	std::vector<uint8_t> data;
+	std::vector<uint8_t> raw;       // the uncompressed records, after the header
+	std::vector<size_t> flushed;    // compressed size at each Flush (or end of a block)
+	std::vector<size_t> rawFlushed; // records' bytes by then
+	std::vector<size_t> counts;     // messages by then
+};
+
+class VectorSink : public hsl::Sink
+{
+public:
+	explicit VectorSink(std::vector<uint8_t> &out) : _out(out) { }
+
+	bool Write(const uint8_t *data, size_t size)
+	{
+		_out.insert(_out.end(), data, data + size);
+		return true;
+	}
+
+private:
+	std::vector<uint8_t> &_out;
+
+	VectorSink &operator=(const VectorSink &);
+};
+
+std::vector<hsl::Codec> codecs()
+{
+	std::vector<hsl::Codec> available;
+	for (auto codec : { hsl::CODEC_DEFLATE, hsl::CODEC_ZSTD, hsl::CODEC_LZ4 }) {
+		if (hsl::CodecAvailable(codec)) {
+			available.push_back(codec);
+		}
+	}
+	return available;
+}
+
+// Messages of a handful of types, compressible like the real thing
+std::vector<Message> makeMessages(int count)
+{
+	const uint32_t TYPES[] = { 1, 2, 3, 19, 1500 };
+	std::mt19937 rng(1);
+	std::vector<Message> messages(count);
+	for (auto i = 0; i < count; i++) {
+		auto &message = messages[i];
+		message.nanotime = START + int64_t(i) * int64_t(1e7);
+		message.type = TYPES[rng() % 5];
+		message.body.resize(rng() % 8 == 0 ? 0 : rng() % 2000);
+		for (size_t j = 0; j < message.body.size(); j++) {
+			message.body[j] = j % 4 == 0 ? uint8_t(rng()) : uint8_t("CARD_EFFECT"[j % 11]);
+		}
+	}
+	return messages;
+}
+
+// <nanotime 8><type 4><size 4><body>
+void appendRecord(std::vector<uint8_t> &out, const Message &message)
+{
+	auto size = uint32_t(message.body.size());
+	auto p = reinterpret_cast<const uint8_t *>(&message.nanotime);
+	out.insert(out.end(), p, p + 8);
+	p = reinterpret_cast<const uint8_t *>(&message.type);
+	out.insert(out.end(), p, p + 4);
+	p = reinterpret_cast<const uint8_t *>(&size);
+	out.insert(out.end(), p, p + 4);
+	out.insert(out.end(), message.body.begin(), message.body.end());
+}
+
+hsl::Header header(hsl::Codec codec, uint8_t format)
+{
+	hsl::Header h;
+	h.nanotime = START;
+	h.format = format;
+	h.gameVersion = 12345;
+	h.codec = codec;
+	return h;
+}
+
+std::range<const uint8_t *> all(const std::vector<uint8_t> &data)
+{
+	return std::make_range(data.data(), data.data() + data.size());
+}
+
+// One stream (or frame sequence) flushed every flushEvery messages, as
+// LogWriter writes plain files
+File writePlain(hsl::Codec codec, const std::vector<Message> &messages, size_t flushEvery)
+{
+	File file;
+	VectorSink sink(file.data);
+	auto compressor = hsl::Compressor::Create(codec, -1, sink);
+	EXPECT(compressor != nullptr);
+
+	std::vector<uint8_t> chunk;
+	header(codec, hsl::Header::FORMAT).Write(chunk);
+	for (size_t i = 0; i < messages.size(); i++) {
+		appendRecord(chunk, messages[i]);
+		appendRecord(file.raw, messages[i]);
+		if ((i + 1) % flushEvery == 0) {
+			EXPECT(compressor->Write(all(chunk)));
+			EXPECT(compressor->Flush());
+			chunk.clear();
+			file.flushed.push_back(file.data.size());
+			file.rawFlushed.push_back(file.raw.size());
+			file.counts.push_back(i + 1);
+		}
+	}
+	EXPECT(compressor->Write(all(chunk)));
+	EXPECT(compressor->Finish());
+	return file;
+}
+
+// Independently compressed blocks of blockSize messages then the index, as
+// LogWriter writes indexed files
+File writeIndexed(hsl::Codec codec, const std::vector<Message> &messages, size_t blockSize, hsl::Index &index)
+{
+	File file;
+	VectorSink sink(file.data);
+	index.blocks.clear();
+	for (size_t first = 0; first < messages.size(); first += blockSize) {
+		auto compressor = hsl::Compressor::Create(codec, -1, sink);
+		hsl::BlockInfo block;
+		block.offset = file.data.size();
+
+		std::vector<uint8_t> chunk;
+		if (first == 0) {
+			header(codec, hsl::Header::FORMAT_INDEXED).Write(chunk);
+		}
+		for (auto i = first; i < std::min(first + blockSize, messages.size()); i++) {
+			appendRecord(chunk, messages[i]);
+			appendRecord(file.raw, messages[i]);
+			block.Add(messages[i].nanotime, messages[i].type);
+		}
+		block.rawSize = uint32_t(chunk.size());
+		EXPECT(compressor->Write(all(chunk)));
+		EXPECT(compressor->Finish());
+
+		block.compressedSize = uint32_t(file.data.size() - block.offset);
+		index.blocks.push_back(block);
+		file.flushed.push_back(file.data.size());
+		file.rawFlushed.push_back(file.raw.size());
+		file.counts.push_back(std::min(first + blockSize, messages.size()));
+	}
+	index.Write(file.data, file.data.size());
+	return file;
+}
+
+// The records of a whole decompressed file, checking its header first
+std::vector<uint8_t> records(const std::vector<uint8_t> &out, hsl::Codec codec, uint8_t format)
+{
+	hsl::Header h;
+	auto size = h.Parse(all(out));
+	EXPECT(size > 0);
+	EXPECT_EQ(h.codec, codec);
+	EXPECT_EQ(h.format, format);
+	EXPECT_EQ(h.nanotime, START);
+	EXPECT_EQ(h.gameVersion, 12345u);
+	return std::vector<uint8_t>(out.begin() + size, out.end());
+}
+
+bool isPrefix(const std::vector<uint8_t> &prefix, const std::vector<uint8_t> &data, size_t size)
+{
+	return prefix.size() == size && size <= data.size() && std::equal(prefix.begin(), prefix.end(), data.begin());
+}
+
+// Where to cut files: on and around every flush, inside the data between
+// them and a few bytes from either end
+std::vector<size_t> cuts(const File &file)
+{
+	std::vector<size_t> at;
+	at.push_back(1);
+	at.push_back(10);
+	size_t last = 0;
+	for (auto flushed : file.flushed) {
+		at.push_back(flushed - 1);
+		at.push_back(flushed);
+		at.push_back(flushed + 1);
+		at.push_back((last + flushed) / 2);
+		last = flushed;
+	}
+	at.push_back(file.data.size() - 1);
+	at.erase(std::remove_if(at.begin(), at.end(), [&](size_t cut) { return cut == 0 || cut >= file.data.size(); }), at.end());
+	return at;
+}
+
+void testHeader()
+{
+	for (auto codec : { hsl::CODEC_DEFLATE, hsl::CODEC_ZSTD, hsl::CODEC_LZ4 }) {
+		std::vector<uint8_t> out;
+		header(codec, hsl::Header::FORMAT).Write(out);
+
+		// Deflate files keep the original 9 byte payload
+		EXPECT_EQ(out.size(), size_t(codec == hsl::CODEC_DEFLATE ? 25 : 26));
+		hsl::Header h;
+		EXPECT_EQ(h.Parse(all(out)), out.size());
+		EXPECT_EQ(h.codec, codec);
+		EXPECT_EQ(h.gameVersion, 12345u);
+
+		out.pop_back();
+		EXPECT_EQ(hsl::Header().Parse(all(out)), 0u);
+	}
+
+	hsl::Codec codec;
+	EXPECT(hsl::ParseCodec("zstd", codec) && codec == hsl::CODEC_ZSTD);
+	EXPECT(hsl::ParseCodec(hsl::CodecName(hsl::CODEC_LZ4), codec) && codec == hsl::CODEC_LZ4);
+	EXPECT(!hsl::ParseCodec("bzip2", codec));
+	EXPECT(hsl::CodecAvailable(hsl::CODEC_DEFLATE));
+}
+
+void testRoundTrip()
+{
+	auto messages = makeMessages(500);
+	for (auto codec : codecs()) {
+		auto file = writePlain(codec, messages, 64);
+		EXPECT_EQ(hsl::DetectCodec(all(file.data)), codec);
+
+		hsl::Codec detected;
+		std::vector<uint8_t> out;
+		std::string error;
+		EXPECT(hsl::Decompress(all(file.data), out, detected, error));
+		EXPECT_EQ(detected, codec);
+		EXPECT(records(out, codec, hsl::Header::FORMAT) == file.raw);
+
+		hsl::Header h;
+		EXPECT(hsl::ReadHeader(codec, all(file.data), h));
+		EXPECT_EQ(h.format, hsl::Header::FORMAT);
+
+		// Fed a few bytes at a time, it's only complete at the very end
+		auto decompressor = hsl::Decompressor::Create(codec);
+		out.clear();
+		for (size_t pos = 0; pos < file.data.size(); pos += 100) {
+			auto end = std::min(pos + 100, file.data.size());
+			EXPECT(decompressor->Write(std::make_range<const uint8_t *>(file.data.data() + pos, file.data.data() + end), out));
+		}
+		EXPECT(decompressor->Complete());
+		EXPECT(records(out, codec, hsl::Header::FORMAT) == file.raw);
+
+		// Corrupt data is an error, not a crash
+		auto corrupt = file.data;
+		for (size_t i = corrupt.size() / 2; i < corrupt.size() / 2 + 64; i++) {
+			corrupt[i] ^= 0x5a;
+		}
+		out.clear();
+		EXPECT(!hsl::Decompress(all(corrupt), out, detected, error) || out != file.raw);
+	}
+}
+
+void testRecover()
+{
+	auto messages = makeMessages(300);
+	for (auto codec : codecs()) {
+		auto file = writePlain(codec, messages, 40);
+		for (auto cut : cuts(file)) {
+			// Everything up to the last flush before the cut is kept
+			auto flush = std::upper_bound(file.flushed.begin(), file.flushed.end(), cut) - file.flushed.begin();
+			std::vector<uint8_t> data(file.data.begin(), file.data.begin() + cut);
+			auto recovered = hsl::Recover(codec, data);
+			EXPECT_EQ(recovered, flush > 0);
+			if (!recovered || flush == 0) {
+				continue;
+			}
+
+			hsl::Codec detected;
+			std::vector<uint8_t> out;
+			std::string error;
+			EXPECT(hsl::Decompress(all(data), out, detected, error));
+			if (!isPrefix(records(out, codec, hsl::Header::FORMAT), file.raw, file.rawFlushed[flush - 1])) {
+				fprintf(stderr, "%s cut at %d of %d bytes\n", hsl::CodecName(codec), int(cut), int(file.data.size()));
+				EXPECT(false);
+			}
+		}
+	}
+}
+
+void testIndex()
+{
+	auto messages = makeMessages(500);
+	for (auto codec : codecs()) {
+		hsl::Index written;
+		auto file = writeIndexed(codec, messages, 64, written);
+
+		hsl::Index index;
+		EXPECT(index.Read(all(file.data)));
+		EXPECT_EQ(index.blocks.size(), 8u);
+		EXPECT_EQ(index.Messages(), messages.size());
+		for (size_t i = 0; i < index.blocks.size() && i < written.blocks.size(); i++) {
+			auto &a = index.blocks[i];
+			auto &b = written.blocks[i];
+			EXPECT(a.offset == b.offset && a.compressedSize == b.compressedSize && a.rawSize == b.rawSize);
+			EXPECT(a.firstNanotime == b.firstNanotime && a.messages == b.messages);
+			EXPECT(memcmp(a.types, b.types, sizeof(a.types)) == 0);
+		}
+
+		// Each block decodes on its own
+		std::vector<uint8_t> out;
+		for (auto &block : index.blocks) {
+			std::string error;
+			EXPECT(hsl::ReadBlock(codec, all(file.data), block, out, error));
+		}
+		EXPECT(records(out, codec, hsl::Header::FORMAT_INDEXED) == file.raw);
+
+		// Seeking
+		size_t first;
+		EXPECT_EQ(index.FindMessage(0, first), 0u);
+		EXPECT_EQ(index.FindMessage(130, first), 2u);
+		EXPECT_EQ(first, 128u);
+		EXPECT_EQ(index.FindMessage(messages.size(), first), index.blocks.size());
+		EXPECT_EQ(index.FindTime(0), 0u);
+		EXPECT_EQ(index.FindTime(messages[200].nanotime), 3u);
+		EXPECT_EQ(index.FindTime(messages.back().nanotime + 1), 7u);
+		EXPECT(index.blocks[0].HasType(1) && index.blocks[0].HasType(1500) && index.blocks[0].HasType(5000));
+		EXPECT(!index.blocks[0].HasType(4));
+
+		// Plain files have no index
+		EXPECT(!hsl::Index().Read(all(writePlain(codec, messages, 64).data)));
+	}
+}
+
+void testRecoverIndexed()
+{
+	auto messages = makeMessages(300);
+	for (auto codec : codecs()) {
+		hsl::Index written;
+		auto file = writeIndexed(codec, messages, 40, written);
+		auto cutsAt = cuts(file);
+		cutsAt.push_back(file.data.size() - 20); // in the index
+
+		for (auto cut : cutsAt) {
+			// The complete blocks are kept, and indexed again
+			auto blocks = std::upper_bound(file.flushed.begin(), file.flushed.end(), cut) - file.flushed.begin();
+			std::vector<uint8_t> data(file.data.begin(), file.data.begin() + cut);
+			auto recovered = hsl::Recover(codec, data);
+			EXPECT_EQ(recovered, blocks > 0);
+			if (!recovered || blocks == 0) {
+				continue;
+			}
+
+			hsl::Index index;
+			EXPECT(index.Read(all(data)));
+			EXPECT_EQ(index.blocks.size(), size_t(blocks));
+			EXPECT_EQ(index.Messages(), file.counts[blocks - 1]);
+
+			std::vector<uint8_t> out;
+			for (auto &block : index.blocks) {
+				std::string error;
+				EXPECT(hsl::ReadBlock(codec, all(data), block, out, error));
+			}
+			if (!isPrefix(records(out, codec, hsl::Header::FORMAT_INDEXED), file.raw, file.rawFlushed[blocks - 1])) {
+				fprintf(stderr, "%s indexed cut at %d of %d bytes\n", hsl::CodecName(codec), int(cut), int(file.data.size()));
+				EXPECT(false);
+			}
+		}
+	}
+}
+
+// Reads the whole file, returning false if anything didn't match
+bool readsBack(const std::vector<uint8_t> &data, const std::vector<Message> &messages, const std::vector<uint32_t> &types)
+{
+	hsl::Reader reader;
+	if (!reader.Open(all(data))) {
+		return false;
+	}
+	reader.SetTypes(types);
+	EXPECT_EQ(reader.GetHeader().nanotime, START);
+
+	auto ok = true;
+	auto i = messages.begin();
+	for (auto &record : reader) {
+		while (i != messages.end() && !types.empty() && std::find(types.begin(), types.end(), i->type) == types.end()) {
+			++i;
+		}
+		ok = ok && i != messages.end() && record.nanotime == i->nanotime && record.type == i->type &&
+			size_t(record.payload.size()) == i->body.size() && std::equal(i->body.begin(), i->body.end(), record.payload.begin());
+		if (i != messages.end()) {
+			++i;
+		}
+	}
+	while (i != messages.end() && !types.empty() && std::find(types.begin(), types.end(), i->type) == types.end()) {
+		++i;
+	}
+	return ok && i == messages.end() && reader.Error().empty();
+}
+
+void testReader()
+{
+	auto messages = makeMessages(500);
+	for (auto codec : codecs()) {
+		hsl::Index index;
+		auto plain = writePlain(codec, messages, 64);
+		auto indexed = writeIndexed(codec, messages, 64, index);
+
+		for (auto file : { &plain, &indexed }) {
+			hsl::Reader reader;
+			EXPECT(reader.Open(all(file->data)));
+			EXPECT_EQ(reader.GetCodec(), codec);
+			EXPECT_EQ(reader.Indexed(), file == &indexed);
+
+			EXPECT(readsBack(file->data, messages, std::vector<uint32_t>()));
+			EXPECT(readsBack(file->data, messages, std::vector<uint32_t>(1, 19)));
+			EXPECT(readsBack(file->data, messages, std::vector<uint32_t>(1, 1500)));
+			EXPECT(readsBack(file->data, messages, std::vector<uint32_t>(1, 4))); // none
+			EXPECT(readsBack(file->data, messages, std::vector<uint32_t>(1, 0xffffffffu)));
+		}
+
+		// A truncated file reads up to the damage and reports it
+		std::vector<uint8_t> truncated(plain.data.begin(), plain.data.begin() + plain.data.size() / 2);
+		hsl::Reader reader;
+		size_t count = 0;
+		if (reader.Open(all(truncated))) {
+			for (auto &record : reader) {
+				(void)record;
+				count++;
+			}
+		}
+		EXPECT(count < messages.size());
+		EXPECT(!reader.Error().empty());
+	}
+
+	hsl::Reader reader;
+	std::vector<uint8_t> garbage(100, 0x42);
+	EXPECT(!reader.Open(all(garbage)));
+	EXPECT(!reader.Error().empty());
+}
+
+} // namespace
+
+int main()
+{
+	testHeader();
+	testRoundTrip();
+	testRecover();
+	testIndex();
+	testRecoverIndexed();
+	testReader();
+	return TEST_RESULT();
+}
@@ -0,0 +1,218 @@
+// LogWriter: games written with each codec compiled in, plain and indexed,
+// read back with hsl::Reader, and pending files cut short at several points
+// (as a crash leaves them) finished by RecoverPending.
+
+#include "Test.h"
+#include "File.h"
+#include "LogWriter.h"
+#include "MessageArena.h"
+#include "hsl/Reader.h"
+
+#include <random>
+#include <string>
+
+using namespace test;
+
+namespace {
+
+const std::string DATA_DIR = "LogWriterTest.data";
+const int64_t START = int64_t(1400000000) * int64_t(1e9);
+
+// Batches are written further apart than LogWriter's 60 second sync
+// interval, so each one after the first ends with a flush (or a block)
+const int BATCHES = 6;
+const int PER_BATCH = 50;
+const int64_t BATCH_INTERVAL = int64_t(61e9);
+
+struct Message
+{
+	int64_t nanotime;
+	std::vector<uint8_t> data; // <type 4><size 4><body>
+};
+
+std::vector<Message> makeMessages()
+{
+	std::mt19937 rng(1);
+	std::vector<Message> messages;
+	for (auto batch = 0; batch < BATCHES; batch++) {
+		for (auto i = 0; i < PER_BATCH; i++) {
+			Message message;
+			message.nanotime = START + batch * BATCH_INTERVAL + i * int64_t(1e6);
+			uint32_t type = rng() % 4 + 1;
+			uint32_t size = rng() % 600;
+			message.data.resize(8 + size);
+			memcpy(&message.data[0], &type, 4);
+			memcpy(&message.data[4], &size, 4);
+			for (uint32_t j = 0; j < size; j++) {
+				message.data[8 + j] = j % 3 == 0 ? uint8_t(rng()) : uint8_t("ZONE_PLAY"[j % 9]);
+			}
+			messages.push_back(message);
+		}
+	}
+	return messages;
+}
+
+void clearDir(const char *dir, const char *extension)
+{
+	auto path = file::Join(DATA_DIR, dir);
+	for (auto &name : file::List(path, extension)) {
+		file::Remove(file::Join(path, name));
+	}
+}
+
+std::vector<std::string> listed(const char *dir, const char *extension)
+{
+	auto path = file::Join(DATA_DIR, dir);
+	auto names = file::List(path, extension);
+	for (auto &name : names) {
+		name = file::Join(path, name);
+	}
+	return names;
+}
+
+// Returns how many messages the file has, or -1 if they aren't the first
+// ones written or it doesn't read cleanly
+int readBack(const std::string &path, const std::vector<Message> &messages, hsl::Codec codec, bool indexed)
+{
+	hsl::Reader reader;
+	if (!reader.Open(path)) {
+		fprintf(stderr, "%s: %s\n", path.c_str(), reader.Error().c_str());
+		return -1;
+	}
+	EXPECT_EQ(reader.GetCodec(), codec);
+	EXPECT_EQ(reader.Indexed(), indexed);
+	EXPECT_EQ(reader.GetHeader().nanotime, START);
+
+	size_t n = 0;
+	for (auto &record : reader) {
+		if (n >= messages.size()) {
+			return -1;
+		}
+		auto &message = messages[n++];
+		if (record.nanotime != message.nanotime || size_t(record.payload.size()) + 8 != message.data.size() ||
+			memcmp(&record.type, message.data.data(), 4) != 0 || memcmp(record.payload.begin(), message.data.data() + 8, record.payload.size()) != 0) {
+			return -1;
+		}
+	}
+	return reader.Error().empty() ? int(n) : -1;
+}
+
+void add(MessageArena &arena, const Message &message)
+{
+	arena.Add(message.nanotime, std::make_range(message.data.data(), message.data.data() + message.data.size()));
+}
+
+void configure(hsl::Codec codec, bool indexed)
+{
+	LogWriter::Settings settings;
+	settings.dataDir = DATA_DIR;
+	settings.codec = codec;
+	settings.indexed = indexed;
+	LogWriter::Configure(settings);
+}
+
+// Writes a game, keeping a copy of the pending file as it was after batch
+// snapshotAfter (when it had just been flushed)
+std::string writeGame(const std::vector<Message> &messages, int snapshotAfter, std::vector<uint8_t> &snapshot)
+{
+	LogWriter writer(START);
+	MessageArena arena(16 * 1024);
+	for (auto batch = 0; batch < BATCHES; batch++) {
+		for (auto i = 0; i < PER_BATCH; i++) {
+			add(arena, messages[batch * PER_BATCH + i]);
+		}
+		writer.Write(arena);
+		arena.Clear();
+
+		if (batch == snapshotAfter) {
+			auto pending = listed("Pending", ".part");
+			EXPECT_EQ(pending.size(), 1u);
+			EXPECT(!pending.empty() && file::Read(pending[0], snapshot));
+		}
+	}
+	EXPECT_EQ(writer.Messages(), messages.size());
+	return writer.Finish();
+}
+
+void testRoundTrip(hsl::Codec codec, bool indexed)
+{
+	configure(codec, indexed);
+	clearDir("Logged", ".hsl");
+	auto messages = makeMessages();
+
+	std::vector<uint8_t> snapshot;
+	auto filename = writeGame(messages, -1, snapshot);
+	EXPECT(!filename.empty());
+	EXPECT_EQ(listed("Pending", ".part").size(), 0u);
+	EXPECT_EQ(readBack(filename, messages, codec, indexed), int(messages.size()));
+
+	// Another game from the same second gets its own name
+	auto second = writeGame(messages, -1, snapshot);
+	EXPECT(!second.empty() && second != filename);
+	EXPECT_EQ(listed("Logged", ".hsl").size(), 2u);
+
+	// Nothing is left behind by a canceled game
+	{
+		LogWriter writer(START);
+		MessageArena arena(16 * 1024);
+		add(arena, messages[0]);
+		writer.Write(arena);
+	}
+	EXPECT_EQ(listed("Pending", ".part").size(), 0u);
+	EXPECT_EQ(listed("Logged", ".hsl").size(), 2u);
+}
+
+void testRecoverPending(hsl::Codec codec, bool indexed)
+{
+	configure(codec, indexed);
+	auto messages = makeMessages();
+
+	// Flushed after batches 1 to 3, so 200 messages
+	std::vector<uint8_t> snapshot;
+	writeGame(messages, 3, snapshot);
+	const int FLUSHED = 4 * PER_BATCH;
+
+	// Cut anywhere, it's the messages up to a flush: exactly the last one
+	// when the file ends with it, the one before if that's cut short
+	size_t cuts[] = { 10, snapshot.size() / 4, snapshot.size() / 2, snapshot.size() - 100, snapshot.size() - 1, snapshot.size() };
+	for (auto cut : cuts) {
+		clearDir("Logged", ".hsl");
+		auto part = file::Join(file::Join(DATA_DIR, "Pending"), std::to_string(static_cast<long long>(START)) + "-1.part");
+		EXPECT(file::Write(part, snapshot.data(), cut));
+		LogWriter::RecoverPending();
+		EXPECT(!file::Exists(part));
+
+		auto logged = listed("Logged", ".hsl");
+		auto count = logged.size() == 1 ? readBack(logged[0], messages, codec, indexed) : 0;
+		EXPECT(logged.size() <= 1);
+		EXPECT(count >= 0 && count % PER_BATCH == 0 && count != PER_BATCH && count <= FLUSHED);
+		if (cut == snapshot.size()) {
+			EXPECT_EQ(count, FLUSHED);
+		} else if (cut == snapshot.size() - 1) {
+			EXPECT_EQ(count, FLUSHED - PER_BATCH);
+		} else if (cut == 10) {
+			EXPECT_EQ(count, 0);
+		}
+	}
+}
+
+} // namespace
+
+int main()
+{
+	file::MakeDirs(file::Join(DATA_DIR, "Pending"));
+	clearDir("Pending", ".part");
+
+	for (auto codec : { hsl::CODEC_DEFLATE, hsl::CODEC_ZSTD, hsl::CODEC_LZ4 }) {
+		if (!hsl::CodecAvailable(codec)) {
+			continue;
+		}
+		for (auto indexed : { false, true }) {
+			testRoundTrip(codec, indexed);
+			testRecoverPending(codec, indexed);
+		}
+	}
+
+	clearDir("Logged", ".hsl");
+	return TEST_RESULT();
+}
@@ -0,0 +1,156 @@
+// tcp::Segment decoding of synthetic IPv4 and IPv6 frames
+
+#include "Test.h"
+#include "tcp/Segment.h"
+
+using namespace test;
+
+namespace {
+
+const std::vector<uint8_t> CLIENT4 = { 10, 0, 0, 1 };
+const std::vector<uint8_t> SERVER4 = { 12, 130, 244, 193 };
+const std::vector<uint8_t> CLIENT6 = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+const std::vector<uint8_t> SERVER6 = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 };
+
+tcp::Segment decode(int linkType, const std::vector<uint8_t> &frame)
+{
+	return tcp::Segment(linkType, std::make_range(frame.data(), frame.data() + frame.size()));
+}
+
+bool payloadIs(const tcp::Segment &segment, const std::vector<uint8_t> &expected)
+{
+	auto payload = segment.Payload();
+	return size_t(payload.size()) == expected.size() && std::equal(payload.begin(), payload.end(), expected.begin());
+}
+
+void testIPv4()
+{
+	auto payload = Bytes("hello");
+	for (auto linkType : { LINK_ETHERNET, LINK_RAW }) {
+		auto frame = TcpFrame(linkType, CLIENT4, SERVER4, 40000, 3724, 1234, TCP_ACK, payload);
+		auto segment = decode(linkType, frame);
+		EXPECT(segment.WasParsed());
+		EXPECT_EQ(segment.Src().Family(), tcp::FlowKey::IPv4);
+		EXPECT(memcmp(segment.Src().Addr(), CLIENT4.data(), 4) == 0);
+		EXPECT(memcmp(segment.Dst().Addr(), SERVER4.data(), 4) == 0);
+		EXPECT_EQ(segment.Src().Port(), 40000);
+		EXPECT_EQ(segment.Dst().Port(), 3724);
+		EXPECT_EQ(segment.SeqNum(), 1234u);
+		EXPECT(!segment.IsSyn() && !segment.IsFin());
+		EXPECT(payloadIs(segment, payload));
+
+		// The payload points into the frame rather than a copy
+		EXPECT(segment.Payload().end() == frame.data() + frame.size());
+	}
+
+	// Ethernet padding after a short packet isn't payload
+	auto frame = TcpFrame(LINK_ETHERNET, CLIENT4, SERVER4, 40000, 3724, 1, TCP_SYN, std::vector<uint8_t>());
+	frame.resize(60);
+	auto segment = decode(LINK_ETHERNET, frame);
+	EXPECT(segment.WasParsed());
+	EXPECT(segment.IsSyn());
+	EXPECT_EQ(segment.Payload().size(), 0);
+}
+
+void testIPv6()
+{
+	auto payload = Bytes("hello, world");
+	auto frame = TcpFrame(LINK_ETHERNET, CLIENT6, SERVER6, 40000, 1119, 0xfffffff0u, TCP_FIN | TCP_ACK, payload);
+	auto segment = decode(LINK_ETHERNET, frame);
+	EXPECT(segment.WasParsed());
+	EXPECT_EQ(segment.Src().Family(), tcp::FlowKey::IPv6);
+	EXPECT(memcmp(segment.Src().Addr(), CLIENT6.data(), 16) == 0);
+	EXPECT(memcmp(segment.Dst().Addr(), SERVER6.data(), 16) == 0);
+	EXPECT_EQ(segment.Dst().Port(), 1119);
+	EXPECT_EQ(segment.SeqNum(), 0xfffffff0u);
+	EXPECT(segment.IsFin());
+	EXPECT(payloadIs(segment, payload));
+}
+
+void testIPv6ExtensionHeaders()
+{
+	auto payload = Bytes("behind two extension headers");
+	auto frame = TcpFrame(LINK_RAW, CLIENT6, SERVER6, 40000, 3724, 7, TCP_ACK, payload);
+
+	// Insert hop-by-hop options (8 bytes) then an atomic fragment header (8
+	// bytes) between the fixed header and TCP
+	const size_t IP6_HDRLEN = 40;
+	uint8_t hopByHop[8] = { 44 /* next: fragment */, 0, 1, 4, 0, 0, 0, 0 };
+	uint8_t fragment[8] = { 6 /* next: TCP */, 0, 0, 0, 0, 0, 0, 1 };
+	frame.insert(frame.begin() + IP6_HDRLEN, fragment, fragment + sizeof(fragment));
+	frame.insert(frame.begin() + IP6_HDRLEN, hopByHop, hopByHop + sizeof(hopByHop));
+	frame[6] = 0; // next: hop-by-hop
+	auto plen = uint16_t(frame.size() - IP6_HDRLEN);
+	frame[4] = uint8_t(plen >> 8);
+	frame[5] = uint8_t(plen);
+
+	auto segment = decode(LINK_RAW, frame);
+	EXPECT(segment.WasParsed());
+	EXPECT_EQ(segment.SeqNum(), 7u);
+	EXPECT(payloadIs(segment, payload));
+
+	// A real fragment (more fragments set) isn't reassembled
+	frame[IP6_HDRLEN + 8 + 3] = 1;
+	EXPECT(!decode(LINK_RAW, frame).WasParsed());
+}
+
+void testMalformed()
+{
+	auto payload = Bytes("payload");
+	auto frame = TcpFrame(LINK_RAW, CLIENT4, SERVER4, 40000, 3724, 1, TCP_ACK, payload);
+
+	// Truncated anywhere in the headers or payload
+	for (auto size : { 0, 10, 19, 20, 30, 39, 40 + 3 }) {
+		std::vector<uint8_t> truncated(frame.begin(), frame.begin() + size);
+		EXPECT(!decode(LINK_RAW, truncated).WasParsed());
+	}
+
+	// IPv4 total length shorter than the IP and TCP headers
+	auto shortLength = frame;
+	shortLength[2] = 0;
+	shortLength[3] = 30;
+	EXPECT(!decode(LINK_RAW, shortLength).WasParsed());
+
+	// Header lengths below the minimum
+	auto shortIpHeader = frame;
+	shortIpHeader[0] = 0x44;
+	EXPECT(!decode(LINK_RAW, shortIpHeader).WasParsed());
+	auto shortTcpHeader = frame;
+	shortTcpHeader[20 + 12] = 4 << 4;
+	EXPECT(!decode(LINK_RAW, shortTcpHeader).WasParsed());
+
+	// Not TCP
+	auto udp = frame;
+	udp[9] = 17;
+	EXPECT(!decode(LINK_RAW, udp).WasParsed());
+
+	// IPv6 payload length 0 (a jumbogram)
+	auto jumbo = TcpFrame(LINK_RAW, CLIENT6, SERVER6, 40000, 3724, 1, TCP_ACK, payload);
+	jumbo[4] = jumbo[5] = 0;
+	EXPECT(!decode(LINK_RAW, jumbo).WasParsed());
+}
+
+void testKeys()
+{
+	auto out = decode(LINK_RAW, TcpFrame(LINK_RAW, CLIENT4, SERVER4, 40000, 3724, 1, TCP_SYN, std::vector<uint8_t>()));
+	auto in = decode(LINK_RAW, TcpFrame(LINK_RAW, SERVER4, CLIENT4, 3724, 40000, 1, TCP_SYN | TCP_ACK, std::vector<uint8_t>()));
+	EXPECT(out.Key() != in.Key());
+	EXPECT(out.Key() == in.Key().Reverse());
+	EXPECT_EQ(out.Key().ConnectionHash(), in.Key().ConnectionHash());
+
+	// The same addresses over IPv6 are a different flow
+	auto out6 = decode(LINK_RAW, TcpFrame(LINK_RAW, CLIENT6, SERVER6, 40000, 3724, 1, TCP_SYN, std::vector<uint8_t>()));
+	EXPECT(out.Key() != out6.Key());
+}
+
+} // namespace
+
+int main()
+{
+	testIPv4();
+	testIPv6();
+	testIPv6ExtensionHeaders();
+	testMalformed();
+	testKeys();
+	return TEST_RESULT();
+}
@@ -0,0 +1,176 @@
+// tcp::ShardedParser: both directions of a connection go to the same shard,
+// each connection's frames arrive in order, and frames that don't decode or
+// don't fit in a queue are dropped rather than passed on.
+
+#include "Test.h"
+#include "tcp/Segment.h"
+#include "tcp/ShardedParser.h"
+
+#include "util.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+
+using namespace test;
+
+namespace {
+
+const int SHARDS = 4;
+const int CONNECTIONS = 200;
+const uint16_t SERVER_PORT = 3724;
+
+const std::vector<uint8_t> SERVER4 = { 12, 130, 244, 193 };
+const std::vector<uint8_t> SERVER6 = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 };
+
+struct Received
+{
+	int shard;
+	uint32_t connection;
+	uint32_t n;
+	bool fromServer;
+};
+
+std::mutex receivedMu;
+std::vector<Received> received;
+std::atomic<int> nextShard(0);
+
+// Stands in for a shard's tcp::Parser, noting which shard saw each frame
+class Recorder : public PacketCapture::Callback
+{
+public:
+	Recorder() : _shard(nextShard++) { }
+
+	virtual void operator()(int64_t, int linkType, std::range<const uint8_t *> data)
+	{
+		tcp::Segment segment(linkType, data);
+		EXPECT(segment.WasParsed());
+		auto payload = segment.Payload();
+		if (!segment.WasParsed() || payload.size() < 8) {
+			return;
+		}
+
+		// The payload is the connection number then the frame number
+		Received r = { _shard, 0, 0, segment.Src().Port() == SERVER_PORT };
+		memcpy(&r.connection, payload.begin(), 4);
+		memcpy(&r.n, payload.begin() + 4, 4);
+		std::lock_guard<std::mutex> lock(receivedMu);
+		received.push_back(r);
+	}
+
+private:
+	const int _shard;
+};
+
+PacketCapture::Callback::Ptr newRecorder()
+{
+	return std::make_unique<Recorder>();
+}
+
+std::vector<uint8_t> client(uint32_t connection)
+{
+	if (connection % 2) {
+		std::vector<uint8_t> addr(SERVER6);
+		addr[14] = uint8_t(connection >> 8);
+		addr[15] = uint8_t(connection);
+		return addr;
+	}
+	std::vector<uint8_t> addr(4);
+	addr[0] = 10;
+	addr[2] = uint8_t(connection >> 8);
+	addr[3] = uint8_t(connection);
+	return addr;
+}
+
+// Frame n of a connection, alternating between the client and the server
+std::vector<uint8_t> frame(uint32_t connection, uint32_t n, size_t padding = 0)
+{
+	auto src = client(connection);
+	auto &dst = connection % 2 ? SERVER6 : SERVER4;
+	auto clientPort = uint16_t(40000 + connection % 1000);
+
+	std::vector<uint8_t> payload(8 + padding);
+	memcpy(&payload[0], &connection, 4);
+	memcpy(&payload[4], &n, 4);
+	if (n % 2) {
+		return TcpFrame(LINK_RAW, dst, src, SERVER_PORT, clientPort, n, TCP_ACK, payload);
+	}
+	return TcpFrame(LINK_RAW, src, dst, clientPort, SERVER_PORT, n, TCP_ACK, payload);
+}
+
+void feed(tcp::ShardedParser &parser, const std::vector<uint8_t> &data)
+{
+	parser(0, LINK_RAW, std::make_range(data.data(), data.data() + data.size()));
+}
+
+void testShards(size_t queueBytes)
+{
+	const uint32_t FRAMES = 50; // per connection
+	received.clear();
+	nextShard = 0;
+	uint64_t stalls;
+	{
+		tcp::ShardedParser parser(SHARDS, newRecorder, queueBytes);
+
+		// Interleave the connections so each shard has several on the go
+		for (uint32_t n = 0; n < FRAMES; n++) {
+			for (uint32_t connection = 0; connection < CONNECTIONS; connection++) {
+				feed(parser, frame(connection, n));
+			}
+		}
+		EXPECT_EQ(parser.GetStats().frames, uint64_t(FRAMES) * CONNECTIONS);
+		EXPECT_EQ(parser.GetStats().dropped, 0u);
+		stalls = parser.GetStats().stalls;
+	}
+	EXPECT_EQ(nextShard.load(), SHARDS);
+
+	// Everything was delivered by the time the parser was destroyed
+	EXPECT_EQ(received.size(), size_t(FRAMES) * CONNECTIONS);
+	std::map<uint32_t, int> shardOf;
+	std::map<uint32_t, uint32_t> nextOf;
+	std::set<int> used;
+	for (auto &r : received) {
+		auto shard = shardOf.insert(std::make_pair(r.connection, r.shard)).first->second;
+		EXPECT_EQ(r.shard, shard);
+		EXPECT_EQ(r.n, nextOf[r.connection]++);
+		EXPECT_EQ(r.fromServer, r.n % 2 == 1);
+		used.insert(r.shard);
+	}
+	EXPECT_EQ(shardOf.size(), size_t(CONNECTIONS));
+
+	// With this many connections every shard gets some
+	EXPECT_EQ(used.size(), size_t(SHARDS));
+	printf("%d byte queues: %llu stalls\n", int(queueBytes), static_cast<unsigned long long>(stalls));
+}
+
+void testDropped()
+{
+	received.clear();
+	nextShard = 0;
+	{
+		// 1 KB queues take frames of up to 496 bytes
+		tcp::ShardedParser parser(SHARDS, newRecorder, 1024);
+		feed(parser, frame(1, 0));
+		feed(parser, frame(1, 1, 1000));
+		feed(parser, Bytes("not a frame"));
+		feed(parser, frame(1, 1));
+		EXPECT_EQ(parser.GetStats().frames, 4u);
+		EXPECT_EQ(parser.GetStats().dropped, 2u);
+	}
+	EXPECT_EQ(received.size(), 2u);
+	for (uint32_t i = 0; i < received.size(); i++) {
+		EXPECT_EQ(received[i].connection, 1u);
+		EXPECT_EQ(received[i].n, i);
+	}
+}
+
+} // namespace
+
+int main()
+{
+	testShards(4 << 20);
+	testShards(1024); // small enough that the capture thread has to wait
+	testDropped();
+	return TEST_RESULT();
+}
@@ -0,0 +1,200 @@
+// tcp::Stream reassembly through tcp::Parser: segments arrive reordered,
+// duplicated, overlapping and partially retransmitted, and the delivered byte
+// stream must match what was sent.
+
+#include "Test.h"
+#include "tcp/Parser.h"
+#include "tcp/Stream.h"
+
+#include "util.h"
+
+#include <algorithm>
+#include <random>
+
+using namespace test;
+
+namespace {
+
+const std::vector<uint8_t> CLIENT = { 10, 0, 0, 1 };
+const std::vector<uint8_t> SERVER = { 12, 130, 244, 193 };
+const uint16_t CLIENT_PORT = 40000;
+
+// What the stream's callback was given (one stream at a time)
+std::vector<uint8_t> delivered;
+bool closed = false;
+
+class Recorder : public tcp::Parser::Callback
+{
+public:
+	virtual void operator()(int64_t, std::range<const uint8_t *> data)
+	{
+		EXPECT(data.size() > 0);
+		delivered.insert(delivered.end(), data.begin(), data.end());
+	}
+
+	virtual ~Recorder() { closed = true; }
+};
+
+tcp::Parser::Callback::Ptr newRecorder(int64_t, tcp::Stream *)
+{
+	delivered.clear();
+	closed = false;
+	return std::make_unique<Recorder>();
+}
+
+struct Piece
+{
+	uint32_t offset; // from the first data byte
+	uint32_t size;
+	uint8_t flags;
+};
+
+void send(tcp::Parser &parser, uint32_t isn, const std::vector<uint8_t> &data, const Piece &piece)
+{
+	std::vector<uint8_t> payload(data.begin() + piece.offset, data.begin() + piece.offset + piece.size);
+	auto seq = piece.flags & TCP_SYN ? isn : isn + 1 + piece.offset;
+	auto frame = TcpFrame(LINK_RAW, CLIENT, SERVER, CLIENT_PORT, 3724, seq, piece.flags, payload);
+	parser(0, LINK_RAW, std::make_range<const uint8_t *>(frame.data(), frame.data() + frame.size()));
+}
+
+void sendAll(tcp::Parser &parser, uint32_t isn, const std::vector<uint8_t> &data, const std::vector<Piece> &pieces)
+{
+	for (auto &piece : pieces) {
+		send(parser, isn, data, piece);
+	}
+}
+
+std::vector<uint8_t> randomData(std::mt19937 &rng, size_t size)
+{
+	std::vector<uint8_t> data(size);
+	for (auto &b : data) {
+		b = uint8_t(rng());
+	}
+	return data;
+}
+
+Piece syn() { Piece p = { 0, 0, TCP_SYN }; return p; }
+Piece data(uint32_t offset, uint32_t size) { Piece p = { offset, size, TCP_ACK }; return p; }
+Piece fin(uint32_t offset) { Piece p = { offset, 0, TCP_FIN | TCP_ACK }; return p; }
+
+void testInOrder()
+{
+	std::mt19937 rng(1);
+	auto bytes = randomData(rng, 3000);
+	tcp::Parser parser(newRecorder);
+
+	Piece pieces[] = { syn(), data(0, 1000), data(1000, 1000), data(2000, 1000), fin(3000) };
+	sendAll(parser, 100, bytes, std::vector<Piece>(pieces, pieces + 5));
+	EXPECT(delivered == bytes);
+	EXPECT(closed);
+	EXPECT_EQ(parser.BufferedBytes(), 0u);
+}
+
+void testOverlaps()
+{
+	std::mt19937 rng(2);
+	auto bytes = randomData(rng, 3000);
+	tcp::Parser parser(newRecorder);
+
+	// A gap filled by a segment that also overlaps delivered and buffered
+	// data on both sides, then a retransmission straddling the next byte
+	Piece pieces[] = {
+		syn(),
+		data(0, 1000),
+		data(1500, 500),   // buffered
+		data(500, 1200),   // overlaps delivered, fills the gap, overlaps buffered
+		data(1900, 300),   // straddles the next byte
+		data(0, 2200),     // pure duplicate
+		data(2200, 800),
+		fin(3000),
+	};
+	sendAll(parser, 0xfffff000u, bytes, std::vector<Piece>(pieces, pieces + 8));
+	EXPECT(delivered == bytes);
+	EXPECT(closed);
+	EXPECT_EQ(parser.BufferedBytes(), 0u);
+}
+
+void testEarlyFin()
+{
+	std::mt19937 rng(3);
+	auto bytes = randomData(rng, 2000);
+	tcp::Parser parser(newRecorder);
+
+	// The FIN waits for the missing data
+	Piece pieces[] = { syn(), data(1000, 1000), fin(2000), fin(2000) };
+	sendAll(parser, 5, bytes, std::vector<Piece>(pieces, pieces + 4));
+	EXPECT(!closed);
+	send(parser, 5, bytes, data(0, 1000));
+	EXPECT(delivered == bytes);
+	EXPECT(closed);
+}
+
+void testLateFin()
+{
+	std::mt19937 rng(4);
+	auto bytes = randomData(rng, 2000);
+	tcp::Parser parser(newRecorder);
+
+	// A FIN for a point that's already been passed closes the stream right away
+	Piece pieces[] = { syn(), data(0, 2000) };
+	sendAll(parser, 5, bytes, std::vector<Piece>(pieces, pieces + 2));
+	EXPECT(!closed);
+	send(parser, 5, bytes, fin(1500));
+	EXPECT(delivered == bytes);
+	EXPECT(closed);
+}
+
+void testRandomized()
+{
+	std::mt19937 rng(12345);
+	for (auto trial = 0; trial < 500; trial++) {
+		auto size = uint32_t(1 + rng() % 20000);
+		auto bytes = randomData(rng, size);
+
+		// Cover the data once, then add retransmissions of random spans
+		// (overlapping whatever is around them) and duplicates
+		std::vector<Piece> pieces;
+		for (uint32_t offset = 0; offset < size; ) {
+			auto n = std::min(size - offset, uint32_t(1 + rng() % 1400));
+			pieces.push_back(data(offset, n));
+			offset += n;
+		}
+		auto extra = rng() % (pieces.size() + 1);
+		for (auto i = 0u; i < extra; i++) {
+			auto offset = uint32_t(rng() % size);
+			auto n = std::min(size - offset, uint32_t(1 + rng() % 2000));
+			pieces.push_back(data(offset, n));
+			if (rng() % 4 == 0) {
+				pieces.push_back(pieces[rng() % pieces.size()]);
+			}
+		}
+		pieces.push_back(fin(size));
+		std::shuffle(pieces.begin(), pieces.end(), rng);
+		pieces.insert(pieces.begin(), syn());
+
+		// Sequence numbers near the wrap point half the time
+		auto isn = trial % 2 ? uint32_t(0 - rng() % 40000) : uint32_t(rng());
+
+		tcp::Parser parser(newRecorder);
+		sendAll(parser, isn, bytes, pieces);
+		EXPECT(delivered == bytes);
+		EXPECT(closed);
+		EXPECT_EQ(parser.BufferedBytes(), 0u);
+		if (delivered != bytes || !closed) {
+			fprintf(stderr, "trial %d: %d bytes, isn %u, %d pieces\n", trial, int(size), isn, int(pieces.size()));
+			break;
+		}
+	}
+}
+
+} // namespace
+
+int main()
+{
+	testInOrder();
+	testOverlaps();
+	testEarlyFin();
+	testLateFin();
+	testRandomized();
+	return TEST_RESULT();
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+// Bare-bones checks for the unit tests (there's no test framework
+// dependency). Each test is its own program whose main returns
+// TEST_RESULT(), which is non-zero if any check failed.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static int testFailures = 0;
+
+#define EXPECT(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); testFailures++; } } while (0)
+#define EXPECT_EQ(a, b) do { if (!((a) == (b))) { fprintf(stderr, "%s:%d: failed: %s == %s (%lld vs %lld)\n", __FILE__, __LINE__, #a, #b, static_cast<long long>(a), static_cast<long long>(b)); testFailures++; } } while (0)
+#define TEST_RESULT() (testFailures == 0 ? 0 : (fprintf(stderr, "%d checks failed\n", testFailures), 1))
+
+namespace test {
+
+// Link types of the synthetic frames
+const int LINK_ETHERNET = 1; // DLT_EN10MB
+const int LINK_RAW = 12;     // DLT_RAW
+
+const uint8_t TCP_FIN = 0x01;
+const uint8_t TCP_SYN = 0x02;
+const uint8_t TCP_ACK = 0x10;
+
+inline void put16(std::vector<uint8_t> &out, uint16_t v) { out.push_back(uint8_t(v >> 8)); out.push_back(uint8_t(v)); }
+inline void put32(std::vector<uint8_t> &out, uint32_t v) { put16(out, uint16_t(v >> 16)); put16(out, uint16_t(v)); }
+
+// Builds a TCP segment in an IPv4 (4 byte addresses) or IPv6 (16 byte
+// addresses) packet, optionally behind an Ethernet header. Checksums are
+// left at zero since the parser doesn't check them.
+inline std::vector<uint8_t> TcpFrame(int linkType, const std::vector<uint8_t> &src, const std::vector<uint8_t> &dst,
+	uint16_t srcPort, uint16_t dstPort, uint32_t seq, uint8_t flags, const std::vector<uint8_t> &payload)
+{
+	std::vector<uint8_t> tcp;
+	put16(tcp, srcPort);
+	put16(tcp, dstPort);
+	put32(tcp, seq);
+	put32(tcp, 0);                // ack
+	tcp.push_back(5 << 4);        // data offset
+	tcp.push_back(flags);
+	put16(tcp, 65535);            // window
+	put32(tcp, 0);                // checksum, urgent pointer
+	tcp.insert(tcp.end(), payload.begin(), payload.end());
+
+	auto ipv6 = src.size() == 16;
+	std::vector<uint8_t> frame;
+	if (linkType == LINK_ETHERNET) {
+		frame.assign(12, 0);
+		put16(frame, ipv6 ? 0x86dd : 0x0800);
+	}
+
+	if (ipv6) {
+		put32(frame, 0x60000000);
+		put16(frame, uint16_t(tcp.size()));
+		frame.push_back(6);       // next header: TCP
+		frame.push_back(64);      // hop limit
+	} else {
+		frame.push_back(0x45);
+		frame.push_back(0);
+		put16(frame, uint16_t(20 + tcp.size()));
+		put32(frame, 0x4000);     // id, don't fragment
+		frame.push_back(64);      // ttl
+		frame.push_back(6);       // protocol: TCP
+		put16(frame, 0);          // checksum
+	}
+	frame.insert(frame.end(), src.begin(), src.end());
+	frame.insert(frame.end(), dst.begin(), dst.end());
+	frame.insert(frame.end(), tcp.begin(), tcp.end());
+	return frame;
+}
+
+inline std::vector<uint8_t> Bytes(const char *s) { return std::vector<uint8_t>(s, s + strlen(s)); }
+
+} // namespace test
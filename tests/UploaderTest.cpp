@@ -0,0 +1,374 @@
+// Uploader against a stand-in server on localhost: batching (by count and by
+// size), keep-alive reuse, games the server refuses and falling back to one
+// game per request when the server doesn't take batches.
+
+#include "Test.h"
+#include "File.h"
+#include "Uploader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace test;
+
+namespace {
+
+const std::string DATA_DIR = "UploaderTest.data";
+const std::string KEY = "testkey";
+
+// Answers uploads like the site does, remembering what it was sent
+class StubServer
+{
+public:
+	struct Request
+	{
+		std::string path;
+		int games;
+	};
+
+	StubServer()
+		: _listen(-1), _port(0), _thread(), _mu(), _batches(true), _refuse(), _requests(), _games(), _connections(0)
+	{
+		_listen = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(addr);
+		if (bind(_listen, reinterpret_cast<sockaddr *>(&addr), len) == -1 || listen(_listen, 4) == -1 ||
+			getsockname(_listen, reinterpret_cast<sockaddr *>(&addr), &len) == -1) {
+			perror("stub server");
+			exit(1);
+		}
+		_port = ntohs(addr.sin_port);
+		_thread = std::thread([this]() { Run(); });
+	}
+
+	~StubServer()
+	{
+		shutdown(_listen, SHUT_RDWR);
+		close(_listen);
+		_thread.join();
+	}
+
+	int Port() const { return _port; }
+
+	void SetBatches(bool batches) { std::lock_guard<std::mutex> lock(_mu); _batches = batches; }
+	void Refuse(const std::string &name) { std::lock_guard<std::mutex> lock(_mu); _refuse.insert(name); }
+
+	std::vector<Request> Requests() { std::lock_guard<std::mutex> lock(_mu); return _requests; }
+	std::map<std::string, std::string> Games() { std::lock_guard<std::mutex> lock(_mu); return _games; }
+	int Connections() { std::lock_guard<std::mutex> lock(_mu); return _connections; }
+
+	void Reset()
+	{
+		std::lock_guard<std::mutex> lock(_mu);
+		_requests.clear();
+		_games.clear();
+		_refuse.clear();
+		_connections = 0;
+	}
+
+private:
+	int _listen;
+	int _port;
+	std::thread _thread;
+	std::mutex _mu;
+	bool _batches;
+	std::set<std::string> _refuse;
+	std::vector<Request> _requests;
+	std::map<std::string, std::string> _games; // name (or request number) to contents
+	int _connections;
+
+	// One connection at a time is enough with a single upload thread
+	void Run()
+	{
+		while (1) {
+			auto fd = accept(_listen, nullptr, nullptr);
+			if (fd == -1) {
+				break;
+			}
+			{
+				std::lock_guard<std::mutex> lock(_mu);
+				_connections++;
+			}
+			std::string buffer;
+			while (Handle(fd, buffer)) {
+			}
+			close(fd);
+		}
+	}
+
+	bool Read(int fd, std::string &buffer)
+	{
+		char chunk[65536];
+		auto n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n <= 0) {
+			return false;
+		}
+		buffer.append(chunk, n);
+		return true;
+	}
+
+	bool Handle(int fd, std::string &buffer)
+	{
+		size_t headerEnd;
+		while ((headerEnd = buffer.find("\r\n\r\n")) == std::string::npos) {
+			if (!Read(fd, buffer)) {
+				return false;
+			}
+		}
+
+		auto headers = buffer.substr(0, headerEnd);
+		auto path = headers.substr(headers.find(' ') + 1);
+		path = path.substr(0, path.find(' '));
+		std::string lower(headers);
+		std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+		auto lengthAt = lower.find("content-length:");
+		size_t length = lengthAt == std::string::npos ? 0 : size_t(atol(lower.c_str() + lengthAt + 15));
+
+		while (buffer.size() < headerEnd + 4 + length) {
+			if (!Read(fd, buffer)) {
+				return false;
+			}
+		}
+		auto body = buffer.substr(headerEnd + 4, length);
+		buffer.erase(0, headerEnd + 4 + length);
+
+		int status;
+		std::string reply;
+		Answer(path, body, status, reply);
+
+		auto response = "HTTP/1.1 " + std::to_string(static_cast<long long>(status)) + " Stub\r\nContent-Length: " +
+			std::to_string(static_cast<long long>(reply.size())) + "\r\n\r\n" + reply;
+		return send(fd, response.data(), response.size(), MSG_NOSIGNAL) == ssize_t(response.size());
+	}
+
+	void Answer(const std::string &path, const std::string &body, int &status, std::string &reply)
+	{
+		std::lock_guard<std::mutex> lock(_mu);
+		Request request = { path, 0 };
+		status = 200;
+
+		if (path.find("key=" + KEY) == std::string::npos) {
+			status = 403;
+		} else if (path.compare(0, 14, "/upload/batch?") == 0) {
+			if (!_batches) {
+				status = 404;
+			} else {
+				// "HSLB" then <name length 4><name><type length 4><type><size 4><data> per game
+				EXPECT(body.compare(0, 4, "HSLB") == 0);
+				size_t pos = 4;
+				while (pos + 4 <= body.size()) {
+					auto name = String(body, pos);
+					String(body, pos); // content type
+					auto data = String(body, pos);
+					request.games++;
+					if (_refuse.count(name)) {
+						reply += "400 " + name + "\n";
+					} else {
+						_games[name] = data;
+						reply += "200 " + name + "\n";
+					}
+				}
+				EXPECT_EQ(pos, body.size());
+			}
+		} else if (path.compare(0, 8, "/upload?") == 0) {
+			// Single games aren't named, so they're matched by contents
+			request.games = 1;
+			_games["#" + std::to_string(static_cast<long long>(_requests.size()))] = body;
+		} else {
+			status = 404;
+		}
+		_requests.push_back(request);
+	}
+
+	static std::string String(const std::string &body, size_t &pos)
+	{
+		uint32_t size = 0;
+		if (pos + 4 <= body.size()) {
+			memcpy(&size, body.data() + pos, 4);
+		}
+		pos += 4;
+		auto s = body.substr(std::min(pos, body.size()), size);
+		pos += size;
+		return s;
+	}
+};
+
+// Writes count games of random contents into Logged/, returning name to contents
+std::map<std::string, std::string> makeGames(int count, size_t size)
+{
+	for (auto dir : { "Logged", "Uploaded" }) {
+		auto path = file::Join(DATA_DIR, dir);
+		for (auto &name : file::List(path, ".hsl")) {
+			file::Remove(file::Join(path, name));
+		}
+	}
+
+	static std::mt19937 rng(1);
+	std::map<std::string, std::string> games;
+	file::MakeDirs(file::Join(DATA_DIR, "Logged"));
+	for (auto i = 0; i < count; i++) {
+		auto name = std::to_string(static_cast<long long>(1400000000 + i)) + ".hsl";
+		std::string data(size + rng() % 100, 0);
+		for (auto &c : data) {
+			c = char(rng());
+		}
+		file::Write(file::Join(file::Join(DATA_DIR, "Logged"), name), reinterpret_cast<const uint8_t *>(data.data()), data.size());
+		games[name] = data;
+	}
+	return games;
+}
+
+Uploader::Settings settings(int port, int batchGames, size_t batchBytes)
+{
+	Uploader::Settings s;
+	s.host = "127.0.0.1";
+	s.port = port;
+	s.key = KEY;
+	s.dataDir = DATA_DIR;
+	s.threads = 1;
+	s.timeoutSeconds = 5;
+	s.batchGames = batchGames;
+	s.batchBytes = batchBytes;
+	return s;
+}
+
+// Uploads everything in Logged/, returning the change in the stats. It's all
+// queued before there's a key, so the batches don't depend on how quickly the
+// worker picks up the first game.
+Uploader::Stats uploadAll(Uploader::Settings s)
+{
+	auto before = Uploader::GetStats();
+	auto key = s.key;
+	s.key.clear();
+	Uploader::Start(s);
+	Uploader::AddPending();
+	Uploader::SetKey(key);
+	EXPECT(Uploader::Drain(10));
+	EXPECT(Uploader::Stop(5000));
+	auto after = Uploader::GetStats();
+
+	Uploader::Stats delta;
+	delta.requests = after.requests - before.requests;
+	delta.uploaded = after.uploaded - before.uploaded;
+	delta.rejected = after.rejected - before.rejected;
+	delta.retries = after.retries - before.retries;
+	delta.bytes = after.bytes - before.bytes;
+	return delta;
+}
+
+size_t listed(const char *dir)
+{
+	return file::List(file::Join(DATA_DIR, dir), ".hsl").size();
+}
+
+void testBatches(StubServer &server)
+{
+	server.Reset();
+	auto games = makeGames(10, 1000);
+	auto stats = uploadAll(settings(server.Port(), 4, 4 << 20));
+
+	// 4 + 4 + 2 over one kept-alive connection
+	auto requests = server.Requests();
+	EXPECT_EQ(requests.size(), 3u);
+	EXPECT_EQ(stats.requests, 3u);
+	for (size_t i = 0; i < requests.size(); i++) {
+		EXPECT(requests[i].path.compare(0, 13, "/upload/batch") == 0);
+		EXPECT_EQ(requests[i].games, (i < 2 ? 4 : 2));
+	}
+	EXPECT_EQ(server.Connections(), 1);
+
+	EXPECT_EQ(stats.uploaded, 10u);
+	EXPECT_EQ(stats.retries, 0u);
+	EXPECT(server.Games() == games);
+	EXPECT_EQ(listed("Logged"), 0u);
+	EXPECT_EQ(listed("Uploaded"), 10u);
+}
+
+void testBatchBytes(StubServer &server)
+{
+	server.Reset();
+	auto games = makeGames(10, 1000);
+
+	// Only two games fit under the limit, the rest wait for the next request
+	auto stats = uploadAll(settings(server.Port(), 32, 2500));
+	auto requests = server.Requests();
+	EXPECT_EQ(requests.size(), 5u);
+	for (auto &request : requests) {
+		EXPECT_EQ(request.games, 2);
+	}
+	EXPECT_EQ(stats.uploaded, 10u);
+	EXPECT(server.Games() == games);
+}
+
+void testRefused(StubServer &server)
+{
+	server.Reset();
+	auto games = makeGames(6, 500);
+	server.Refuse("1400000001.hsl");
+	server.Refuse("1400000004.hsl");
+
+	// Refused games stay in Logged/ and aren't retried
+	auto stats = uploadAll(settings(server.Port(), 8, 4 << 20));
+	EXPECT_EQ(server.Requests().size(), 1u);
+	EXPECT_EQ(stats.uploaded, 4u);
+	EXPECT_EQ(stats.rejected, 2u);
+	EXPECT_EQ(stats.retries, 0u);
+	EXPECT_EQ(listed("Logged"), 2u);
+	EXPECT(file::Exists(file::Join(file::Join(DATA_DIR, "Logged"), "1400000001.hsl")));
+	EXPECT_EQ(listed("Uploaded"), 4u);
+	EXPECT_EQ(server.Games().size(), 4u);
+}
+
+void testNoBatches(StubServer &server)
+{
+	// Run last: once the server says it doesn't take batches the uploader
+	// remembers that for the rest of the process
+	server.Reset();
+	server.SetBatches(false);
+	auto games = makeGames(5, 1000);
+	auto stats = uploadAll(settings(server.Port(), 4, 4 << 20));
+
+	auto requests = server.Requests();
+	EXPECT_EQ(requests.size(), 6u);
+	if (!requests.empty()) {
+		EXPECT(requests[0].path.compare(0, 13, "/upload/batch") == 0);
+	}
+	EXPECT_EQ(stats.uploaded, 5u);
+	EXPECT_EQ(listed("Uploaded"), 5u);
+
+	// Every game arrived intact (in some order)
+	std::multiset<std::string> sent, received;
+	for (auto &game : games) {
+		sent.insert(game.second);
+	}
+	for (auto &game : server.Games()) {
+		received.insert(game.second);
+	}
+	EXPECT(sent == received);
+}
+
+} // namespace
+
+int main()
+{
+	StubServer server;
+	testBatches(server);
+	testBatchBytes(server);
+	testRefused(server);
+	testNoBatches(server);
+	return TEST_RESULT();
+}